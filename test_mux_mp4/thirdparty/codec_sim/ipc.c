@@ -46,6 +46,17 @@ void ipc_run()
     ipc->run(ipc);
 }
 
+void ipc_stop()
+{
+    if (!ipc || !ipc->stop)
+    {
+        log_error("no ipc dev found!!!\n");
+        return;
+    }
+
+    ipc->stop(ipc);
+}
+
 int ipc_capture_picture(char *file)
 {
     if (!ipc | !ipc->capture_picture)
@@ -69,6 +80,40 @@ int ipc_dev_register(ipc_dev_t *dev)
     log_debug("Register dev");
 
     ipc = dev;
+    return 0;
 err:
     return -1;
 }
+
+ipc_dev_t *ipc_dev_get()
+{
+    return ipc;
+}
+
+ipc_dev_t *ipc_dev_new(const ipc_dev_t *type)
+{
+    ipc_dev_t *dev;
+    if (!type)
+    {
+        log_error("check param error\n");
+        return NULL;
+    }
+    dev = (ipc_dev_t *)malloc(sizeof(ipc_dev_t));
+    if (!dev)
+    {
+        log_error("malloc error\n");
+        return NULL;
+    }
+    *dev = *type;
+    dev->priv = NULL; // instance state is created by init()
+    return dev;
+}
+
+void ipc_dev_free(ipc_dev_t *dev)
+{
+    if (!dev)
+        return;
+    if (dev->deinit)
+        dev->deinit(dev);
+    free(dev);
+}
@@ -4,6 +4,7 @@
 #define IPC_H
 
 #include <stdint.h>
+#include "../framepool/framepool.h"
 
 typedef enum
 {
@@ -30,6 +31,11 @@ enum
     FRAME_TYPE_VIDEO
 };
 
+// Callback return: consumer can't take the frame now. Real-time capture drops
+// it, with virtual_clock the frame is delivered again after the consumer
+// calls resume()
+#define IPC_FRAME_BUSY 1
+
 typedef struct
 {
     uint8_t frame_type;
@@ -48,9 +54,15 @@ typedef struct
     char *video_file;
     char *pic_file;
     char *audio_file;
-    int (*video_cb)(uint8_t *frame, int len, int iskey, int64_t timestamp);
-    int (*audio_cb)(uint8_t *frame, int len, int64_t timestamp);
-    int (*event_cb)(int event, void *data);
+    // video frame: one access unit with its start codes, iskey if it holds an IDR (H.265 IRAP) picture
+    int (*video_cb)(uint8_t *frame, int len, int iskey, int64_t timestamp, void *user);
+    int (*audio_cb)(uint8_t *frame, int len, int64_t timestamp, void *user);
+    int (*event_cb)(int event, void *data, void *user);
+    void *user;              // passed to the callbacks
+    framepool_t *frame_pool; // optional: frames passed to the callbacks are then pool buffers,
+                             // a callback may keep one with framepool_ref(framepool_buf(frame))
+    int virtual_clock;       // simulator: emit frames as fast as callbacks take them, timestamps
+                             // advance by frame duration instead of following the wall clock
 } ipc_param_t;
 
 typedef struct ipc_dev_t
@@ -58,15 +70,30 @@ typedef struct ipc_dev_t
     int (*init)(struct ipc_dev_t *ipc, ipc_param_t *param);
     void (*run)(struct ipc_dev_t *ipc);
     int (*capture_picture)(struct ipc_dev_t *ipc, char *file);
+    void (*stop)(struct ipc_dev_t *ipc); // stop capture, no callbacks after return
     void (*deinit)(struct ipc_dev_t *ipc);
+    void (*resume)(struct ipc_dev_t *ipc); // consumer can take frames again after IPC_FRAME_BUSY, any thread
     void *priv;
 } ipc_dev_t;
 
 extern int ipc_init(ipc_param_t *param);
 extern void ipc_run();
+extern void ipc_stop();
 extern int ipc_dev_register(ipc_dev_t *dev);
 extern int ipc_capture_picture(char *file);
 
+/**
+ *   Registered device, used by the ipc_*() functions above
+ */
+extern ipc_dev_t *ipc_dev_get();
+
+/**
+ *   New instance of a device type, e.g. one per simulated camera: ipc_dev_new(&sim_ipc).
+ *   Use its init/run/stop ops directly, ipc_dev_free() deinits and frees it
+ */
+extern ipc_dev_t *ipc_dev_new(const ipc_dev_t *type);
+extern void ipc_dev_free(ipc_dev_t *dev);
+
 extern ipc_dev_t sim_ipc;
 
 #endif /*IPC_H*/
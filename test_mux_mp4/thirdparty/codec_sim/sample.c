@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include "ipc.h"
 #include "../thirdparty/log/log.h"
 
-int VideoFrameCallBack(uint8_t *frame, int len, int iskey, int64_t timestamp)
+int VideoFrameCallBack(uint8_t *frame, int len, int iskey, int64_t timestamp, void *user)
 {
     frame_info_t frame_info;
 
@@ -21,7 +23,7 @@ int VideoFrameCallBack(uint8_t *frame, int len, int iskey, int64_t timestamp)
     return 0;
 }
 
-int AudioFrameCallBack(uint8_t *frame, int len, int64_t timestamp)
+int AudioFrameCallBack(uint8_t *frame, int len, int64_t timestamp, void *user)
 {
     frame_info_t frame_info;
 
@@ -38,6 +40,8 @@ int AudioFrameCallBack(uint8_t *frame, int len, int64_t timestamp)
 
 int main()
 {
+    sigset_t set;
+    int sig;
 
     ipc_dev_register(&sim_ipc);
     log_set_level(LOG_DEBUG);
@@ -56,11 +60,17 @@ int main()
             .event_cb = NULL,
         };
 
+    // block before ipc_run(), so capture threads inherit the mask
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
     ipc_init(&param);
     ipc_run();
 
-    while (1)
-    {
-        sleep(2);
-    }
+    // sleep until Ctrl+C
+    sigwait(&set, &sig);
+    ipc_stop();
+    return 0;
 }
\ No newline at end of file
@@ -7,12 +7,38 @@
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include "../../thirdparty/log/log.h"
+#include "../../thirdparty/h264reader/h264reader.h"
 #include "ipc.h"
 
+enum
+{
+    SIM_STREAM_VIDEO,
+    SIM_STREAM_AUDIO,
+};
+
+// Elementary stream loaded once and indexed, frames (access units) are slices of it served in a loop
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    int mapped;       // data is mmap()ed, else read into memory
+    void *index;      // access units, H264IndexBuild()
+    int count;
+    int next;
+    unsigned long long slices; // nalTypes of coded slices: access units without them are not frames
+} sim_source_t;
+
 typedef struct
 {
     int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled on stop, wakes up sleeping tasks
+    pthread_t thread[3];
+    int thread_count;
     ipc_dev_t *dev;
     char *video_file;
     char *audio_file;
@@ -23,9 +49,20 @@ typedef struct
     int audio_sample;
 
     char *pic_file;
-    int (*video_cb)(uint8_t *frame, int len, int iskey, int64_t timestamp);
-    int (*audio_cb)(uint8_t *frame, int len, int64_t timestamp);
-    int (*event_cb)(int event, void *data);
+    int (*video_cb)(uint8_t *frame, int len, int iskey, int64_t timestamp, void *user);
+    int (*audio_cb)(uint8_t *frame, int len, int64_t timestamp, void *user);
+    int (*event_cb)(int event, void *data, void *user);
+    void *user;
+    framepool_t *frame_pool;
+
+    int virtual_clock;
+    int64_t clock_base;      // ms, timestamp of the first frames
+    int64_t start_us;        // CLOCK_MONOTONIC, frames are paced from it
+    int64_t stream_pts[2];   // us, virtual clock: time of each stream, INT64_MAX after it ends, under lock
+    pthread_cond_t advance;  // virtual clock: a stream advanced, or the consumer resumed
+    int waiting;             // tasks waiting on advance, under lock
+    unsigned resumes;        // resume() calls, written under lock
+    sim_source_t source;
 } sim_ipc_t;
 
 typedef struct _LinkADTSFixheader
@@ -197,7 +234,7 @@ static void *sim_ipc_video_task1(void *instance)
             }
 
             if (ipc->video_cb)
-                ipc->video_cb((uint8_t *)p_video_buf, frame_len, is_key_frame, timestamp);
+                ipc->video_cb((uint8_t *)p_video_buf, frame_len, is_key_frame, timestamp, ipc->user);
 
             p_video_buf += frame_len;
             timestamp += 40;
@@ -283,7 +320,7 @@ static void *sim_ipc_video_task2(void *instance)
 
             /* Callback */
             if (ipc->video_cb)
-                ipc->video_cb((uint8_t *)video_frame, video_frame_size, is_key_frame, timestamp);
+                ipc->video_cb((uint8_t *)video_frame, video_frame_size, is_key_frame, timestamp, ipc->user);
 
             log_warn("%ld", video_frame);
             timestamp += 40;
@@ -299,186 +336,266 @@ static void *sim_ipc_video_task2(void *instance)
 }
 #endif
 
-#define CACH_LEN (1024 * 1024)
-static uint8_t *g_cach[2] = {NULL, NULL};
-static FILE *fp_inH264 = NULL;
-static int icach = 0;
-static int ioffset = 0;
-static int bLoop = 0;
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define SIM_IPC_VIRTUAL_SKEW 100000 // us, virtual clock: audio and video stay this close, like a camera
 
-static int check_start_frame(uint8_t *buffer, int offset)
+static void sim_source_close(sim_source_t *s)
 {
-    static uint8_t startcode[4] = {0x00, 0x00, 0x00, 0x01};
-    return !memcmp(buffer + offset, startcode, 4);
+    if (s->data)
+    {
+        if (s->mapped)
+            munmap(s->data, s->size);
+        else
+            free(s->data);
+    }
+    H264IndexRemove(s->index);
+    memset(s, 0, sizeof(*s));
 }
 
-int get_one_frame(uint8_t *buf, int buf_len)
+/**
+ *   Map (or read) the file and index its access units with the h264reader splitter
+ */
+static int sim_source_open(sim_source_t *s, char *file, int hevc)
 {
-    int i = 0;
-    int start_point = ioffset;
-    int end_point = ioffset;
-    for (i = ioffset + 4; i <= CACH_LEN - 4; i++)
+    struct stat st;
+    const tH264IndexEntry *last;
+    int frames = 0, i;
+    int fd = open(file, O_RDONLY);
+
+    memset(s, 0, sizeof(*s));
+    if (fd < 0)
     {
-        if (check_start_frame(g_cach[icach], i))
-        {
-            start_point = ioffset;
-            end_point = i;
-            break;
-        }
+        log_error("open file %s error", file);
+        return -1;
     }
-
-    if (end_point - start_point > 0)
+    if (fstat(fd, &st) || st.st_size < 4)
     {
-        int data_len = end_point - start_point;
-        if (buf_len < data_len)
-        {
-            log_error("recv buffer too short, need %d byte", data_len);
-        }
-        memcpy(buf, g_cach[icach] + start_point, MIN(data_len, buf_len));
-        ioffset = end_point;
-        return MIN(data_len, buf_len);
+        log_error("input file %s is empty", file);
+        close(fd);
+        return -1;
     }
-    else
+    s->size = (size_t)st.st_size;
+    // private writable mapping: callbacks get uint8_t *, changes stay local
+    s->data = (uint8_t *)mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    s->mapped = s->data != MAP_FAILED;
+    if (!s->mapped)
     {
-        int old_len = CACH_LEN - start_point;
-        memcpy(g_cach[(icach + 1) % 2], g_cach[icach] + start_point, old_len);
-
-        int new_len = 0;
-        new_len = fread(g_cach[(icach + 1) % 2] + old_len, 1, CACH_LEN - (old_len), fp_inH264);
-        if (new_len < CACH_LEN - old_len)
+        size_t done = 0;
+        s->data = (uint8_t *)malloc(s->size);
+        while (s->data && done < s->size)
         {
-            if (bLoop)
-            {
-                fseek(fp_inH264, 0, SEEK_SET);
-                ioffset = 0;
-                icach = 0;
-                fread(g_cach[icach], 1, CACH_LEN, fp_inH264);
-                return get_one_frame(buf, buf_len);
-            }
-            else
-            {
-                if (new_len <= 0)
-                {
-                    return -1;
-                }
-                memset(g_cach[(icach + 1) % 2] + old_len + new_len, 0, CACH_LEN - old_len - new_len);
-            }
+            ssize_t n = read(fd, s->data + done, s->size - done);
+            if (n <= 0)
+                break;
+            done += (size_t)n;
+        }
+        if (!s->data || done < s->size)
+        {
+            log_error("can't load %s", file);
+            close(fd);
+            sim_source_close(s);
+            return -1;
         }
-        ioffset = 0;
-        icach = (icach + 1) % 2;
-        return get_one_frame(buf, buf_len);
-    }
-}
-
-int init(char *file_h264)
-{
-    g_cach[0] = (uint8_t *)malloc(CACH_LEN);
-    g_cach[1] = (uint8_t *)malloc(CACH_LEN);
-
-    fp_inH264 = fopen(file_h264, "r");
-    if (fp_inH264 == NULL)
-        return -1;
-    else
-    {
-        log_debug("open h264 file\n");
     }
-
-    if (fread(g_cach[icach], 1, CACH_LEN, fp_inH264) < CACH_LEN)
+    close(fd);
+
+    s->index = H264IndexBuild(file, hevc);
+    s->count = H264IndexCount(s->index);
+    s->slices = hevc ? 0xffffffffULL : 0x3eULL; // H.265 types 0..31, H.264 1..5
+    for (i = 0; i < s->count; i++)
+        frames += (H264IndexGet(s->index, i)->nalTypes & s->slices) != 0;
+    last = H264IndexGet(s->index, s->count - 1);
+    if (!frames || last->offset + last->size > (long long)s->size)
     {
-        log_error("input file too short");
+        log_error("no access units in %s", file);
+        sim_source_close(s);
         return -1;
     }
-
+    log_debug("%s: %d access units indexed, %d frames", file, s->count, frames);
     return 0;
 }
 
-int deinit()
+/**
+ *   Next access unit with a picture, from the start again after the last one
+ */
+static const tH264IndexEntry *sim_source_next(sim_source_t *s, uint8_t **frame)
 {
-    if (g_cach[0])
+    const tH264IndexEntry *e;
+    do
     {
-        free(g_cach[0]);
-        g_cach[0] = NULL;
-    }
-
-    if (g_cach[1])
-    {
-        free(g_cach[1]);
-        g_cach[1] = NULL;
-    }
+        e = H264IndexGet(s->index, s->next);
+        if (++s->next == s->count)
+            s->next = 0;
+    } while (!(e->nalTypes & s->slices));
+    *frame = s->data + e->offset;
+    return e;
+}
 
-    if (fp_inH264)
-    {
-        fclose(fp_inH264);
-        fp_inH264 = NULL;
-    }
+/**
+ *   CLOCK_MONOTONIC time, us
+ */
+static int64_t sim_ipc_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-int H264CheckNalType(uint8_t buff)
+/**
+ *   Sleep until CLOCK_MONOTONIC deadline (us) or stop, return 0 if stopped
+ */
+static int sim_ipc_sleep_until(sim_ipc_t *ipc, int64_t deadline_us)
 {
-    return (buff && 0x1F);
+    struct timespec ts;
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+    pthread_mutex_lock(&ipc->lock);
+    while (ipc->running && pthread_cond_timedwait(&ipc->cond, &ipc->lock, &ts) == 0)
+        ;
+    pthread_mutex_unlock(&ipc->lock);
+    return __atomic_load_n(&ipc->running, __ATOMIC_ACQUIRE);
 }
 
-static void *sim_ipc_video_task(void *instance)
+/**
+ *   Sleep for given time or until stop, return 0 if stopped
+ */
+static int sim_ipc_sleep(sim_ipc_t *ipc, long usec)
 {
-    sim_ipc_t *ipc = (sim_ipc_t *)instance;
+    return sim_ipc_sleep_until(ipc, sim_ipc_now_us() + usec);
+}
 
-    uint8_t *buffer = (uint8_t *)malloc(CACH_LEN);
+/**
+ *   Wake up tasks waiting on advance, called under lock
+ */
+static void sim_ipc_wake(sim_ipc_t *ipc)
+{
+    if (ipc->waiting)
+        pthread_cond_broadcast(&ipc->advance);
+}
 
-    while (ipc->running)
-    {
-        if (init(ipc->video_file))
-            return NULL;
+/**
+ *   Wait on advance, called under lock
+ */
+static void sim_ipc_wait(sim_ipc_t *ipc)
+{
+    ipc->waiting++;
+    pthread_cond_wait(&ipc->advance, &ipc->lock);
+    ipc->waiting--;
+}
 
-        int I_frame_cnt = 0;
-        struct timeval tv;
+/**
+ *   Set stream time, us. Virtual clock: the other stream may wait for it
+ */
+static void sim_ipc_advance(sim_ipc_t *ipc, int stream, int64_t pts_us)
+{
+    pthread_mutex_lock(&ipc->lock);
+    ipc->stream_pts[stream] = pts_us;
+    sim_ipc_wake(ipc);
+    pthread_mutex_unlock(&ipc->lock);
+}
 
-        int len = 0;
-        //while ((len = get_one_frame(buffer, CACH_LEN)) > 0)
-        while(1)
-        {
-            
-            len = get_one_frame(buffer, CACH_LEN);
-            if(len <= 0)
-            {
-                if (init(ipc->video_file))
-                    return NULL;
-            }
-            int is_key_frame = 0;
-            int frame_type = H264CheckNalType(buffer[4]);
-            if (frame_type == 5)
-            {
-                is_key_frame = 1;
-                I_frame_cnt++;
-            }
+/**
+ *   Wait until stream time pts_us (since run) and return the frame timestamp, ms.
+ *   Virtual clock does not wait for time: the stream runs as fast as the
+ *   callbacks take it, only held back for the other stream to catch up
+ */
+static int sim_ipc_pace(sim_ipc_t *ipc, int stream, int64_t pts_us, int64_t *timestamp)
+{
+    if (ipc->virtual_clock)
+    {
+        int running;
+        pthread_mutex_lock(&ipc->lock);
+        ipc->stream_pts[stream] = pts_us;
+        sim_ipc_wake(ipc);
+        while ((running = ipc->running) && pts_us - ipc->stream_pts[!stream] > SIM_IPC_VIRTUAL_SKEW)
+            sim_ipc_wait(ipc);
+        pthread_mutex_unlock(&ipc->lock);
+        *timestamp = ipc->clock_base + pts_us / 1000;
+        return running;
+    }
+    if (!sim_ipc_sleep_until(ipc, ipc->start_us + pts_us))
+        return 0;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    *timestamp = (int64_t)(tv.tv_sec) * 1000 + (int64_t)(tv.tv_usec) / 1000; // in milliseconds
+    return 1;
+}
 
-            gettimeofday(&tv, NULL);
-            uint64_t timestamp = (uint64_t)(tv.tv_sec) * 1000 + (uint64_t)(tv.tv_usec) / 1000; // in milliseconds
+int H264CheckNalType(uint8_t buff)
+{
+    return (buff & 0x1F);
+}
 
-            if (ipc->video_cb)
-                ipc->video_cb((uint8_t *)buffer, len, is_key_frame, timestamp);
+/**
+ *   Frame passed to the callbacks: a pool buffer the callback may keep if the app set a pool,
+ *   else the source data itself. Returns NULL if the pool is out of memory.
+ */
+static uint8_t *sim_ipc_frame(sim_ipc_t *ipc, uint8_t *data, int len, frame_buf_t **fb)
+{
+    *fb = NULL;
+    if (!ipc->frame_pool)
+        return data;
+    *fb = framepool_get(ipc->frame_pool, len);
+    if (!*fb)
+        return NULL;
+    memcpy((*fb)->data, data, len);
+    return (*fb)->data;
+}
 
-            // timestamp += 40;
+/**
+ *   Pass frame to the video (audio) callback. With virtual clock a busy consumer
+ *   gets the frame again after it resumes, else it is dropped. Return 0 if stopped
+ */
+static int sim_ipc_deliver(sim_ipc_t *ipc, uint8_t *data, int len, int video, int iskey, int64_t timestamp)
+{
+    frame_buf_t *fb;
+    // no copy without a pool: the frame is valid during the callback only
+    uint8_t *frame = sim_ipc_frame(ipc, data, len, &fb);
+    int ret = 0;
+    while (frame)
+    {
+        // a resume() during the callback is not missed
+        unsigned resumes = __atomic_load_n(&ipc->resumes, __ATOMIC_ACQUIRE);
+        if (video)
+            ret = ipc->video_cb(frame, len, iskey, timestamp, ipc->user);
+        else
+            ret = ipc->audio_cb(frame, len, timestamp, ipc->user);
+        if (ret != IPC_FRAME_BUSY || !ipc->virtual_clock)
+            break;
+        pthread_mutex_lock(&ipc->lock);
+        while (ipc->running && ipc->resumes == resumes)
+            sim_ipc_wait(ipc);
+        pthread_mutex_unlock(&ipc->lock);
+        if (!__atomic_load_n(&ipc->running, __ATOMIC_ACQUIRE))
+            break;
+    }
+    framepool_unref(fb);
+    return __atomic_load_n(&ipc->running, __ATOMIC_ACQUIRE);
+}
 
-            // if (frame_type == NALU_TYPE_AUD || frame_type == NALU_TYPE_DPA || frame_type == NALU_TYPE_DPB ||
-            //     frame_type == NALU_TYPE_DPC || frame_type == NALU_TYPE_EOSEQ || frame_type == NALU_TYPE_EOSTREAM ||
-            //     frame_type == NALU_TYPE_FILL || frame_type == NALU_TYPE_SEI || frame_type == NALU_TYPE_SLICE)
-            // {
-            long sleep = (1.0 / ipc->video_fps) * 1000 * 1000;
-            // log_debug("%d", ipc->video_fps);
-            // log_debug("Sleep: %ld", sleep);
-            usleep(sleep);
-            // usleep(40 * 1000); // fps = 1 / (0.04 s) = 25}
-            // }
-            
+static void *sim_ipc_video_task(void *instance)
+{
+    sim_ipc_t *ipc = (sim_ipc_t *)instance;
+    int64_t frames = 0;
 
+    if (sim_source_open(&ipc->source, ipc->video_file, ipc->video_codec == H265))
+        return NULL;
 
-        }
+    while (__atomic_load_n(&ipc->running, __ATOMIC_ACQUIRE))
+    {
+        uint8_t *data;
+        int64_t timestamp;
+        const tH264IndexEntry *au = sim_source_next(&ipc->source, &data);
 
-        free(buffer);
-        deinit();
+        // frames (access units) follow each other at video_fps
+        if (!sim_ipc_pace(ipc, SIM_STREAM_VIDEO, frames * 1000000 / ipc->video_fps, &timestamp))
+            break;
+        frames++;
+        // no copy: the frame is a slice of the source unless a pool is set
+        if (ipc->video_cb && !sim_ipc_deliver(ipc, data, au->size, 1, au->key, timestamp))
+            break;
     }
 
+    sim_source_close(&ipc->source);
     return NULL;
 }
 
@@ -536,12 +653,10 @@ void *sim_ipc_audio_task(void *param)
     int offset = 0;
     // int64_t timeStamp = 0;
 
-    int64_t interval = 0;
+    int64_t pts_us = 0; // stream time of the next frame
     int count = 0;
 
-    struct timeval tv;
-
-    while (ipc->running)
+    while (__atomic_load_n(&ipc->running, __ATOMIC_ACQUIRE))
     {
         LinkADTSFixheader fix;
         LinkADTSVariableHeader var;
@@ -552,29 +667,23 @@ void *sim_ipc_audio_task(void *param)
             int size = fix.protection_absent == 1 ? 7 : 9;
             // LOGI("size = %d\n", size );
             LinkParseAdtsVariableHeader((unsigned char *)(buf_ptr + offset), &var);
-            if (offset + size + var.aac_frame_length <= len)
+            if (offset + size + var.aac_frame_length <= len && fix.sampling_frequency_index < 13)
             {
-                if (ipc->audio_cb)
-                {
-                    count++;
-                    // log_debug("fix.sampling_frequency_index = %d", fix.sampling_frequency_index);
-
-                    // 1024 is number sample of each audio frame, 1000 for convert to ms
-                    interval = ((1024 * 1000.0) / aacfreq[fix.sampling_frequency_index]);
-                    // log_debug("interval = %ld", interval);
-                    // timeStamp += interval * count;
-
-                    gettimeofday(&tv, NULL);
-                    uint64_t timeStamp = (uint64_t)(tv.tv_sec) * 1000 + (uint64_t)(tv.tv_usec) / 1000; // in milliseconds
-
-                    // callback
-                    ipc->audio_cb((uint8_t *)buf_ptr + offset, var.aac_frame_length, timeStamp);
-                }
+                int64_t timeStamp;
+                if (!sim_ipc_pace(ipc, SIM_STREAM_AUDIO, pts_us, &timeStamp))
+                    break;
+                // 1024 is number sample of each audio frame
+                pts_us += 1024 * 1000000LL / aacfreq[fix.sampling_frequency_index];
+                count++;
+
+                // callback
+                if (ipc->audio_cb && !sim_ipc_deliver(ipc, (uint8_t *)buf_ptr + offset, var.aac_frame_length, 0, 0,
+                                                      timeStamp))
+                    break;
             }
 
             offset += var.aac_frame_length;
             // log_debug("var.aac_frame_length = %d\n", var.aac_frame_length);
-            usleep(interval * 10000);
         }
         else
         {
@@ -582,6 +691,8 @@ void *sim_ipc_audio_task(void *param)
         }
     }
 
+    free(buf_ptr);
+    fclose(fp);
     return NULL;
 }
 
@@ -602,7 +713,7 @@ int sim_ipc_init(struct ipc_dev_t *dev, ipc_param_t *param)
         log_error("check param error\n");
         return -1;
     }
-    sim = (sim_ipc_t *)malloc(sizeof(sim_ipc_t));
+    sim = (sim_ipc_t *)calloc(1, sizeof(sim_ipc_t));
     if (!sim)
     {
         log_error("malloc error\n");
@@ -610,6 +721,14 @@ int sim_ipc_init(struct ipc_dev_t *dev, ipc_param_t *param)
     }
 
     sim->running = 1;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&sim->lock, NULL);
+    pthread_cond_init(&sim->cond, &attr);
+    pthread_cond_init(&sim->advance, NULL);
+    pthread_condattr_destroy(&attr);
+    sim->thread_count = 0;
     sim->dev = dev;
     sim->audio_codec = param->audio_codec;
     sim->video_codec = param->video_codec;
@@ -622,6 +741,9 @@ int sim_ipc_init(struct ipc_dev_t *dev, ipc_param_t *param)
     sim->video_cb = param->video_cb;
     sim->audio_cb = param->audio_cb;
     sim->event_cb = param->event_cb;
+    sim->user = param->user;
+    sim->frame_pool = param->frame_pool;
+    sim->virtual_clock = param->virtual_clock;
     dev->priv = (void *)sim;
 
     return 0;
@@ -637,33 +759,78 @@ void *sim_ipc_motion_detect_task(void *arg)
         return NULL;
     }
 
-    for (;;)
+    while (sim_ipc_sleep(ipc, 5 * 1000000))
     {
-        sleep(5);
-        ipc->event_cb(EVENT_MOTION_DETECTION, NULL);
-        sleep(8);
-        ipc->event_cb(EVENT_MOTION_DETECTION_DISAPEER, NULL);
+        ipc->event_cb(EVENT_MOTION_DETECTION, NULL, ipc->user);
+        if (!sim_ipc_sleep(ipc, 8 * 1000000))
+            break;
+        ipc->event_cb(EVENT_MOTION_DETECTION_DISAPEER, NULL, ipc->user);
     }
     return NULL;
 }
 
+/**
+ *   Stream tasks, ended streams do not hold the other one back
+ */
+static void *sim_ipc_video_thread(void *arg)
+{
+    sim_ipc_video_task(arg);
+    sim_ipc_advance((sim_ipc_t *)arg, SIM_STREAM_VIDEO, INT64_MAX);
+    return NULL;
+}
+
+static void *sim_ipc_audio_thread(void *arg)
+{
+    sim_ipc_audio_task(arg);
+    sim_ipc_advance((sim_ipc_t *)arg, SIM_STREAM_AUDIO, INT64_MAX);
+    return NULL;
+}
+
 void sim_ipc_run(ipc_dev_t *dev)
 {
-    pthread_t thread;
+    sim_ipc_t *sim = (sim_ipc_t *)dev->priv;
+    void *(*task[3])(void *) = {sim_ipc_video_thread, sim_ipc_audio_thread, sim_ipc_motion_detect_task};
+    int i;
+    struct timeval tv;
     log_debug("===> Create threads ");
-    int ret = pthread_create(&thread, NULL, sim_ipc_video_task, dev->priv);
-    if (ret != 0)
-        log_error("Create thread fail");
-    ret = pthread_create(&thread, NULL, sim_ipc_audio_task, dev->priv);
-    if (ret != 0)
-        log_error("Create thread fail");
-    ret = pthread_create(&thread, NULL, sim_ipc_motion_detect_task, dev->priv);
-    if (ret != 0)
-        log_error("Create thread fail");
-    else
+    // streams share the clock: first audio and video frames have the same timestamp
+    gettimeofday(&tv, NULL);
+    sim->clock_base = (int64_t)(tv.tv_sec) * 1000 + (int64_t)(tv.tv_usec) / 1000;
+    sim->start_us = sim_ipc_now_us();
+    sim->stream_pts[SIM_STREAM_VIDEO] = 0;
+    sim->stream_pts[SIM_STREAM_AUDIO] = 0;
+    for (i = 0; i < 3; i++)
+    {
+        if (pthread_create(&sim->thread[sim->thread_count], NULL, task[i], sim) != 0)
+        {
+            log_error("Create thread fail");
+            if (i < 2)
+                sim_ipc_advance(sim, i, INT64_MAX);
+        }
+        else
+            sim->thread_count++;
+    }
+    if (sim->thread_count == 3)
         log_debug("===> Create thread ok");
 }
 
+void sim_ipc_stop(ipc_dev_t *dev)
+{
+    sim_ipc_t *sim = (sim_ipc_t *)dev->priv;
+    int i;
+    log_debug("Sim ipc stop");
+    if (!sim)
+        return;
+    pthread_mutex_lock(&sim->lock);
+    __atomic_store_n(&sim->running, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&sim->cond);
+    pthread_cond_broadcast(&sim->advance);
+    pthread_mutex_unlock(&sim->lock);
+    for (i = 0; i < sim->thread_count; i++)
+        pthread_join(sim->thread[i], NULL);
+    sim->thread_count = 0;
+}
+
 int sim_ipc_capture_picture(ipc_dev_t *dev, char *file)
 {
     sim_ipc_t *sim = (sim_ipc_t *)dev->priv;
@@ -687,17 +854,33 @@ int sim_ipc_capture_picture(ipc_dev_t *dev, char *file)
     system(buf);
     if (sim->event_cb)
     {
-        sim->event_cb(EVENT_CAPTURE_PICTURE_SUCCESS, file);
+        sim->event_cb(EVENT_CAPTURE_PICTURE_SUCCESS, file, sim->user);
     }
     return 0;
 }
 
+void sim_ipc_resume(ipc_dev_t *dev)
+{
+    sim_ipc_t *sim = (sim_ipc_t *)dev->priv;
+    if (!sim)
+        return;
+    pthread_mutex_lock(&sim->lock);
+    __atomic_store_n(&sim->resumes, sim->resumes + 1, __ATOMIC_RELEASE);
+    sim_ipc_wake(sim);
+    pthread_mutex_unlock(&sim->lock);
+}
+
 void sim_ipc_deinit(ipc_dev_t *dev)
 {
     log_debug("Sim ipc deiinit");
     if (dev->priv)
     {
+        sim_ipc_stop(dev);
+        pthread_mutex_destroy(&((sim_ipc_t *)dev->priv)->lock);
+        pthread_cond_destroy(&((sim_ipc_t *)dev->priv)->cond);
+        pthread_cond_destroy(&((sim_ipc_t *)dev->priv)->advance);
         free(dev->priv);
+        dev->priv = NULL;
     }
 }
 
@@ -707,6 +890,8 @@ ipc_dev_t sim_ipc =
         .deinit = sim_ipc_deinit,
         .capture_picture = sim_ipc_capture_picture,
         .run = sim_ipc_run,
+        .stop = sim_ipc_stop,
+        .resume = sim_ipc_resume,
 };
 
 /**NOTE - This function auto call before main() is excuted*/
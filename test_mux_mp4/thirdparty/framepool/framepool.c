@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../log/log.h"
+#include "framepool.h"
+
+struct framepool
+{
+    pthread_mutex_t lock;
+    frame_buf_t *free_list[FRAMEPOOL_CLASSES];
+    unsigned free_count[FRAMEPOOL_CLASSES];
+    unsigned class_in_use[FRAMEPOOL_CLASSES];
+    unsigned max_free;
+    int destroyed;          // freed by the last framepool_unref()
+    framepool_stats_t stats;
+};
+
+static int framepool_class(int size)
+{
+    int c = 0;
+    while (c < FRAMEPOOL_CLASSES && (FRAMEPOOL_MIN_SIZE << c) < size)
+        c++;
+    return c < FRAMEPOOL_CLASSES ? c : -1;
+}
+
+static void framepool_free_lists(framepool_t *pool)
+{
+    int c;
+    for (c = 0; c < FRAMEPOOL_CLASSES; c++)
+    {
+        while (pool->free_list[c])
+        {
+            frame_buf_t *buf = pool->free_list[c];
+            pool->free_list[c] = buf->next;
+            free(buf);
+        }
+        pool->free_count[c] = 0;
+    }
+    pool->stats.bytes_free = 0;
+}
+
+framepool_t *framepool_create(unsigned max_free)
+{
+    framepool_t *pool = (framepool_t *)calloc(1, sizeof(framepool_t));
+    if (!pool)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_free = max_free ? max_free : FRAMEPOOL_MAX_FREE;
+    return pool;
+}
+
+frame_buf_t *framepool_get(framepool_t *pool, int size)
+{
+    frame_buf_t *buf = NULL;
+    int c = framepool_class(size);
+    framepool_stats_t *s;
+
+    if (!pool || size < 0)
+        return NULL;
+    pthread_mutex_lock(&pool->lock);
+    s = &pool->stats;
+    s->gets++;
+    if (c >= 0 && pool->free_list[c])
+    {
+        buf = pool->free_list[c];
+        pool->free_list[c] = buf->next;
+        pool->free_count[c]--;
+        s->bytes_free -= buf->capacity;
+        s->hits++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!buf)
+    {
+        // header and data in one block, so framepool_buf() finds the header
+        int capacity = c >= 0 ? FRAMEPOOL_MIN_SIZE << c : size;
+        buf = (frame_buf_t *)malloc(sizeof(frame_buf_t) + capacity);
+        if (!buf)
+        {
+            log_error("can't allocate %d bytes frame", capacity);
+            return NULL;
+        }
+        buf->data = (uint8_t *)(buf + 1);
+        buf->capacity = capacity;
+        buf->size_class = c;
+        buf->pool = pool;
+    }
+    buf->size = size;
+    buf->refs = 1;
+    buf->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    s->in_use++;
+    if (s->in_use > s->in_use_high)
+        s->in_use_high = s->in_use;
+    s->bytes_in_use += buf->capacity;
+    if (s->bytes_in_use > s->bytes_high)
+        s->bytes_high = s->bytes_in_use;
+    if (c >= 0 && ++pool->class_in_use[c] > s->class_high[c])
+        s->class_high[c] = pool->class_in_use[c];
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+}
+
+frame_buf_t *framepool_buf(const void *data)
+{
+    return data ? (frame_buf_t *)data - 1 : NULL;
+}
+
+void framepool_ref(frame_buf_t *buf)
+{
+    if (buf)
+        __atomic_fetch_add(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void framepool_unref(frame_buf_t *buf)
+{
+    framepool_t *pool;
+    framepool_stats_t *s;
+    int c, last;
+
+    if (!buf || __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    pool = buf->pool;
+    c = buf->size_class;
+    pthread_mutex_lock(&pool->lock);
+    s = &pool->stats;
+    s->in_use--;
+    s->bytes_in_use -= buf->capacity;
+    if (c >= 0)
+        pool->class_in_use[c]--;
+    if (c >= 0 && !pool->destroyed && pool->free_count[c] < pool->max_free)
+    {
+        buf->next = pool->free_list[c];
+        pool->free_list[c] = buf;
+        pool->free_count[c]++;
+        s->bytes_free += buf->capacity;
+        buf = NULL;
+    }
+    last = pool->destroyed && !s->in_use;
+    pthread_mutex_unlock(&pool->lock);
+    free(buf);
+    if (last)
+    {
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+    }
+}
+
+void framepool_stats(framepool_t *pool, framepool_stats_t *stats)
+{
+    if (!pool || !stats)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void framepool_destroy(framepool_t *pool)
+{
+    unsigned in_use;
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    framepool_free_lists(pool);
+    pool->destroyed = 1;
+    in_use = pool->stats.in_use;
+    pthread_mutex_unlock(&pool->lock);
+    if (in_use)
+    {
+        // pool may be gone already
+        log_warn("frame pool destroyed with %u buffers in use", in_use);
+        return;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
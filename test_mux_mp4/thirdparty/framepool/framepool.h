@@ -0,0 +1,84 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *   Pool of reference counted frame buffers in power of 2 size classes.
+ *   Capture fills a buffer once and every stage after it (queue, muxer) takes
+ *   a reference instead of a copy; released buffers are reused, so steady
+ *   state recording does not allocate. Thread-safe
+ */
+
+// Smallest size class, bytes
+#define FRAMEPOOL_MIN_SIZE 1024
+
+// Number of size classes: 1 KB .. 2 MB, larger frames are allocated directly
+#define FRAMEPOOL_CLASSES 12
+
+// Default number of free buffers kept per class
+#define FRAMEPOOL_MAX_FREE 32
+
+typedef struct framepool framepool_t;
+
+typedef struct frame_buf
+{
+    uint8_t *data;
+    int size;               // bytes used, set by the producer
+    int capacity;
+    int refs;
+    int size_class;         // -1 if larger than the last class
+    framepool_t *pool;
+    struct frame_buf *next; // in free list
+} frame_buf_t;
+
+typedef struct
+{
+    uint64_t gets;          // framepool_get() calls
+    uint64_t hits;          // served by a free buffer
+    unsigned in_use;        // buffers not released
+    unsigned in_use_high;   // high-water mark of in_use
+    size_t bytes_in_use;    // capacity of buffers in use
+    size_t bytes_high;      // high-water mark of bytes_in_use
+    size_t bytes_free;      // capacity of free buffers
+    unsigned class_high[FRAMEPOOL_CLASSES]; // high-water mark of buffers in use per class
+} framepool_stats_t;
+
+/**
+ *   Create pool, max_free is number of free buffers kept per class (0 - default)
+ *
+ *   return pool, or NULL on failure
+ */
+extern framepool_t *framepool_create(unsigned max_free);
+
+/**
+ *   Get buffer for at least size bytes with one reference, size field is set
+ *
+ *   return buffer, or NULL on failure
+ */
+extern frame_buf_t *framepool_get(framepool_t *pool, int size);
+
+/**
+ *   Buffer of data returned in frame_buf_t::data
+ */
+extern frame_buf_t *framepool_buf(const void *data);
+
+extern void framepool_ref(frame_buf_t *buf);
+
+/**
+ *   Drop reference, last one returns buffer to the pool
+ */
+extern void framepool_unref(frame_buf_t *buf);
+
+/**
+ *   Snapshot of pool counters; hit rate is hits / gets
+ */
+extern void framepool_stats(framepool_t *pool, framepool_stats_t *stats);
+
+/**
+ *   Free the pool; if buffers are still referenced it is freed with the last one
+ */
+extern void framepool_destroy(framepool_t *pool);
+
+#endif /*FRAMEPOOL_H*/
@@ -16,90 +16,165 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "h264reader.h"
 
-#define DEF_H264_DELIMITER 0x01000000
+#define DEF_H264_BUF_SIZE (1024 * 1024)
+
+/* NAL types of slices */
+#define DEF_H264_VCL_TYPES 0x3eULL
+#define DEF_H265_VCL_TYPES 0xffffffffULL
+
+/* Index sidecar: header, then one record per access unit, little endian */
+#define DEF_H264_INDEX_MAGIC "H26XIDX1"
+#define DEF_H264_INDEX_HEADER 32 /* magic, mode, count, source size, reserved */
+#define DEF_H264_INDEX_RECORD 24 /* offset, size, flags, NAL types */
+
 typedef struct tH264FrameBuf
 {
-    void *data;
-    int curSize;
+    unsigned char *data;
+    int curSize;    /* bytes in data */
     int maxSize;
+    int frameStart; /* start code of the frame being built */
+    int frameEnd;   /* end of the frame returned last, released on the next call */
+    int nalHdr;     /* header byte of the last NAL of the frame being built */
+    int scanPos;    /* next byte checked for a start code, every byte is checked once */
+    int synced;     /* first start code found */
+    int mode;
+    int eof;
+    long long fileOffset;           /* file offset of data[0] */
+    long long frameOffset;          /* file offset of the frame returned last */
+    unsigned long long nalTypes;    /* NAL types in the frame being built */
+    unsigned long long frameTypes;  /* NAL types in the frame returned last */
     FILE *pFile;
 } tH264FrameBuf;
 
+typedef struct tH264Index
+{
+    tH264IndexEntry *entry;
+    int count;
+    int maxCount;
+    int mode;
+    long long sourceSize;
+} tH264Index;
+
 /*
- * PURPOSE : Export 1 H264 frame from reader
- * INPUT   : [reader] - Reader pointer
- * OUTPUT  : [data]   - Frame pointer
- *           [size]   - Frame size
- * RETURN  : Frame size
+ * PURPOSE : Find start code
+ * INPUT   : [r]     - Reader
+ *           [from]  - First byte checked for the 0x01 of a start code
+ *           [lower] - Start code can't begin before this byte
+ * OUTPUT  : [pos]   - Start code position, 3 or 4 bytes long
+ * RETURN  : Position of the 0x01, -1 if not found
  * DESCRIPT: None
  */
 static int
-H264FileReaderFrameExport(void *reader, void *data, int *size)
+H264FileReaderFindStart(tH264FrameBuf *r, int from, int lower, int *pos)
 {
-    int i = 0;
-    tH264FrameBuf *r = (tH264FrameBuf *)reader;
-    char *buf = (char *)(r->data);
-    int syncWord = 0;
-    char *pSOF = NULL;
-    char *pEOF = NULL;
-    int iFrameSize = 0;
+    unsigned char *p;
+    unsigned char *end = r->data + r->curSize;
 
-    /* Find first sync word */
-    for (i = 0; i < r->curSize - 4; i++)
+    if (from < lower + 2)
+        from = lower + 2;
+    for (p = r->data + from; p < end && (p = memchr(p, 0x01, end - p)) != NULL; p++)
     {
-        memcpy(&syncWord, buf + i, 4);
-        if (syncWord == DEF_H264_DELIMITER)
+        if (p[-1] == 0 && p[-2] == 0)
         {
-            pSOF = buf + i;
-            break;
+            int i = p - r->data;
+            *pos = (i - 3 >= lower && p[-3] == 0) ? i - 3 : i - 2;
+            return i;
         }
     }
+    return -1;
+}
 
-    /* Exit if not found */
-    if (pSOF == NULL)
-        return 0;
-    else if (pSOF != buf)
+/*
+ * PURPOSE : Check if NAL begins a new access unit (ITU-T H.264 7.4.1.2.3)
+ * INPUT   : [hdr]   - NAL header
+ *           [avail] - Bytes available from hdr
+ * OUTPUT  : None
+ * RETURN  : 1 if the NAL starts a new access unit after a slice
+ * DESCRIPT: None
+ */
+static int
+H264FileReaderAuStart(const unsigned char *hdr, int avail, int hevc)
+{
+    int type;
+
+    if (avail < 1)
+        return 1;
+    if (hevc)
     {
-        /* Move to index 0 */
-        memmove(r->data, pEOF, ((buf + r->curSize) - pSOF));
-        r->curSize = r->curSize - (pSOF - buf);
-        pSOF = buf;
+        /* ITU-T H.265 7.4.2.4.4, first_slice_segment_in_pic_flag follows the 2 byte header */
+        type = (hdr[0] >> 1) & 0x3f;
+        if (type < 32)
+            return avail < 3 || (hdr[2] & 0x80);
+        return (type >= 32 && type <= 35) || type == 39 || (type >= 41 && type <= 44) ||
+               (type >= 48 && type <= 55);
     }
-
-    /* Search next sync word */
-    for (i = 4; i < r->curSize - 4; i++)
+    type = hdr[0] & 0x1f;
+    if (type == 1 || type == 5)
     {
-        memcpy(&syncWord, buf + i, 4);
-        if (syncWord == DEF_H264_DELIMITER)
-        {
-            pEOF = buf + i;
-            iFrameSize = pEOF - pSOF;
-            if (iFrameSize < 100)
-                continue;
-            else
-                break;
-        }
+        /* first_mb_in_slice == 0: ue(v) starts with a 1 bit */
+        return avail < 2 || (hdr[1] & 0x80);
     }
+    return (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+}
 
-    /* Move data out */
-    if (pEOF != NULL)
+/*
+ * PURPOSE : Add NAL type to the frame being built
+ * INPUT   : [r] - Reader, nalHdr is the NAL header
+ * OUTPUT  : None
+ * RETURN  : None
+ * DESCRIPT: None
+ */
+static void
+H264FileReaderAddNal(tH264FrameBuf *r)
+{
+    int hdr = r->data[r->nalHdr];
+    int type = (r->mode & H264_READER_HEVC) ? (hdr >> 1) & 0x3f : hdr & 0x1f;
+    r->nalTypes |= 1ULL << type;
+}
+
+/*
+ * PURPOSE : Read more data
+ * INPUT   : [r] - Reader
+ * OUTPUT  : None
+ * RETURN  : Bytes read. 0 if EOF, -1 on error
+ * DESCRIPT: Only the frame being built is moved to the front, and the buffer
+ *           grows to twice its size, so no byte is moved more often than read
+ */
+static int
+H264FileReaderFill(tH264FrameBuf *r)
+{
+    int keep = r->curSize - r->frameStart;
+    int readSize = 0;
+
+    if (r->frameStart > 0)
     {
-        iFrameSize = pEOF - pSOF;
-        if (size)
-        {
-            if (*size < iFrameSize)
-                return 0;
-            *size = iFrameSize;
-        }
-        if (data)
-            memmove(data, pSOF, iFrameSize);
-        memmove(r->data, pEOF, r->curSize - iFrameSize);
-        r->curSize = r->curSize - iFrameSize;
-        return iFrameSize;
+        memmove(r->data, r->data + r->frameStart, keep);
+        r->nalHdr -= r->frameStart;
+        r->scanPos -= r->frameStart;
+        r->fileOffset += r->frameStart;
+        r->curSize = keep;
+        r->frameStart = 0;
     }
-    return 0;
+    if (keep > r->maxSize / 2)
+    {
+        unsigned char *data = realloc(r->data, r->maxSize * 2);
+        if (data == NULL)
+            return -1;
+        r->data = data;
+        r->maxSize *= 2;
+    }
+    readSize = fread(r->data + r->curSize, sizeof(char), r->maxSize - r->curSize, r->pFile);
+    if (readSize == 0)
+    {
+        if (ferror(r->pFile))
+            return -1;
+        r->eof = 1;
+    }
+    r->curSize += readSize;
+    return readSize;
 }
 
 /*
@@ -143,7 +218,7 @@ H264FileReaderCreate(char *fileName)
     if (fileName == NULL)
         return NULL;
 
-    tH264FrameBuf *reader = malloc(sizeof(tH264FrameBuf));
+    tH264FrameBuf *reader = calloc(1, sizeof(tH264FrameBuf));
     if (reader == NULL)
         return NULL;
 
@@ -154,9 +229,9 @@ H264FileReaderCreate(char *fileName)
         return NULL;
     }
 
-    reader->curSize = 0;
-    reader->maxSize = (1024 * 1024);
-    reader->data = (void *)malloc(sizeof(char) * reader->maxSize);
+    reader->maxSize = DEF_H264_BUF_SIZE;
+    reader->mode = H264_READER_AU;
+    reader->data = malloc(sizeof(char) * reader->maxSize);
     if (reader->data == NULL)
     {
         H264FileReaderRemove(reader);
@@ -166,59 +241,439 @@ H264FileReaderCreate(char *fileName)
 }
 
 /*
- * PURPOSE : Read 1 H264 frame from file
+ * PURPOSE : Set what a frame is
  * INPUT   : [reader] - Reader pointer
- * OUTPUT  : [data]   - Frame pointer
- *           [size]   - Frame size
- * RETURN  : Frame size. 0 if EOF
+ *           [mode]   - H264_READER_NAL or H264_READER_AU, | H264_READER_HEVC for H265
+ * OUTPUT  : None
+ * RETURN  : None
  * DESCRIPT: None
  */
-int H264FileReaderGetFrame(void *reader, void *data, int *size)
+void H264FileReaderSetMode(void *reader, int mode)
+{
+    if (reader)
+        ((tH264FrameBuf *)reader)->mode = mode;
+}
+
+/*
+ * PURPOSE : Read 1 H264 frame from file without copy
+ * INPUT   : [reader] - Reader pointer
+ * OUTPUT  : [frame]  - Frame in the reader buffer, valid until the next call
+ * RETURN  : Frame size. 0 if EOF, < 0 on error
+ * DESCRIPT: None
+ */
+int H264FileReaderNextFrame(void *reader, const unsigned char **frame)
 {
     tH264FrameBuf *r = NULL;
-    int readSize = 0;
-    int iRetCode = 0;
+    unsigned long long vclTypes = 0;
+    int pos = 0;
+    int i = 0;
 
     /* Check input */
-    if (reader == NULL)
+    if (reader == NULL || frame == NULL)
         return -1;
     r = (tH264FrameBuf *)reader;
-    do
+    r->frameStart = r->frameEnd;
+    vclTypes = (r->mode & H264_READER_HEVC) ? DEF_H265_VCL_TYPES : DEF_H264_VCL_TYPES;
+
+    /* Skip data before the first start code, keep what may be a split one */
+    while (!r->synced)
     {
-        readSize = fread(r->data + r->curSize, sizeof(char), r->maxSize - r->curSize, r->pFile);
-        if (readSize < 0)
+        i = H264FileReaderFindStart(r, r->scanPos, r->frameStart, &pos);
+        if (i >= 0)
         {
-            iRetCode = -2;
+            r->frameStart = pos;
+            r->nalHdr = i + 1;
+            r->scanPos = i + 1;
+            r->synced = 1;
             break;
         }
-        else if (readSize == 0)
+        r->scanPos = r->curSize;
+        if (r->curSize - r->frameStart > 3)
+            r->frameStart = r->curSize - 3;
+        i = r->eof ? 0 : H264FileReaderFill(r);
+        if (i <= 0)
+            return i < 0 ? -2 : 0;
+    }
+
+    for (;;)
+    {
+        i = H264FileReaderFindStart(r, r->scanPos, r->nalHdr, &pos);
+        if (i >= 0 && (i + 3 < r->curSize || r->eof))
         {
-            iRetCode = 0;
-            break;
+            int next = i + 1;
+
+            H264FileReaderAddNal(r);
+            r->nalHdr = next;
+            r->scanPos = next;
+            if (!(r->mode & H264_READER_AU) ||
+                ((r->nalTypes & vclTypes) &&
+                 H264FileReaderAuStart(r->data + next, r->curSize - next, r->mode & H264_READER_HEVC)))
+            {
+                r->frameEnd = pos;
+                break;
+            }
+            continue;
         }
+        if (i < 0)
+            r->scanPos = r->curSize;
         else
+            r->scanPos = i; /* NAL header not read yet */
+        if (r->eof)
         {
-            r->curSize += readSize;
-            iRetCode = H264FileReaderFrameExport(reader, data, size);
-            if (iRetCode > 0)
-                break;
-            else
-            {
-                r->data = realloc(r->data, r->maxSize + 1024 * 1024);
-                if (r->data)
-                {
-                    r->maxSize += 1024 * 1024;
-                    continue;
-                }
-                else
-                {
-                    iRetCode = 0;
-                    break;
-                }
-            }
+            if (r->nalHdr < r->curSize && r->curSize > r->frameStart)
+                H264FileReaderAddNal(r);
+            r->frameEnd = r->curSize;
+            r->nalHdr = r->curSize;
+            break;
+        }
+        if (H264FileReaderFill(r) < 0)
+            return -2;
+    }
+
+    r->frameOffset = r->fileOffset + r->frameStart;
+    r->frameTypes = r->nalTypes;
+    r->nalTypes = 0;
+    *frame = r->data + r->frameStart;
+    return r->frameEnd - r->frameStart;
+}
+
+/*
+ * PURPOSE : Read 1 H264 frame from file
+ * INPUT   : [reader] - Reader pointer
+ * OUTPUT  : [data]   - Frame pointer
+ *           [size]   - Frame size
+ * RETURN  : Frame size. 0 if EOF, < 0 on error, -3 if the frame is bigger
+ *           than *size: *size is set to the frame size, and the next call
+ *           reads the same frame
+ * DESCRIPT: None
+ */
+int H264FileReaderGetFrame(void *reader, void *data, int *size)
+{
+    const unsigned char *frame = NULL;
+    int frameSize = H264FileReaderNextFrame(reader, &frame);
+
+    if (frameSize <= 0)
+        return frameSize;
+    if (size)
+    {
+        if (*size < frameSize)
+        {
+            /* Read the frame again from its start code on a retry */
+            *size = frameSize;
+            if (H264FileReaderSeek(reader, ((tH264FrameBuf *)reader)->frameOffset))
+                return -2;
+            return -3;
+        }
+        *size = frameSize;
+    }
+    if (data)
+        memcpy(data, frame, frameSize);
+    return frameSize;
+}
+
+/*
+ * PURPOSE : Move reader to file offset
+ * INPUT   : [reader] - Reader pointer
+ *           [offset] - Start code of the next frame, from the index
+ * OUTPUT  : None
+ * RETURN  : 0 if OK, < 0 on error
+ * DESCRIPT: None
+ */
+int H264FileReaderSeek(void *reader, long long offset)
+{
+    tH264FrameBuf *r = (tH264FrameBuf *)reader;
+
+    if (r == NULL || offset < 0 || fseeko(r->pFile, (off_t)offset, SEEK_SET))
+        return -1;
+    r->curSize = 0;
+    r->frameStart = 0;
+    r->frameEnd = 0;
+    r->nalHdr = 0;
+    r->scanPos = 0;
+    r->synced = 0;
+    r->eof = 0;
+    r->fileOffset = offset;
+    r->nalTypes = 0;
+    return 0;
+}
+
+/*
+ * PURPOSE : Read frame at known position, without searching start codes
+ * INPUT   : [reader] - Reader pointer
+ *           [entry]  - Frame from the index
+ * OUTPUT  : [data]   - Frame pointer
+ *           [size]   - Frame size
+ * RETURN  : Frame size. < 0 on error
+ * DESCRIPT: Reader continues with the next frame
+ */
+int H264FileReaderReadFrame(void *reader, const tH264IndexEntry *entry, void *data, int *size)
+{
+    tH264FrameBuf *r = (tH264FrameBuf *)reader;
+
+    if (r == NULL || entry == NULL || data == NULL)
+        return -1;
+    if (size)
+    {
+        if (*size < entry->size)
+            return -1;
+        *size = entry->size;
+    }
+    if (fseeko(r->pFile, (off_t)entry->offset, SEEK_SET) ||
+        fread(data, sizeof(char), entry->size, r->pFile) != (size_t)entry->size ||
+        H264FileReaderSeek(reader, entry->offset + entry->size))
+        return -2;
+    return entry->size;
+}
+
+static void
+H264IndexPut32(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void
+H264IndexPut64(unsigned char *p, unsigned long long v)
+{
+    H264IndexPut32(p, (unsigned int)v);
+    H264IndexPut32(p + 4, (unsigned int)(v >> 32));
+}
+
+static unsigned int
+H264IndexGet32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long
+H264IndexGet64(const unsigned char *p)
+{
+    return H264IndexGet32(p) | ((unsigned long long)H264IndexGet32(p + 4) << 32);
+}
+
+static int
+H264IndexAdd(tH264Index *index, const tH264IndexEntry *entry)
+{
+    if (index->count == index->maxCount)
+    {
+        int maxCount = index->maxCount ? index->maxCount * 2 : 1024;
+        tH264IndexEntry *e = realloc(index->entry, maxCount * sizeof(tH264IndexEntry));
+        if (e == NULL)
+            return -1;
+        index->entry = e;
+        index->maxCount = maxCount;
+    }
+    index->entry[index->count++] = *entry;
+    return 0;
+}
+
+/*
+ * PURPOSE : Index access units of file
+ * INPUT   : [fileName] - File name
+ *           [hevc]     - File is H265
+ * OUTPUT  : None
+ * RETURN  : Index pointer, NULL on error
+ * DESCRIPT: One pass of the reader over the file
+ */
+void *
+H264IndexBuild(char *fileName, int hevc)
+{
+    const unsigned char *frame = NULL;
+    unsigned long long keyTypes = hevc ? 0xff0000ULL : 0x20ULL; /* H265 IRAP, H264 IDR */
+    tH264FrameBuf *r = NULL;
+    tH264Index *index = NULL;
+    int size = 0;
+
+    r = H264FileReaderCreate(fileName);
+    index = calloc(1, sizeof(tH264Index));
+    if (r == NULL || index == NULL)
+    {
+        H264FileReaderRemove(r);
+        free(index);
+        return NULL;
+    }
+    index->mode = H264_READER_AU | (hevc ? H264_READER_HEVC : 0);
+    H264FileReaderSetMode(r, index->mode);
+    while ((size = H264FileReaderNextFrame(r, &frame)) > 0)
+    {
+        tH264IndexEntry e;
+        e.offset = r->frameOffset;
+        e.size = size;
+        e.key = (r->frameTypes & keyTypes) != 0;
+        e.nalTypes = r->frameTypes;
+        if (H264IndexAdd(index, &e))
+        {
+            size = -1;
+            break;
         }
-    } while (!feof(r->pFile));
-    return iRetCode;
+    }
+    index->sourceSize = r->fileOffset + r->curSize;
+    H264FileReaderRemove(r);
+    if (size < 0)
+    {
+        H264IndexRemove(index);
+        return NULL;
+    }
+    return index;
+}
+
+/*
+ * PURPOSE : Write index sidecar file
+ * INPUT   : [index]     - Index pointer
+ *           [indexName] - Sidecar file name
+ * OUTPUT  : None
+ * RETURN  : 0 if OK, < 0 on error
+ * DESCRIPT: None
+ */
+int H264IndexSave(void *index, char *indexName)
+{
+    tH264Index *x = (tH264Index *)index;
+    unsigned char rec[DEF_H264_INDEX_HEADER];
+    FILE *f = NULL;
+    int i = 0;
+    int err = 0;
+
+    if (x == NULL || indexName == NULL || (f = fopen(indexName, "wb")) == NULL)
+        return -1;
+    memset(rec, 0, sizeof(rec));
+    memcpy(rec, DEF_H264_INDEX_MAGIC, 8);
+    H264IndexPut32(rec + 8, x->mode);
+    H264IndexPut32(rec + 12, x->count);
+    H264IndexPut64(rec + 16, x->sourceSize);
+    err = fwrite(rec, 1, DEF_H264_INDEX_HEADER, f) != DEF_H264_INDEX_HEADER;
+    for (i = 0; i < x->count && !err; i++)
+    {
+        const tH264IndexEntry *e = x->entry + i;
+        H264IndexPut64(rec, e->offset);
+        H264IndexPut32(rec + 8, e->size);
+        H264IndexPut32(rec + 12, e->key);
+        H264IndexPut64(rec + 16, e->nalTypes);
+        err = fwrite(rec, 1, DEF_H264_INDEX_RECORD, f) != DEF_H264_INDEX_RECORD;
+    }
+    if (fclose(f))
+        err = 1;
+    return err ? -2 : 0;
+}
+
+/*
+ * PURPOSE : Read index sidecar file
+ * INPUT   : [indexName] - Sidecar file name
+ *           [fileName]  - Indexed file, NULL to skip the check
+ *           [hevc]      - File is H265
+ * OUTPUT  : None
+ * RETURN  : Index pointer, NULL if missing, corrupt, built for the other
+ *           codec or file size changed
+ * DESCRIPT: None
+ */
+void *
+H264IndexLoad(char *indexName, char *fileName, int hevc)
+{
+    unsigned char rec[DEF_H264_INDEX_HEADER];
+    tH264Index *index = NULL;
+    struct stat st;
+    FILE *f = NULL;
+    int count = 0;
+    int i = 0;
+
+    if (indexName == NULL || (f = fopen(indexName, "rb")) == NULL)
+        return NULL;
+    if (fread(rec, 1, DEF_H264_INDEX_HEADER, f) != DEF_H264_INDEX_HEADER ||
+        memcmp(rec, DEF_H264_INDEX_MAGIC, 8) || (int)(count = H264IndexGet32(rec + 12)) < 0 ||
+        !(H264IndexGet32(rec + 8) & H264_READER_HEVC) != !hevc ||
+        (fileName && (stat(fileName, &st) || (long long)st.st_size != (long long)H264IndexGet64(rec + 16))) ||
+        (index = calloc(1, sizeof(tH264Index))) == NULL)
+    {
+        fclose(f);
+        return NULL;
+    }
+    index->mode = H264IndexGet32(rec + 8);
+    index->sourceSize = H264IndexGet64(rec + 16);
+    index->maxCount = count;
+    index->entry = malloc((count ? count : 1) * sizeof(tH264IndexEntry));
+    for (i = 0; index->entry && i < count; i++)
+    {
+        tH264IndexEntry *e = index->entry + i;
+        if (fread(rec, 1, DEF_H264_INDEX_RECORD, f) != DEF_H264_INDEX_RECORD)
+            break;
+        e->offset = H264IndexGet64(rec);
+        e->size = H264IndexGet32(rec + 8);
+        e->key = H264IndexGet32(rec + 12) & 1;
+        e->nalTypes = H264IndexGet64(rec + 16);
+    }
+    fclose(f);
+    index->count = i;
+    if (index->entry == NULL || i < count)
+    {
+        H264IndexRemove(index);
+        return NULL;
+    }
+    return index;
+}
+
+/*
+ * PURPOSE : Remove index
+ * INPUT   : [index] - Index pointer
+ * OUTPUT  : None
+ * RETURN  : None
+ * DESCRIPT: None
+ */
+void H264IndexRemove(void *index)
+{
+    tH264Index *x = (tH264Index *)index;
+    if (x)
+    {
+        free(x->entry);
+        free(x);
+    }
+}
+
+/*
+ * PURPOSE : Number of access units
+ * INPUT   : [index] - Index pointer
+ * OUTPUT  : None
+ * RETURN  : Count
+ * DESCRIPT: None
+ */
+int H264IndexCount(void *index)
+{
+    return index ? ((tH264Index *)index)->count : 0;
+}
+
+/*
+ * PURPOSE : Get access unit
+ * INPUT   : [index] - Index pointer
+ *           [n]     - Access unit number
+ * OUTPUT  : None
+ * RETURN  : Entry, NULL if n is out of range
+ * DESCRIPT: None
+ */
+const tH264IndexEntry *
+H264IndexGet(void *index, int n)
+{
+    tH264Index *x = (tH264Index *)index;
+    return (x && n >= 0 && n < x->count) ? x->entry + n : NULL;
+}
+
+/*
+ * PURPOSE : Find key frame to start decoding access unit n from
+ * INPUT   : [index] - Index pointer
+ *           [n]     - Access unit number
+ * OUTPUT  : None
+ * RETURN  : Number of the last key frame at or before n, -1 if none
+ * DESCRIPT: None
+ */
+int H264IndexFindKey(void *index, int n)
+{
+    tH264Index *x = (tH264Index *)index;
+    if (x == NULL)
+        return -1;
+    if (n >= x->count)
+        n = x->count - 1;
+    while (n >= 0 && !x->entry[n].key)
+        n--;
+    return n;
 }
 
 /*
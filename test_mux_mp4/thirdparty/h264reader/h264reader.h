@@ -8,6 +8,20 @@
 #ifndef H264_READER_H_
 #define H264_READER_H_
 
+/* Frame returned by the reader */
+#define H264_READER_NAL 0 /* one NAL unit */
+#define H264_READER_AU  1 /* one access unit: AUD, SPS, PPS, SEI and the slices of a picture (default) */
+#define H264_READER_HEVC 2 /* flag: file is H265 */
+
+/* Access unit in the index */
+typedef struct tH264IndexEntry
+{
+    long long offset;            /* start code of the first NAL */
+    int size;
+    int key;                     /* holds IDR (H265 IRAP) picture */
+    unsigned long long nalTypes; /* bit n set if a NAL of type n is in the access unit */
+} tH264IndexEntry;
+
 /*
  * PURPOSE : Remove H264 file reader
  * INPUT   : [reader] - Reader pointer
@@ -33,10 +47,133 @@ H264FileReaderCreate(char* fileName);
  * INPUT   : [reader] - Reader pointer
  * OUTPUT  : [data]   - Frame pointer
  *           [size]   - Frame size
- * RETURN  : Frame size. 0 if EOF
+ * RETURN  : Frame size. 0 if EOF, < 0 on error, -3 if the frame is bigger
+ *           than *size: *size is set to the frame size, and the next call
+ *           reads the same frame
  * DESCRIPT: None
  */
 int
 H264FileReaderGetFrame(void* reader, void* data, int* size);
 
+/*
+ * PURPOSE : Read 1 H264 frame from file without copy
+ * INPUT   : [reader] - Reader pointer
+ * OUTPUT  : [frame]  - Frame in the reader buffer, valid until the next call
+ * RETURN  : Frame size. 0 if EOF, < 0 on error
+ * DESCRIPT: Each byte of the file is read and scanned once
+ */
+int
+H264FileReaderNextFrame(void* reader, const unsigned char** frame);
+
+/*
+ * PURPOSE : Set what a frame is
+ * INPUT   : [reader] - Reader pointer
+ *           [mode]   - H264_READER_NAL or H264_READER_AU
+ * OUTPUT  : None
+ * RETURN  : None
+ * DESCRIPT: None
+ */
+void
+H264FileReaderSetMode(void* reader, int mode);
+
+/*
+ * PURPOSE : Move reader to file offset
+ * INPUT   : [reader] - Reader pointer
+ *           [offset] - Start code of the next frame, from the index
+ * OUTPUT  : None
+ * RETURN  : 0 if OK, < 0 on error
+ * DESCRIPT: None
+ */
+int
+H264FileReaderSeek(void* reader, long long offset);
+
+/*
+ * PURPOSE : Read frame at known position, without searching start codes
+ * INPUT   : [reader] - Reader pointer
+ *           [entry]  - Frame from the index
+ * OUTPUT  : [data]   - Frame pointer
+ *           [size]   - Frame size
+ * RETURN  : Frame size. < 0 on error
+ * DESCRIPT: Reader continues with the next frame
+ */
+int
+H264FileReaderReadFrame(void* reader, const tH264IndexEntry* entry, void* data, int* size);
+
+/*
+ * PURPOSE : Index access units of file
+ * INPUT   : [fileName] - File name
+ *           [hevc]     - File is H265
+ * OUTPUT  : None
+ * RETURN  : Index pointer, NULL on error
+ * DESCRIPT: One pass of the reader over the file
+ */
+void*
+H264IndexBuild(char* fileName, int hevc);
+
+/*
+ * PURPOSE : Write index sidecar file
+ * INPUT   : [index]     - Index pointer
+ *           [indexName] - Sidecar file name
+ * OUTPUT  : None
+ * RETURN  : 0 if OK, < 0 on error
+ * DESCRIPT: 32 byte header and 24 bytes per access unit
+ */
+int
+H264IndexSave(void* index, char* indexName);
+
+/*
+ * PURPOSE : Read index sidecar file
+ * INPUT   : [indexName] - Sidecar file name
+ *           [fileName]  - Indexed file, NULL to skip the check
+ *           [hevc]      - File is H265
+ * OUTPUT  : None
+ * RETURN  : Index pointer, NULL if missing, corrupt, built for the other
+ *           codec or file size changed
+ * DESCRIPT: None
+ */
+void*
+H264IndexLoad(char* indexName, char* fileName, int hevc);
+
+/*
+ * PURPOSE : Remove index
+ * INPUT   : [index] - Index pointer
+ * OUTPUT  : None
+ * RETURN  : None
+ * DESCRIPT: None
+ */
+void
+H264IndexRemove(void* index);
+
+/*
+ * PURPOSE : Number of access units
+ * INPUT   : [index] - Index pointer
+ * OUTPUT  : None
+ * RETURN  : Count
+ * DESCRIPT: None
+ */
+int
+H264IndexCount(void* index);
+
+/*
+ * PURPOSE : Get access unit
+ * INPUT   : [index] - Index pointer
+ *           [n]     - Access unit number
+ * OUTPUT  : None
+ * RETURN  : Entry, NULL if n is out of range
+ * DESCRIPT: None
+ */
+const tH264IndexEntry*
+H264IndexGet(void* index, int n);
+
+/*
+ * PURPOSE : Find key frame to start decoding access unit n from
+ * INPUT   : [index] - Index pointer
+ *           [n]     - Access unit number
+ * OUTPUT  : None
+ * RETURN  : Number of the last key frame at or before n, -1 if none
+ * DESCRIPT: None
+ */
+int
+H264IndexFindKey(void* index, int n);
+
 #endif /* H264_READER_H_ */
\ No newline at end of file
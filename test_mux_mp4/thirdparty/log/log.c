@@ -20,24 +20,94 @@
  * IN THE SOFTWARE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
 #include "log.h"
 
 #define MAX_CALLBACKS 32
 
+/* Async mode: per-thread ring of records, a power of 2 */
+#define ASYNC_RING_SIZE (64 * 1024)
+/* Longest record, string arguments are cut to fit */
+#define ASYNC_MAX_RECORD 1024
+/* Longest formatted message */
+#define ASYNC_MAX_MESSAGE 2048
+/* Writer collects records this long after a batch; it parks when there are none */
+#define ASYNC_BATCH_US 1000
+
 typedef struct {
   log_LogFn fn;
   void *udata;
   int level;
 } Callback;
 
+/* Record in a ring, followed by packed arguments of fmt */
+typedef struct {
+  uint32_t size;      /* bytes with arguments, multiple of 8 */
+  int level;          /* -1: padding to the end of the ring */
+  int line;
+  const char *file;
+  const char *fmt;    /* NULL: message preformatted, follows as a string */
+  int64_t ns;         /* CLOCK_REALTIME_COARSE */
+} Record;
+
+/* Single producer (owner thread), single consumer (writer thread); fields
+ * of each side on their own cache line */
+typedef struct Ring {
+  uint64_t head;      /* owner: end of queued records */
+  uint64_t tail_seen; /* owner: tail when last read */
+  uint64_t dropped;   /* owner: records not queued, ring was full */
+  int active;         /* owner: inside log_async(), log_set_async(false) waits for it */
+  char pad1[64 - 3 * sizeof(uint64_t) - sizeof(int)];
+  uint64_t tail;      /* writer: end of written records */
+  uint64_t head_seen; /* writer: head at the start of the batch */
+  uint64_t reported;  /* writer: dropped records reported */
+  char pad2[64 - 3 * sizeof(uint64_t)];
+  char *buf;
+  int orphan;         /* owner exited, another thread may adopt the ring */
+  struct Ring *next;
+} Ring;
+
+/* printf conversion, as far as needed to pack its argument */
+typedef struct {
+  const char *start;  /* '%' */
+  int len;
+  int stars;          /* '*' width and precision arguments before the value */
+  int prec;           /* precision, -1 if none, -2 if '*' */
+  char mod;           /* 0, 'H' (hh), 'h', 'l', 'q' (ll), 'j', 'z', 't' */
+  char conv;
+} Spec;
+
 static struct {
   void *udata;
   log_LockFn lock;
   int level;
   bool quiet;
   Callback callbacks[MAX_CALLBACKS];
+  int async;          /* producers queue records */
+  int stop;
+  pthread_t writer;
+  Ring *rings;
+  uint64_t flush_req;
+  uint64_t flush_ack;
+  int sleeping;       /* writer is parked, the first producer to clear it wakes it */
 } L;
 
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_flushed = PTHREAD_COND_INITIALIZER;
+
+static __thread Ring *tls_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
 
 static const char *level_strings[] = {
   "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
@@ -65,7 +135,7 @@ static void stdout_callback(log_Event *ev) {
 #endif
   vfprintf(ev->udata, ev->fmt, ev->ap);
   fprintf(ev->udata, "\n");
-  fflush(ev->udata);
+  if (!__atomic_load_n(&L.async, __ATOMIC_RELAXED)) { fflush(ev->udata); }
 }
 
 
@@ -77,7 +147,7 @@ static void file_callback(log_Event *ev) {
     buf, level_strings[ev->level], ev->file, ev->line);
   vfprintf(ev->udata, ev->fmt, ev->ap);
   fprintf(ev->udata, "\n");
-  fflush(ev->udata);
+  if (!__atomic_load_n(&L.async, __ATOMIC_RELAXED)) { fflush(ev->udata); }
 }
 
 
@@ -129,27 +199,23 @@ int log_add_fp(FILE *fp, int level) {
 
 
 static void init_event(log_Event *ev, void *udata) {
-  if (!ev->time) {
-    time_t t = time(NULL);
-    ev->time = localtime(&t);
-  }
   ev->udata = udata;
 }
 
 
-void log_log(int level, const char *file, int line, const char *fmt, ...) {
+static void log_event(int level, const char *file, int line, struct tm *time,
+                      const char *fmt, va_list ap) {
   log_Event ev = {
     .fmt   = fmt,
     .file  = file,
     .line  = line,
     .level = level,
+    .time  = time,
   };
 
-  lock();
-
   if (!L.quiet && level >= L.level) {
     init_event(&ev, stderr);
-    va_start(ev.ap, fmt);
+    va_copy(ev.ap, ap);
     stdout_callback(&ev);
     va_end(ev.ap);
   }
@@ -158,11 +224,505 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     Callback *cb = &L.callbacks[i];
     if (level >= cb->level) {
       init_event(&ev, cb->udata);
-      va_start(ev.ap, fmt);
+      va_copy(ev.ap, ap);
       cb->fn(&ev);
       va_end(ev.ap);
     }
   }
+}
+
+
+static void log_text(int level, const char *file, int line, struct tm *time,
+                     const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  log_event(level, file, line, time, fmt, ap);
+  va_end(ap);
+}
+
+
+static int min_level(void) {
+  int level = L.quiet ? LOG_FATAL + 1 : L.level;
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (L.callbacks[i].level < level) { level = L.callbacks[i].level; }
+  }
+  return level;
+}
+
+
+/* Parse conversion at or after p: 1 - found, 0 - none, -1 - can't be packed */
+static int next_spec(const char *p, Spec *spec) {
+  const char *q;
+  p = strchr(p, '%');
+  if (!p) { return 0; }
+  spec->start = p;
+  spec->stars = 0;
+  spec->prec = -1;
+  spec->mod = 0;
+  q = p + 1;
+  while (*q && strchr("-+ #0'", *q)) { q++; }
+  if (*q == '*') { spec->stars++; q++; }
+  while (*q >= '0' && *q <= '9') { q++; }
+  if (*q == '.') {
+    q++;
+    if (*q == '*') {
+      spec->stars++;
+      spec->prec = -2;
+      q++;
+    } else {
+      spec->prec = 0;
+    }
+    while (*q >= '0' && *q <= '9') { spec->prec = spec->prec * 10 + *q++ - '0'; }
+  }
+  if (*q == 'h' || *q == 'l') {
+    spec->mod = *q++;
+    if (*q == spec->mod) { spec->mod = spec->mod == 'h' ? 'H' : 'q'; q++; }
+  } else if (*q == 'j' || *q == 'z' || *q == 't') {
+    spec->mod = *q++;
+  }
+  spec->conv = *q;
+  spec->len = q + 1 - p;
+  if (!*q || spec->len > 31) { return -1; }
+  if (spec->conv == '%') { return spec->len == 2 ? 1 : -1; }
+  if (strchr("diouxXc", spec->conv)) { return spec->conv == 'c' && spec->mod ? -1 : 1; }
+  if (spec->conv == 's') { return spec->mod ? -1 : 1; }
+  if (strchr("eEfFgGaAp", spec->conv)) { return spec->mod && spec->mod != 'l' ? -1 : 1; }
+  return -1; /* %n, %m, %lc, %ls, %Lf ... */
+}
+
+
+/* Integer argument of conversion, as its own type */
+static uint64_t arg_int(const Spec *spec, va_list *ap) {
+  switch (spec->mod) {
+    case 'l': return (uint64_t)va_arg(*ap, long);
+    case 'q': return (uint64_t)va_arg(*ap, long long);
+    case 'j': return (uint64_t)va_arg(*ap, intmax_t);
+    case 'z': return (uint64_t)va_arg(*ap, size_t);
+    case 't': return (uint64_t)va_arg(*ap, ptrdiff_t);
+    default:  return (uint64_t)va_arg(*ap, int);
+  }
+}
+
+
+static int fmt_int(char *buf, size_t size, const char *f, const Spec *spec,
+                   const int *star, uint64_t v) {
+#define FMT_INT(T) \
+  (spec->stars == 2 ? snprintf(buf, size, f, star[0], star[1], (T)v) : \
+   spec->stars == 1 ? snprintf(buf, size, f, star[0], (T)v) : snprintf(buf, size, f, (T)v))
+  switch (spec->mod) {
+    case 'l': return FMT_INT(long);
+    case 'q': return FMT_INT(long long);
+    case 'j': return FMT_INT(intmax_t);
+    case 'z': return FMT_INT(size_t);
+    case 't': return FMT_INT(ptrdiff_t);
+    default:  return FMT_INT(int);
+  }
+#undef FMT_INT
+}
+
+
+/* Pack arguments of fmt to buf, return bytes, -1 if they can't be packed */
+static int pack_args(char *buf, int size, const char *fmt, va_list *ap) {
+  Spec spec;
+  int used = 0, found;
+  for (const char *p = fmt; (found = next_spec(p, &spec)) > 0; p = spec.start + spec.len) {
+    int n = spec.conv == '%' ? 0 : spec.stars + 1;
+    int prec = spec.prec;
+    if (used + n * 8 > size) { return -1; }
+    for (int i = 0; i < spec.stars; i++) {
+      int64_t star = va_arg(*ap, int);
+      memcpy(buf + used, &star, 8);
+      used += 8;
+      if (prec == -2 && i == spec.stars - 1) { prec = star < 0 ? -1 : (int)star; }
+    }
+    if (spec.conv == '%') {
+      continue;
+    } else if (strchr("diouxXc", spec.conv)) {
+      uint64_t v = arg_int(&spec, ap);
+      memcpy(buf + used, &v, 8);
+      used += 8;
+    } else if (spec.conv == 'p') {
+      void *v = va_arg(*ap, void *);
+      memcpy(buf + used, &v, sizeof(v));
+      used += 8;
+    } else if (spec.conv == 's') {
+      /* copy, the string may be gone when the record is written */
+      /* precision bounds the read: the string needs no NUL within it */
+      const char *str = va_arg(*ap, const char *);
+      int max = size - used - 1;
+      int len;
+      if (max < 0) { return -1; }
+      if (prec >= 0 && prec < max) { max = prec; }
+      if (!str) { str = prec < 0 || prec >= 6 ? "(null)" : ""; }
+      len = (int)strnlen(str, max);
+      memcpy(buf + used, str, len);
+      buf[used + len] = '\0';
+      used += (len + 8) & ~7;
+    } else {
+      double v = va_arg(*ap, double);
+      memcpy(buf + used, &v, 8);
+      used += 8;
+    }
+  }
+  return found < 0 ? -1 : used;
+}
+
+
+/* Format record made by pack_args() */
+static void unpack_args(char *out, int size, const char *fmt, const char *args) {
+  Spec spec;
+  char f[32];
+  int len = 0, found;
+  const char *p = fmt;
+  for (; (found = next_spec(p, &spec)) > 0 && len < size; p = spec.start + spec.len) {
+    int star[2] = { 0, 0 }, n = spec.start - p;
+    if (n > size - len - 1) { n = size - len - 1; }
+    memcpy(out + len, p, n);
+    len += n;
+    if (spec.conv == '%') {
+      if (len < size - 1) { out[len++] = '%'; }
+      continue;
+    }
+    memcpy(f, spec.start, spec.len);
+    f[spec.len] = '\0';
+    for (int i = 0; i < spec.stars; i++) {
+      int64_t v;
+      memcpy(&v, args, 8);
+      star[i] = (int)v;
+      args += 8;
+    }
+    if (strchr("diouxXc", spec.conv)) {
+      uint64_t v;
+      memcpy(&v, args, 8);
+      n = fmt_int(out + len, size - len, f, &spec, star, v);
+      args += 8;
+    } else if (spec.conv == 'p') {
+      void *v;
+      memcpy(&v, args, sizeof(v));
+      n = spec.stars == 1 ? snprintf(out + len, size - len, f, star[0], v)
+                          : snprintf(out + len, size - len, f, v);
+      args += 8;
+    } else if (spec.conv == 's') {
+      n = spec.stars == 2 ? snprintf(out + len, size - len, f, star[0], star[1], args) :
+          spec.stars == 1 ? snprintf(out + len, size - len, f, star[0], args) :
+                            snprintf(out + len, size - len, f, args);
+      args += (strlen(args) + 8) & ~7;
+    } else {
+      double v;
+      memcpy(&v, args, 8);
+      n = spec.stars == 2 ? snprintf(out + len, size - len, f, star[0], star[1], v) :
+          spec.stars == 1 ? snprintf(out + len, size - len, f, star[0], v) :
+                            snprintf(out + len, size - len, f, v);
+      args += 8;
+    }
+    len += n > 0 ? n : 0;
+  }
+  if (len >= size) { len = size - 1; }
+  snprintf(out + len, size - len, "%s", found == 0 ? p : "");
+}
+
+
+static void ring_release(void *ring) {
+  __atomic_store_n(&((Ring *)ring)->orphan, 1, __ATOMIC_RELEASE);
+}
+
+
+static void ring_key_create(void) {
+  pthread_key_create(&ring_key, ring_release);
+}
+
+
+/* Ring of calling thread: adopt one of an exited thread, or add new one */
+static Ring *get_ring(void) {
+  Ring *ring = tls_ring;
+  if (ring) { return ring; }
+  pthread_once(&ring_once, ring_key_create);
+  for (ring = __atomic_load_n(&L.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    int orphan = 1;
+    if (__atomic_compare_exchange_n(&ring->orphan, &orphan, 0, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  if (!ring) {
+    if (posix_memalign((void **)&ring, 64, sizeof(Ring))) { return NULL; }
+    if (!(ring->buf = malloc(ASYNC_RING_SIZE))) {
+      free(ring);
+      return NULL;
+    }
+    memset(&ring->head, 0, offsetof(Ring, buf));
+    ring->orphan = 0;
+    ring->next = __atomic_load_n(&L.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&L.rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+  }
+  pthread_setspecific(ring_key, ring);
+  tls_ring = ring;
+  return ring;
+}
+
+
+/* Wake the writer if it is parked */
+static void wake_writer(void) {
+  if (__atomic_load_n(&L.sleeping, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&L.sleeping, 0, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&writer_mutex);
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_mutex);
+  }
+}
+
+
+/* Queue record, never blocks: dropped if the ring is full */
+static void queue_record(Ring *ring, int level, const char *file, int line, const char *fmt, va_list ap) {
+  union { Record r; char buf[ASYNC_MAX_RECORD]; } rec;
+  struct timespec ts;
+  va_list copy;
+  uint64_t head, need;
+  uint32_t pos;
+  int args;
+
+  /* a tick (1-4 ms) is enough for the log time, ordering across threads is within it */
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  rec.r.level = level;
+  rec.r.line = line;
+  rec.r.file = file;
+  rec.r.fmt = fmt;
+  rec.r.ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  va_copy(copy, ap);
+  args = pack_args(rec.buf + sizeof(Record), sizeof(rec) - sizeof(Record), fmt, &copy);
+  va_end(copy);
+  if (args < 0) {
+    /* conversion the writer can't redo: format here */
+    args = vsnprintf(rec.buf + sizeof(Record), sizeof(rec) - sizeof(Record), fmt, ap);
+    if (args < 0) { return; }
+    if (args >= (int)(sizeof(rec) - sizeof(Record))) { args = sizeof(rec) - sizeof(Record) - 1; }
+    args = (args + 8) & ~7;
+    rec.r.fmt = NULL;
+  }
+  rec.r.size = sizeof(Record) + args;
+
+  head = ring->head;
+  pos = head & (ASYNC_RING_SIZE - 1);
+  /* records don't wrap, padding skips to the start */
+  need = rec.r.size > ASYNC_RING_SIZE - pos ? ASYNC_RING_SIZE - pos + rec.r.size : rec.r.size;
+  if (ASYNC_RING_SIZE - (head - ring->tail_seen) < need) {
+    ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ASYNC_RING_SIZE - (head - ring->tail_seen) < need) {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  if (need > rec.r.size) {
+    Record *pad = (Record *)(ring->buf + pos);
+    pad->size = ASYNC_RING_SIZE - pos;
+    pad->level = -1;
+    head += pad->size;
+    pos = 0;
+  }
+  memcpy(ring->buf + pos, rec.buf, rec.r.size);
+  __atomic_store_n(&ring->head, head + rec.r.size, __ATOMIC_RELEASE);
+  /* head before sleeping, the writer checks them in the other order */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  wake_writer();
+}
+
+
+/* Queue record, return -1 if async mode ended meanwhile */
+static int log_async(int level, const char *file, int line, const char *fmt, va_list ap) {
+  Ring *ring = get_ring();
+  if (!ring) { return 0; }
+  /* active before async, log_set_async(false) checks them in the other order */
+  __atomic_store_n(&ring->active, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&L.async, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&ring->active, 0, __ATOMIC_RELEASE);
+    return -1;
+  }
+  queue_record(ring, level, file, line, fmt, ap);
+  __atomic_store_n(&ring->active, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+/* Write records queued before the call in time order, return number written */
+static int drain(void) {
+  static time_t last;
+  static struct tm tm;
+  char msg[ASYNC_MAX_MESSAGE];
+  int count = 0;
+  Ring *rings = __atomic_load_n(&L.rings, __ATOMIC_ACQUIRE);
+
+  for (Ring *ring = rings; ring; ring = ring->next) {
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (dropped != ring->reported) {
+      last = time(NULL);
+      localtime_r(&last, &tm);
+      lock();
+      log_text(LOG_WARN, __FILE__, __LINE__, &tm, "%llu log messages dropped",
+               (unsigned long long)(dropped - ring->reported));
+      unlock();
+      ring->reported = dropped;
+      count++;
+    }
+  }
 
+  for (;;) {
+    Ring *next = NULL;
+    Record *rec = NULL;
+    for (Ring *ring = rings; ring; ring = ring->next) {
+      while (ring->tail != ring->head_seen) {
+        Record *r = (Record *)(ring->buf + (ring->tail & (ASYNC_RING_SIZE - 1)));
+        if (r->level >= 0) {
+          if (!rec || r->ns < rec->ns) { rec = r; next = ring; }
+          break;
+        }
+        __atomic_store_n(&ring->tail, ring->tail + r->size, __ATOMIC_RELEASE);
+      }
+    }
+    if (!rec) { return count; }
+
+    time_t t = rec->ns / 1000000000;
+    const char *args = (const char *)(rec + 1);
+    if (t != last) {
+      last = t;
+      localtime_r(&t, &tm);
+    }
+    if (rec->fmt) {
+      unpack_args(msg, sizeof(msg), rec->fmt, args);
+      args = msg;
+    }
+    lock();
+    log_text(rec->level, rec->file, rec->line, &tm, "%s", args);
+    unlock();
+    __atomic_store_n(&next->tail, next->tail + rec->size, __ATOMIC_RELEASE);
+    count++;
+  }
+}
+
+
+static void flush_sinks(void) {
+  fflush(stderr);
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (L.callbacks[i].fn == file_callback) { fflush(L.callbacks[i].udata); }
+  }
+}
+
+
+/* Anything for the writer: records, a flush or stop request */
+static int writer_pending(void) {
+  if (__atomic_load_n(&L.stop, __ATOMIC_SEQ_CST) ||
+      __atomic_load_n(&L.flush_req, __ATOMIC_SEQ_CST) != L.flush_ack) {
+    return 1;
+  }
+  for (Ring *ring = __atomic_load_n(&L.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail) { return 1; }
+  }
+  return 0;
+}
+
+
+/* Sleep until a producer, log_flush() or log_set_async(false) wakes the writer */
+static void writer_park(void) {
+  pthread_mutex_lock(&writer_mutex);
+  __atomic_store_n(&L.sleeping, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&L.sleeping, __ATOMIC_SEQ_CST) && !writer_pending()) {
+    pthread_cond_wait(&writer_wake, &writer_mutex);
+  }
+  __atomic_store_n(&L.sleeping, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&writer_mutex);
+}
+
+
+static void *writer_thread(void *arg) {
+  (void)arg;
+  for (;;) {
+    uint64_t req = __atomic_load_n(&L.flush_req, __ATOMIC_ACQUIRE);
+    int stop = __atomic_load_n(&L.stop, __ATOMIC_ACQUIRE);
+    int count = drain();
+    if (count) { flush_sinks(); }
+    if (req != L.flush_ack) {
+      pthread_mutex_lock(&writer_mutex);
+      __atomic_store_n(&L.flush_ack, req, __ATOMIC_RELEASE);
+      pthread_cond_broadcast(&writer_flushed);
+      pthread_mutex_unlock(&writer_mutex);
+    }
+    if (stop) { break; }
+    if (count) {
+      /* producers don't wake a writer that isn't parked */
+      struct timespec ts = { 0, ASYNC_BATCH_US * 1000 };
+      nanosleep(&ts, NULL);
+    } else {
+      writer_park();
+    }
+  }
+  return NULL;
+}
+
+
+static void async_exit(void) {
+  log_set_async(false);
+}
+
+
+int log_set_async(bool enable) {
+  static bool exit_set;
+  if (enable == (bool)__atomic_load_n(&L.async, __ATOMIC_ACQUIRE)) { return 0; }
+  if (enable) {
+    __atomic_store_n(&L.stop, 0, __ATOMIC_RELAXED);
+    if (pthread_create(&L.writer, NULL, writer_thread, NULL)) { return -1; }
+    if (!exit_set) { exit_set = !atexit(async_exit); }
+    __atomic_store_n(&L.async, 1, __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(&L.async, 0, __ATOMIC_SEQ_CST);
+    /* producers that saw async set finish queueing before the last drain */
+    for (Ring *ring = __atomic_load_n(&L.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+      while (__atomic_load_n(&ring->active, __ATOMIC_SEQ_CST)) { sched_yield(); }
+    }
+    __atomic_store_n(&L.stop, 1, __ATOMIC_SEQ_CST);
+    wake_writer();
+    pthread_join(L.writer, NULL);
+  }
+  return 0;
+}
+
+
+void log_flush(void) {
+  uint64_t req;
+  if (!__atomic_load_n(&L.async, __ATOMIC_ACQUIRE)) { return; }
+  req = __atomic_add_fetch(&L.flush_req, 1, __ATOMIC_SEQ_CST);
+  wake_writer();
+  pthread_mutex_lock(&writer_mutex);
+  while (__atomic_load_n(&L.flush_ack, __ATOMIC_ACQUIRE) < req) {
+    pthread_cond_wait(&writer_flushed, &writer_mutex);
+  }
+  pthread_mutex_unlock(&writer_mutex);
+}
+
+
+void log_log(int level, const char *file, int line, const char *fmt, ...) {
+  va_list ap;
+
+  if (__atomic_load_n(&L.async, __ATOMIC_ACQUIRE)) {
+    int ret;
+    if (level < min_level()) { return; }
+    va_start(ap, fmt);
+    ret = log_async(level, file, line, fmt, ap);
+    va_end(ap);
+    if (!ret) {
+      if (level == LOG_FATAL) { log_flush(); }
+      return;
+    }
+    /* async mode just ended: write it here */
+  }
+
+  time_t t = time(NULL);
+  struct tm tm;
+  localtime_r(&t, &tm);
+
+  lock();
+  va_start(ap, fmt);
+  log_event(level, file, line, &tm, fmt, ap);
+  va_end(ap);
   unlock();
-}
\ No newline at end of file
+}
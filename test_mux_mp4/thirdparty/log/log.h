@@ -46,4 +46,10 @@ int log_add_fp(FILE *fp, int level);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
+/* Async mode: log_log() queues the record to a per-thread ring and returns,
+ * a writer thread formats and writes queued records in batches. Records are
+ * dropped (and counted) rather than blocking when a ring is full */
+int log_set_async(bool enable);
+void log_flush(void);
+
 #endif
\ No newline at end of file
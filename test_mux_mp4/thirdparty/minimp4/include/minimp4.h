@@ -117,6 +117,33 @@ extern "C"
 // Enable TrackFragmentBaseMediaDecodeTimeBox support
 #define MP4D_TFDT_SUPPORT 0
 
+// Demuxer keeps 'stts'/'ctts' as runs; one timestamp checkpoint is stored
+// per this number of runs to bound the walk done by per-sample lookups
+#define MP4D_RUN_CHECKPOINT_INTERVAL 64
+
+// Support saving parsed track tables to index sidecar, see MP4D_write_index()
+#define MP4D_INDEX_SUPPORTED 1
+
+// Support batched reads: opening MP4 with asynchronous reads, see MP4D_async_open(),
+// and coalesced sample reads, see MP4D_plan_reads()
+#define MP4D_ASYNC_SUPPORTED 1
+
+// Support MP4 to fragmented MP4 remux, see MP4E_remux_fragmented().
+// Requires MP4D_INFO_SUPPORTED and MP4D_TIMESTAMPS_SUPPORTED
+#define MINIMP4_REMUX_SUPPORTED 1
+
+// Support rebuilding index of sequential mode file, not closed by MP4E_close(),
+// see MP4E_recover()
+#define MINIMP4_RECOVER_SUPPORTED 1
+
+// Support periodic index journal, to rebuild 'moov' after crash,
+// see MP4E_set_journal()
+#define MINIMP4_JOURNAL_SUPPORTED 1
+
+// Support writing samples of all tracks in decode time order,
+// see MP4E_set_interleave()
+#define MINIMP4_INTERLEAVE_SUPPORTED 1
+
 /************************************************************************/
 /*          Some values of MP4(E/D)_track_t->object_type_indication     */
 /************************************************************************/
@@ -143,6 +170,8 @@ extern "C"
 #define MP4E_STATUS_NO_MEMORY -2
 #define MP4E_STATUS_FILE_WRITE_ERROR -3
 #define MP4E_STATUS_ONLY_ONE_DSI_ALLOWED -4
+#define MP4E_STATUS_FILE_READ_ERROR -5
+#define MP4E_STATUS_INCOMPATIBLE_TRACKS -6
 
 /************************************************************************/
 /*          Sample kind for MP4E_put_sample()                           */
@@ -230,6 +259,43 @@ typedef unsigned int boxsize_t;
 
     typedef struct MP4D_sample_to_chunk_t_tag MP4D_sample_to_chunk_t;
 
+    /**
+     * @brief One run of a run-length coded sample table ('stts', 'ctts')
+     * @param unsigned count; number of consecutive samples in the run
+     * @param unsigned value; sample_delta for 'stts', sample_offset for 'ctts'
+     */
+    typedef struct
+    {
+        unsigned count;
+        unsigned value;
+    } MP4D_run_t;
+
+    /**
+     * @brief Sparse checkpoint into a run table
+     * @param unsigned run; index of the run this checkpoint points to
+     * @param unsigned first_sample; number of samples before this run
+     * @param uint64_t sum; sum of count * value before this run (decode time for 'stts')
+     */
+    typedef struct
+    {
+        unsigned run;
+        unsigned first_sample;
+        uint64_t sum;
+    } MP4D_run_checkpoint_t;
+
+    /**
+     * @brief Run-length coded sample table, as stored in the file, plus
+     *        optional checkpoints (allocated only for long tables)
+     */
+    typedef struct
+    {
+        unsigned run_count;
+        MP4D_run_t *run;
+
+        unsigned checkpoint_count;
+        MP4D_run_checkpoint_t *checkpoint;
+    } MP4D_run_table_t;
+
     typedef struct
     {
         /************************************************************************/
@@ -266,6 +332,9 @@ typedef unsigned int boxsize_t;
         // case 0x6C: return "Visual ISO/IEC 10918-1";
         unsigned object_type_indication;
 
+        // Size of NAL length field in AVC/HEVC samples, from 'avcC'/'hvcC'
+        unsigned nal_length_size;
+
 #if MP4D_INFO_SUPPORTED
         /************************************************************************/
         /*                 informational public data                            */
@@ -324,6 +393,10 @@ typedef unsigned int boxsize_t;
         /************************************************************************/
         /*                 private data: MP4 indexes                            */
         /************************************************************************/
+        // Constant sample size from 'stsz', zero if sizes differ
+        unsigned sample_size;
+
+        // Per-sample sizes, allocated only when sample_size is zero
         unsigned *entry_size;
 
         unsigned sample_to_chunk_count;
@@ -332,9 +405,22 @@ typedef unsigned int boxsize_t;
         unsigned chunk_count;
         MP4D_file_offset_t *chunk_offset;
 
+        // Sync samples (key frames) from 'stss', 0-based and ascending.
+        // NULL if 'stss' is absent: then every sample is a sync sample
+        unsigned sync_count;
+        unsigned *sync_sample;
+
 #if MP4D_TIMESTAMPS_SUPPORTED
-        unsigned *timestamp;
-        unsigned *duration;
+        // 'stts' runs: memory is proportional to number of runs, not samples
+        MP4D_run_table_t stts;
+
+        // 'ctts' runs, value is signed decode-to-presentation offset.
+        // Empty if 'ctts' is absent: then presentation time == decode time
+        MP4D_run_table_t ctts;
+
+        // Range of 'ctts' offsets, bounds presentation reordering window
+        int ctts_min_offset;
+        int ctts_max_offset;
 #endif
 
     } MP4D_track_t;
@@ -376,17 +462,45 @@ typedef unsigned int boxsize_t;
         } tag;
 #endif
 
+        /************************************************************************/
+        /*                 private data                                         */
+        /************************************************************************/
+        // Index sidecar memory, if opened by MP4D_open_with_index(): tables
+        // point into it, and MP4D_close() does not free them
+        const void *index;
+
     } MP4D_demux_t;
 
+    /**
+     * @brief Sample (frame) description, see MP4D_sample_info()
+     * @param MP4D_file_offset_t offset; sample position in file
+     * @param unsigned size; coded sample size in bytes
+     * @param uint64_t dts; decode time, in track timescale units
+     * @param int64_t pts; presentation time, in track timescale units
+     * @param unsigned duration; sample duration, in track timescale units
+     * @param int is_sync; sample is a sync sample (key frame)
+     */
+    typedef struct
+    {
+        MP4D_file_offset_t offset;
+        unsigned size;
+        uint64_t dts;
+        int64_t pts;
+        unsigned duration;
+        int is_sync;
+    } MP4D_sample_info_t;
+
     /**
      * @brief struct MP4D_sample_to_chunk_t_tag
      * @param unsigned first_chunk;
      * @param unsigned samples_per_chunk;
+     * @param unsigned first_sample; number of samples in the preceding groups
      */
     struct MP4D_sample_to_chunk_t_tag
     {
         unsigned first_chunk;
         unsigned samples_per_chunk;
+        unsigned first_sample;
     };
 
     typedef struct
@@ -441,21 +555,251 @@ typedef unsigned int boxsize_t;
      *   MP4 term for 'frame'
      *
      *   frame_bytes [OUT]   - return coded frame size in bytes
-     *   timestamp [OUT]     - return frame timestamp (in mp4->timescale units)
+     *   timestamp [OUT]     - return frame decode timestamp (in mp4->timescale units)
      *   duration [OUT]      - return frame duration (in mp4->timescale units)
      *
      *   function return offset for the frame
+     *   Use MP4D_sample_info() to get presentation timestamp for tracks with B-frames
      */
     MP4D_file_offset_t MP4D_frame_offset(const MP4D_demux_t *mp4, unsigned int ntrack,
                                          unsigned int nsample, unsigned int *frame_bytes, unsigned *timestamp, unsigned *duration);
 
+    /**
+     *   Return full description for given sample: position, size, decode and
+     *   presentation ('ctts') timestamps, duration and sync flag.
+     *
+     *   return 1 on success, 0 on failure
+     */
+    int MP4D_sample_info(const MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample, MP4D_sample_info_t *info);
+
+    /**
+     *   Return 1 if given sample is a sync sample (key frame), 0 otherwise
+     */
+    int MP4D_sample_is_sync(const MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample);
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+    /**
+     *   Find sample for given decode time, and the nearest sync sample (key frame)
+     *   at or before it, where decoding must start to display that sample.
+     *   Binary search over 'stts' runs and 'stss' table, no per-sample scan.
+     *
+     *   time [IN]             - decode time, in track timescale units (mp4->track[ntrack].timescale)
+     *   sample [OUT]          - sample, which covers given time (last sample if time is past the end)
+     *   keyframe_sample [OUT] - nearest preceding sync sample (first sync sample if none precedes)
+     *
+     *   return 1 on success, 0 on failure
+     */
+    int MP4D_seek(const MP4D_demux_t *mp4, unsigned int ntrack, uint64_t time,
+                  unsigned int *sample, unsigned int *keyframe_sample);
+
+    /**
+     *   Same as MP4D_seek(), but for presentation time: find sample displayed at
+     *   given time (largest presentation time not after it) and the sync sample
+     *   where decoding must start. Only the reordering window, bounded by the
+     *   range of 'ctts' offsets, is examined.
+     *
+     *   return 1 on success, 0 on failure
+     */
+    int MP4D_seek_pts(const MP4D_demux_t *mp4, unsigned int ntrack, int64_t time,
+                      unsigned int *sample, unsigned int *keyframe_sample);
+#endif
+
     /**
      *   De-allocated memory
      */
     void MP4D_close(MP4D_demux_t *mp4);
 
+#if MP4D_INDEX_SUPPORTED
+    /**
+     *   Save parsed track tables of opened MP4 to index sidecar, so the file can be
+     *   re-opened by MP4D_open_with_index() without 'moov' parsing.
+     *   file_size and file_mtime identify MP4 file version (e.g. from stat()),
+     *   sidecar is rejected if they do not match on open.
+     *   write_callback has the same meaning as for MP4E_open()
+     *
+     *   return 1 on success, 0 on failure
+     */
+    int MP4D_write_index(const MP4D_demux_t *mp4, int64_t file_size, int64_t file_mtime,
+                         int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token), void *token);
+
+    /**
+     *   Open MP4 using index sidecar instead of parsing 'moov'.
+     *   Sidecar is validated (format version, build layout, checksum, MP4 file size
+     *   and mtime) and used in-place: tables point to the given memory, which must
+     *   be 8-byte aligned and kept valid until MP4D_close(). Typically it is mmap()-ed:
+     *
+     *       void *index = mmap(NULL, index_size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+     *       if (!MP4D_open_with_index(mp4, index, index_size, st.st_mtime, read_callback, token, st.st_size))
+     *           MP4D_open(mp4, read_callback, token, st.st_size); // stale or broken sidecar
+     *
+     *   return 1 on success, 0 on failure (then call MP4D_open() as usual)
+     */
+    int MP4D_open_with_index(MP4D_demux_t *mp4, const void *index, size_t index_bytes, int64_t file_mtime,
+                             int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size);
+#endif
+
+#if MP4D_ASYNC_SUPPORTED
+    /**
+     * @brief Byte range of the file, see MP4D_async_open()
+     * @param int64_t offset; file position
+     * @param size_t size; number of bytes
+     * @param void *buffer; memory to read to, owned by MP4D_async_t
+     */
+    typedef struct
+    {
+        int64_t offset;
+        size_t size;
+        void *buffer;
+    } MP4D_range_t;
+
+    /**
+     * @brief State of MP4D_async_open(); request[0..request_count) is the batch of
+     * ranges to read before MP4D_async_resume(), other fields are private
+     */
+    typedef struct
+    {
+        MP4D_range_t *request;
+        unsigned request_count;
+
+        MP4D_demux_t *mp4;
+        int64_t file_size;
+        MP4D_range_t *chunk; // ranges read so far
+        unsigned chunk_count;
+        unsigned last_chunk;
+        int64_t pos;         // next top-level box to look at
+        int64_t stop;        // end of 'moov', parsing stops there
+        int64_t skip_to;     // 'moov' found in file tail: parser sees one 'free' box before it
+        uint64_t walk_bytes; // size of the last box header read, grows on every read
+        int tail_read;
+        int64_t miss_offset; // first byte not in chunks, seen by parser
+        size_t miss_size;
+        int parsing;
+        unsigned rounds;
+    } MP4D_async_t;
+
+// Return values of MP4D_async_open() and MP4D_async_resume(), 0 is failure
+#define MP4D_ASYNC_OPENED 1
+#define MP4D_ASYNC_NEED_DATA 2
+
     /**
-     *   Helper functions to parse mp4.track[ntrack].dsi for H.264 SPS/PPS
+     *   Open MP4 without read callback, for high-latency storage. Instead of
+     *   many small synchronous reads, the caller gets batches of byte ranges:
+     *   top-level box headers (file head and tail are read speculatively),
+     *   then whole 'moov'. Typically it takes 1 or 2 batches.
+     *
+     *       int res = MP4D_async_open(&a, mp4, file_size);
+     *       while (res == MP4D_ASYNC_NEED_DATA)
+     *       {
+     *           for (i = 0; i < a.request_count; i++) // may be issued in parallel
+     *               read(a.request[i].offset, a.request[i].buffer, a.request[i].size);
+     *           res = MP4D_async_resume(&a, 0);
+     *       }
+     *       MP4D_async_close(&a);
+     *
+     *   Top-level boxes after 'moov' are not parsed. mp4->read_callback is not
+     *   set, assign it before using API which reads the file, e.g. remux.
+     *
+     *   return MP4D_ASYNC_NEED_DATA, or 0 on failure
+     */
+    int MP4D_async_open(MP4D_async_t *a, MP4D_demux_t *mp4, int64_t file_size);
+
+    /**
+     *   Continue opening after all ranges of the batch are read.
+     *   Non-zero error aborts opening
+     *
+     *   return MP4D_ASYNC_NEED_DATA with the next batch, MP4D_ASYNC_OPENED, or 0 on failure
+     */
+    int MP4D_async_resume(MP4D_async_t *a, int error);
+
+    /**
+     *   Free read buffers; MP4 opened by MP4D_async_resume() stays open
+     */
+    void MP4D_async_close(MP4D_async_t *a);
+
+    /**
+     *   MP4D_open() variant on top of MP4D_async_open(): read_batch_callback reads
+     *   all given ranges, possibly in parallel, and returns non-zero on failure
+     *
+     *   return 1 on success, 0 on failure
+     */
+    int MP4D_open_batched(MP4D_demux_t *mp4, int (*read_batch_callback)(MP4D_range_t *ranges, unsigned count, void *token),
+                          void *token, int64_t file_size);
+
+    /**
+     * @brief Samples [first, end) of the track, see MP4D_plan_reads()
+     */
+    typedef struct
+    {
+        unsigned track;
+        unsigned first;
+        unsigned end;
+    } MP4D_sample_range_t;
+
+    /**
+     * @brief Sample data inside planned read
+     * @param unsigned track, sample; sample number
+     * @param unsigned read; index of MP4D_read_plan_t::read which contains the sample
+     * @param unsigned size; sample size in bytes
+     * @param const unsigned char *data; sample data, valid when the read is done
+     */
+    typedef struct
+    {
+        unsigned track;
+        unsigned sample;
+        unsigned read;
+        unsigned size;
+        const unsigned char *data;
+    } MP4D_sample_slice_t;
+
+    /**
+     * @brief Coalesced reads and per-sample slices, see MP4D_plan_reads()
+     * @param uint64_t read_bytes, sample_bytes; total size of reads and of samples
+     * in them, the difference is read from gaps between samples
+     */
+    typedef struct
+    {
+        MP4D_range_t *read;
+        unsigned read_count;
+        MP4D_sample_slice_t *slice;
+        unsigned slice_count;
+        uint64_t read_bytes;
+        uint64_t sample_bytes;
+    } MP4D_read_plan_t;
+
+    /**
+     *   Plan reads of the given sample ranges: samples, which are close in the
+     *   file (gap up to gap_bytes), are read together, so consecutive samples of
+     *   a chunk, and interleaved chunks of several tracks, take one read instead
+     *   of one per sample. Single read does not exceed max_read_bytes (0 - no
+     *   limit) unless a sample is bigger. Slices follow order of ranges and samples.
+     *
+     *       MP4D_plan_reads(mp4, ranges, nranges, 4096, 4 << 20, &plan);
+     *       for (i = 0; i < plan.read_count; i++) // or read_batch_callback(plan.read, plan.read_count, token)
+     *           read(plan.read[i].offset, plan.read[i].buffer, plan.read[i].size);
+     *       for (i = 0; i < plan.slice_count; i++)
+     *           consume(plan.slice[i].track, plan.slice[i].sample, plan.slice[i].data, plan.slice[i].size);
+     *       MP4D_free_read_plan(&plan);
+     *
+     *   return 1 on success, 0 on failure
+     */
+    int MP4D_plan_reads(const MP4D_demux_t *mp4, const MP4D_sample_range_t *ranges, unsigned range_count,
+                        unsigned gap_bytes, size_t max_read_bytes, MP4D_read_plan_t *plan);
+
+    /**
+     *   Free read buffers and slices
+     */
+    void MP4D_free_read_plan(MP4D_read_plan_t *plan);
+#endif
+
+    /**
+     *   Helper functions to parse mp4.track[ntrack].dsi for H.265 VPS
+     *   Return pointer to internal mp4 memory, it must not be free()-ed
+     *   Return NULL for H.264 tracks, which have no VPS
+     */
+    const void *MP4D_read_vps(const MP4D_demux_t *mp4, unsigned int ntrack, int nvps, int *vps_bytes);
+
+    /**
+     *   Helper functions to parse mp4.track[ntrack].dsi for H.264/H.265 SPS/PPS
      *   Return pointer to internal mp4 memory, it must not be free()-ed
      *
      *   Example: process all SPS in MP4 file:
@@ -468,7 +812,7 @@ typedef unsigned int boxsize_t;
     const void *MP4D_read_sps(const MP4D_demux_t *mp4, unsigned int ntrack, int nsps, int *sps_bytes);
 
     /**
-     *   Helper functions to parse mp4.track[ntrack].dsi for H.264 SPS/PPS
+     *   Helper functions to parse mp4.track[ntrack].dsi for H.264/H.265 SPS/PPS
      *   Return pointer to internal mp4 memory, it must not be free()-ed
      *
      *   Example: process all SPS in MP4 file:
@@ -480,6 +824,17 @@ typedef unsigned int boxsize_t;
      */
     const void *MP4D_read_pps(const MP4D_demux_t *mp4, unsigned int ntrack, int npps, int *pps_bytes);
 
+    /**
+     *   Convert H.264/H.265 sample from NAL length prefixed to Annex-B (start code)
+     *   format. For sync samples VPS/SPS/PPS from DSI are prepended, so output can be
+     *   decoded starting from any key frame.
+     *   If out is NULL, only required output size is returned
+     *
+     *   return output size in bytes, 0 on failure or if out_bytes is not enough
+     */
+    int MP4D_annexb_sample(const MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample,
+                           const void *sample, unsigned int sample_bytes, void *out, unsigned int out_bytes);
+
 #if MP4D_PRINT_INFO_SUPPORTED
     /**
      *   Print MP4 information to stdout.
@@ -572,6 +927,131 @@ typedef unsigned int boxsize_t;
      */
     int MP4E_set_text_comment(MP4E_mux_t *mux, const char *comment);
 
+#if MINIMP4_REMUX_SUPPORTED
+    /**
+     *   Remux opened MP4 file to fragmented MP4, without payload parsing.
+     *   mux must be just opened in fragmentation mode, with no tracks: tracks,
+     *   parameter sets and DSI are taken from the source (video other than AVC
+     *   and HEVC becomes a private track with its DSI). Each fragment starts at
+     *   sync sample of the first video track, at least fragment_ms after previous
+     *   one (0 - fragment per GOP), and holds one run of samples per track.
+     *   Payloads are copied as contiguous byte ranges of the source file by
+     *   copy_callback, so it may use copy_file_range() or splice(); it returns 0
+     *   on success. If copy_callback is NULL, payloads are read with the demuxer
+     *   read_callback and written with the mux write_callback.
+     *   mux still must be closed with MP4E_close()
+     *
+     *   return error code MP4E_STATUS_*
+     */
+    int MP4E_remux_fragmented(const MP4D_demux_t *mp4, MP4E_mux_t *mux, unsigned fragment_ms,
+                              int (*copy_callback)(int64_t src_offset, int64_t dst_offset, size_t size, void *token), void *token);
+
+    /**
+     *   Cut clip [start_ms, end_ms] from opened MP4 file without re-encoding.
+     *   Clip starts at sync sample of the first video track at or before start_ms,
+     *   and ends before its sync sample at or after end_ms; other tracks are cut at
+     *   the same decode times; end_ms of 0 cuts to the end of the file.
+     *   Timestamps of the clip start from zero.
+     *   mux must be just opened in non-sequential, non-fragmented mode, with no
+     *   tracks, and closed with MP4E_close(), which writes the clip indexes.
+     *   Only the clip payloads are read, as large contiguous ranges; copy_callback
+     *   has the same meaning as for MP4E_remux_fragmented()
+     *
+     *   return error code MP4E_STATUS_*
+     */
+    int MP4E_trim(const MP4D_demux_t *mp4, MP4E_mux_t *mux, uint64_t start_ms, uint64_t end_ms,
+                  int (*copy_callback)(int64_t src_offset, int64_t dst_offset, size_t size, void *token), void *token);
+
+    /**
+     *   Join consecutive segments (e.g. rotated recording files) into one file
+     *   without re-encoding. All segments must have the same tracks with the same
+     *   sample descriptions (codec, timescale, SPS/PPS/VPS or DSI), otherwise
+     *   MP4E_STATUS_INCOMPATIBLE_TRACKS is returned and nothing is written.
+     *   Each segment starts where first video track of previous one ends; last
+     *   sample of other tracks is stretched or shortened to keep them in sync.
+     *   mux must be just opened, non-sequential or fragmented, with no tracks. Without
+     *   fragmentation, sample tables are merged and written as one 'moov' by
+     *   MP4E_close(); with fragmentation, segments are written as fragments of
+     *   fragment_ms duration, cut at key frames.
+     *   Payloads are copied as large contiguous ranges with copy_callback, called
+     *   with read token of the source segment demuxer, or, if copy_callback is
+     *   NULL, with segment read_callback and mux write_callback
+     *
+     *   return error code MP4E_STATUS_*
+     */
+    int MP4E_concat(const MP4D_demux_t *const *segments, unsigned count, MP4E_mux_t *mux, unsigned fragment_ms,
+                    int (*copy_callback)(int64_t src_offset, int64_t dst_offset, size_t size, void *token));
+#endif
+
+#if MINIMP4_RECOVER_SUPPORTED
+    /**
+     *   Rebuild indexes of sequential mode file, which was not closed (e.g. power
+     *   loss): 'ftyp' followed by one 'mdat' box per sample and no 'moov'.
+     *   mux must be opened for the same file in sequential, non-fragmented mode,
+     *   with tracks added as by the recorder: SPS/PPS and DSI are kept in memory
+     *   until MP4E_close(), so the file does not have them. Payloads, which are
+     *   chains of NAL units, go to the first video track; others go to the first
+     *   audio track. Key frames are found by NAL types, sample durations are
+     *   default_duration of the track. Only box headers and NAL headers are read.
+     *   Then MP4E_close() writes 'moov' over the incomplete box at the file tail;
+     *   file should be truncated after the last write.
+     *   The file must not have 'moov' (check with MP4D_open() first)
+     *
+     *   return error code MP4E_STATUS_*
+     */
+    int MP4E_recover(MP4E_mux_t *mux, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token),
+                     void *token, int64_t file_size);
+#endif
+
+#if MINIMP4_JOURNAL_SUPPORTED
+    /**
+     *   Enable index journal for non-fragmented mux. Each interval_ms of media time
+     *   of any track, sample descriptors added since previous checkpoint are
+     *   appended to the journal by one write_callback() call, with tracks, SPS/PPS
+     *   and DSI when they have changed. Sample data must be durable before the
+     *   journal write refers to it: e.g. write_callback() may fdatasync() media
+     *   file first. Journal is written from offset 0 and is useless after
+     *   MP4E_close()
+     *
+     *   return error code MP4E_STATUS_*
+     */
+    int MP4E_set_journal(MP4E_mux_t *mux, unsigned interval_ms,
+                         int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token), void *token);
+
+    /**
+     *   Restore tracks and sample tables of unclosed file from its index journal.
+     *   mux must be opened for the file in sequential mode, with no tracks: the
+     *   mode of the original mux is taken from the journal. Torn record at the
+     *   journal tail and samples beyond file_size are ignored.
+     *   In sequential mode, sample boxes after the last checkpoint are recovered
+     *   as by MP4E_recover(), if read_callback is given, with duration of the last
+     *   journaled sample of the track, and 'moov' replaces torn box at the tail; file should be truncated after the last write. In
+     *   non-sequential mode, 'moov' is appended at file_size.
+     *   Then MP4E_close() writes 'moov'
+     *
+     *   return error code MP4E_STATUS_*
+     */
+    int MP4E_replay_journal(MP4E_mux_t *mux, const void *journal, size_t journal_bytes,
+                            int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token,
+                            int64_t file_size);
+#endif
+
+#if MINIMP4_INTERLEAVE_SUPPORTED
+    /**
+     *   Write samples of all tracks in decode time order, so player reads 'mdat'
+     *   strictly forward. MP4E_put_sample() copies samples to per-track queues;
+     *   a sample is written when no other track can have an earlier one. A track
+     *   which is behind (or has no samples yet) holds others back until they
+     *   queue window_ms of media, then its samples are written late.
+     *   The last sample of each track is written when the next one comes (it may
+     *   have continuations) or on MP4E_close(). window_ms 0 writes the queues
+     *   and disables interleaving
+     *
+     *   return error code MP4E_STATUS_*
+     */
+    int MP4E_set_interleave(MP4E_mux_t *mux, unsigned window_ms);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -756,6 +1236,7 @@ enum
  * @param boxsize_t offset
  * @param unsigned duration
  * @param unsigned flag_random_access
+ * @param int composition_offset
  *
  */
 typedef struct
@@ -764,6 +1245,7 @@ typedef struct
     boxsize_t offset;
     unsigned duration;
     unsigned flag_random_access;
+    int composition_offset; // 'ctts' offset, non-zero for reordered (remuxed) samples
 } sample_t;
 
 typedef struct
@@ -783,6 +1265,18 @@ typedef struct
     minimp4_vector_t vpps; // not used for audio
     minimp4_vector_t vvps; // used for HEVC
 
+#if MINIMP4_INTERLEAVE_SUPPORTED
+    minimp4_vector_t queue;  // samples held by interleaver: interleave_sample_t + data
+    int queue_read;          // bytes of queue already written
+    int queue_samples;       // queued samples, not counting continuations
+    uint64_t queue_dts;      // decode time of the first queued (or next) sample
+    uint64_t queue_duration; // duration of queued samples
+#endif
+#if MINIMP4_JOURNAL_SUPPORTED
+    int journal_samples;       // samples saved to index journal
+    int journal_param_bytes;   // vsps + vpps + vvps bytes saved to index journal
+    uint64_t journal_duration; // duration of samples added since last checkpoint
+#endif
 } track_t;
 
 typedef struct MP4E_mux_tag
@@ -798,6 +1292,18 @@ typedef struct MP4E_mux_tag
     int enable_fragmentation; // flag, indicating streaming-friendly 'fragmentation' mode
     int fragments_count;      // # of fragments in 'fragmentation' mode
 
+#if MINIMP4_INTERLEAVE_SUPPORTED
+    unsigned interleave_window_ms; // 0 if samples are written as they come
+#endif
+
+#if MINIMP4_JOURNAL_SUPPORTED
+    int (*journal_callback)(int64_t offset, const void *buffer, size_t size, void *token);
+    void *journal_token;
+    int64_t journal_pos;          // journal size
+    unsigned journal_interval_ms; // media time between checkpoints
+    unsigned journal_tracks;      // tracks saved to journal
+    minimp4_vector_t journal_buf; // checkpoint, written by one call
+#endif
 } MP4E_mux_t;
 
 static const unsigned char box_ftyp[] = {
@@ -99,6 +99,17 @@ MP4E_mux_t *MP4E_open(int sequential_mode_flag, int enable_fragmentation, void *
     mux->token = token;
     mux->text_comment = NULL;
     mux->write_pos = sizeof(box_ftyp);
+#if MINIMP4_JOURNAL_SUPPORTED
+    mux->journal_callback = NULL;
+    mux->journal_token = NULL;
+    mux->journal_pos = 0;
+    mux->journal_interval_ms = 0;
+    mux->journal_tracks = 0;
+    minimp4_vector_init(&mux->journal_buf, 0);
+#endif
+#if MINIMP4_INTERLEAVE_SUPPORTED
+    mux->interleave_window_ms = 0;
+#endif
 
     if (!mux->sequential_mode_flag)
     { // Write filler, which would be updated later
@@ -358,10 +369,18 @@ static int add_sample_descriptor(MP4E_mux_t *mux, track_t *tr, int data_bytes, i
     smp.offset = (boxsize_t)mux->write_pos;
     smp.duration = (duration ? duration : tr->info.default_duration);
     smp.flag_random_access = (kind == MP4E_SAMPLE_RANDOM_ACCESS);
+    smp.composition_offset = 0;
     return NULL != minimp4_vector_put(&tr->smpl, &smp, sizeof(sample_t));
 }
 
 static int mp4e_flush_index(MP4E_mux_t *mux);
+#if MINIMP4_JOURNAL_SUPPORTED
+static int journal_on_sample(MP4E_mux_t *mux, track_t *tr, unsigned duration);
+#endif
+#if MINIMP4_INTERLEAVE_SUPPORTED
+static int interleave_put(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind);
+static int interleave_flush(MP4E_mux_t *mux, int final);
+#endif
 
 /**
  * @brief Write Movie Fragment: 'moof' box
@@ -492,7 +511,7 @@ static int mp4e_write_mdat_box(MP4E_mux_t *mux, uint32_t size)
 }
 
 /**
- * @brief new sample to specified track
+ * @brief write new sample to specified track
  * @param MP4E_mux_t *mux
  * @param int track_num
  * @param void *data
@@ -500,7 +519,7 @@ static int mp4e_write_mdat_box(MP4E_mux_t *mux, uint32_t size)
  * @param int duration
  * @param int kind
  */
-int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+static int mp4e_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
 {
     LOG_INFO("MP4E put sample");
     track_t *tr;
@@ -535,6 +554,10 @@ int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_b
             ERR(write_pending_data(mux, tr));
         if (!add_sample_descriptor(mux, tr, data_bytes, duration, kind))
             return MP4E_STATUS_NO_MEMORY;
+#if MINIMP4_JOURNAL_SUPPORTED
+        if (mux->journal_callback)
+            ERR(journal_on_sample(mux, tr, duration));
+#endif
     }
     else
     {
@@ -562,6 +585,18 @@ int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_b
     return MP4E_STATUS_OK;
 }
 
+/**
+ * @brief new sample to specified track, queued if interleaving is enabled
+ */
+int MP4E_put_sample(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+{
+#if MINIMP4_INTERLEAVE_SUPPORTED
+    if (mux && mux->interleave_window_ms)
+        return interleave_put(mux, track_num, data, data_bytes, duration, kind);
+#endif
+    return mp4e_put_sample(mux, track_num, data, data_bytes, duration, kind);
+}
+
 /**
  *   calculate size of length field of OD box
  */
@@ -985,7 +1020,7 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
             }
             else
             {
-                int numOfVPS = items_count(&tr->vpps);
+                int numOfVPS = items_count(&tr->vvps);
                 ATOM(BOX_hvcC);
                 // TODO: read actual params from stream
                 WRITE_1(1);          // configurationVersion
@@ -1052,6 +1087,36 @@ static int mp4e_flush_index(MP4E_mux_t *mux)
         }
         END_ATOM;
 
+        // Composition Offset Box, only if presentation order differs from decoding order
+        {
+            int has_offsets = 0, has_negative = 0;
+            for (i = 0; i < samples_count; i++)
+            {
+                has_offsets |= sample[i].composition_offset != 0;
+                has_negative |= sample[i].composition_offset < 0;
+            }
+            if (has_offsets)
+            {
+                unsigned char *pentry_count;
+                int cnt = 1, entry_count = 0;
+                ATOM_FULL(BOX_ctts, has_negative ? 0x01000000 : 0); // version 1: signed offsets
+                pentry_count = p;
+                WRITE_4(0);
+                for (i = 0; i < samples_count; i++, cnt++)
+                {
+                    if (i == (samples_count - 1) || sample[i].composition_offset != sample[i + 1].composition_offset)
+                    {
+                        WRITE_4(cnt);
+                        WRITE_4(sample[i].composition_offset);
+                        cnt = 0;
+                        entry_count++;
+                    }
+                }
+                WR4(pentry_count, entry_count);
+                END_ATOM;
+            }
+        }
+
         // Sample To Chunk Box
         ATOM_FULL(BOX_stsc, 0);
         if (mux->enable_fragmentation)
@@ -1198,8 +1263,16 @@ int MP4E_close(MP4E_mux_t *mux)
     unsigned ntr, ntracks;
     if (!mux)
         return MP4E_STATUS_BAD_ARGUMENTS;
+#if MINIMP4_INTERLEAVE_SUPPORTED
+    if (mux->interleave_window_ms)
+        err = interleave_flush(mux, 1);
+#endif
     if (!mux->enable_fragmentation)
-        err = mp4e_flush_index(mux);
+    {
+        int index_err = mp4e_flush_index(mux);
+        if (err == MP4E_STATUS_OK)
+            err = index_err;
+    }
     if (mux->text_comment)
         free(mux->text_comment);
     ntracks = mux->tracks.bytes / sizeof(track_t);
@@ -1210,8 +1283,14 @@ int MP4E_close(MP4E_mux_t *mux)
         minimp4_vector_reset(&tr->vpps);
         minimp4_vector_reset(&tr->smpl);
         minimp4_vector_reset(&tr->pending_sample);
+#if MINIMP4_INTERLEAVE_SUPPORTED
+        minimp4_vector_reset(&tr->queue);
+#endif
     }
     minimp4_vector_reset(&mux->tracks);
+#if MINIMP4_JOURNAL_SUPPORTED
+    minimp4_vector_reset(&mux->journal_buf);
+#endif
     free(mux);
     return err;
 }
@@ -1817,6 +1896,34 @@ void mp4_h26x_write_close(mp4_h26x_writer_t *h)
     memset(h, 0, sizeof(*h));
 }
 
+/**
+ *   Put NAL with 4-byte size prefix to the track. Prefix and NAL go as two
+ *   pieces of one sample, so NAL is not copied; each fragment holds only one
+ *   piece, so fragmented output gets them joined
+ */
+static int mp4e_put_nal(MP4E_mux_t *mux, int track_id, const unsigned char *nal, int sizeof_nal, int duration, int kind)
+{
+    unsigned char size[4], *tmp;
+    int err;
+    size[0] = (unsigned char)(sizeof_nal >> 24);
+    size[1] = (unsigned char)(sizeof_nal >> 16);
+    size[2] = (unsigned char)(sizeof_nal >> 8);
+    size[3] = (unsigned char)(sizeof_nal);
+    if (!mux->enable_fragmentation)
+    {
+        ERR(MP4E_put_sample(mux, track_id, size, 4, duration, kind));
+        return MP4E_put_sample(mux, track_id, nal, sizeof_nal, duration, MP4E_SAMPLE_CONTINUATION);
+    }
+    tmp = (unsigned char *)malloc(4 + sizeof_nal);
+    if (!tmp)
+        return MP4E_STATUS_NO_MEMORY;
+    memcpy(tmp, size, 4);
+    memcpy(tmp + 4, nal, sizeof_nal);
+    err = MP4E_put_sample(mux, track_id, tmp, 4 + sizeof_nal, duration, kind);
+    free(tmp);
+    return err;
+}
+
 static int mp4_h265_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int sizeof_nal, unsigned timeStamp90kHz_next)
 {
     LOG_INFO("mp4 h265 write nal");
@@ -1845,19 +1952,10 @@ static int mp4_h265_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, in
         if (h->need_vps || h->need_sps || h->need_pps || h->need_idr)
             return MP4E_STATUS_BAD_ARGUMENTS;
         {
-            unsigned char *tmp = (unsigned char *)malloc(4 + sizeof_nal);
-            if (!tmp)
-                return MP4E_STATUS_NO_MEMORY;
             int sample_kind = MP4E_SAMPLE_DEFAULT;
-            tmp[0] = (unsigned char)(sizeof_nal >> 24);
-            tmp[1] = (unsigned char)(sizeof_nal >> 16);
-            tmp[2] = (unsigned char)(sizeof_nal >> 8);
-            tmp[3] = (unsigned char)(sizeof_nal);
-            memcpy(tmp + 4, nal, sizeof_nal);
             if (is_intra)
                 sample_kind = MP4E_SAMPLE_RANDOM_ACCESS;
-            err = MP4E_put_sample(h->mux, h->mux_track_id, tmp, 4 + sizeof_nal, timeStamp90kHz_next, sample_kind);
-            free(tmp);
+            err = mp4e_put_nal(h->mux, h->mux_track_id, nal, sizeof_nal, timeStamp90kHz_next, sample_kind);
         }
         break;
     }
@@ -1981,23 +2079,14 @@ int mp4_h26x_write_nal(mp4_h26x_writer_t *h, const unsigned char *nal, int lengt
             if (!h->need_pps && !h->need_idr)
             {
                 bit_reader_t bs[1];
-                unsigned char *tmp = (unsigned char *)malloc(4 + sizeof_nal);
-                if (!tmp)
-                    return MP4E_STATUS_NO_MEMORY;
                 init_bits(bs, nal + 1, sizeof_nal - 1);
                 unsigned first_mb_in_slice = ue_bits(bs);
                 int sample_kind = MP4E_SAMPLE_DEFAULT;
-                tmp[0] = (unsigned char)(sizeof_nal >> 24);
-                tmp[1] = (unsigned char)(sizeof_nal >> 16);
-                tmp[2] = (unsigned char)(sizeof_nal >> 8);
-                tmp[3] = (unsigned char)(sizeof_nal);
-                memcpy(tmp + 4, nal, sizeof_nal);
                 if (first_mb_in_slice)
                     sample_kind = MP4E_SAMPLE_CONTINUATION;
                 else if (payload_type == 5)
                     sample_kind = MP4E_SAMPLE_RANDOM_ACCESS;
-                err = MP4E_put_sample(h->mux, h->mux_track_id, tmp, 4 + sizeof_nal, timeStamp90kHz_next, sample_kind);
-                free(tmp);
+                err = mp4e_put_nal(h->mux, h->mux_track_id, nal, sizeof_nal, timeStamp90kHz_next, sample_kind);
             }
             break;
         }
@@ -2122,6 +2211,165 @@ typedef enum
     BOX_OD
 } boxtype_t;
 
+#if MP4D_HEVC_SUPPORTED
+// HEVCDecoderConfigurationRecord fields before numOfArrays
+#define HVCC_HEADER_BYTES 22
+
+/**
+ *   Convert HEVCDecoderConfigurationRecord to compact DSI table: VPS, SPS and PPS
+ *   arrays, in this order, each is 2-byte count followed by 2-byte size prefixed NALs.
+ *   Other arrays (SEI) are dropped. Output buffer must hold record_bytes + 6 bytes.
+ *   Return DSI size, or -1 if record is broken
+ */
+static int hvcc_to_dsi(const unsigned char *record, unsigned record_bytes, unsigned char *dsi)
+{
+    static const unsigned char nal_types[3] = {HEVC_NAL_VPS, HEVC_NAL_SPS, HEVC_NAL_PPS};
+    unsigned char *p = dsi;
+    int t;
+    for (t = 0; t < 3; t++)
+    {
+        unsigned char *count_pos = p;
+        unsigned count = 0, pos = HVCC_HEADER_BYTES + 1, a, num_arrays = record[HVCC_HEADER_BYTES];
+        p += 2;
+        for (a = 0; a < num_arrays; a++)
+        {
+            unsigned n, num_nalus, type;
+            if (pos + 3 > record_bytes)
+                return -1;
+            type = record[pos] & 0x3f;
+            num_nalus = record[pos + 1] * 256 + record[pos + 2];
+            pos += 3;
+            for (n = 0; n < num_nalus; n++)
+            {
+                unsigned nal_bytes;
+                if (pos + 2 > record_bytes)
+                    return -1;
+                nal_bytes = record[pos] * 256 + record[pos + 1];
+                if (pos + 2 + nal_bytes > record_bytes)
+                    return -1;
+                if (type == nal_types[t])
+                {
+                    memcpy(p, record + pos, 2 + nal_bytes);
+                    p += 2 + nal_bytes;
+                    count++;
+                }
+                pos += 2 + nal_bytes;
+            }
+        }
+        count_pos[0] = (unsigned char)(count >> 8);
+        count_pos[1] = (unsigned char)count;
+    }
+    return (int)(p - dsi);
+}
+#endif
+
+/**
+ *   Build sparse checkpoints for run table, one per MP4D_RUN_CHECKPOINT_INTERVAL runs.
+ *   Short tables are walked from the beginning and get no checkpoints.
+ *   Return 1 on success, 0 on failure
+ */
+static int run_table_index(MP4D_run_table_t *rt)
+{
+    unsigned i, first_sample = 0;
+    uint64_t sum = 0;
+    rt->checkpoint_count = 0;
+    if (rt->run_count <= MP4D_RUN_CHECKPOINT_INTERVAL)
+        return 1;
+    rt->checkpoint = (MP4D_run_checkpoint_t *)malloc((rt->run_count / MP4D_RUN_CHECKPOINT_INTERVAL + 1) * sizeof(MP4D_run_checkpoint_t));
+    if (!rt->checkpoint)
+        return 0;
+    for (i = 0; i < rt->run_count; i++)
+    {
+        if (!(i % MP4D_RUN_CHECKPOINT_INTERVAL))
+        {
+            MP4D_run_checkpoint_t *cp = rt->checkpoint + rt->checkpoint_count++;
+            cp->run = i;
+            cp->first_sample = first_sample;
+            cp->sum = sum;
+        }
+        first_sample += rt->run[i].count;
+        sum += (uint64_t)rt->run[i].count * rt->run[i].value;
+    }
+    return 1;
+}
+
+/**
+ *   Find run, containing given sum (decode time for 'stts').
+ *   Returns run number, first sample of this run and sum of preceding runs, or -1
+ */
+static int run_table_find_sum(const MP4D_run_table_t *rt, uint64_t value, unsigned *first_sample, uint64_t *sum)
+{
+    unsigned i = 0, start = 0;
+    uint64_t acc = 0;
+    if (rt->checkpoint_count)
+    {
+        // last checkpoint at or before given sum
+        unsigned lo = 0, hi = rt->checkpoint_count;
+        while (hi - lo > 1)
+        {
+            unsigned mid = (lo + hi) / 2;
+            if (rt->checkpoint[mid].sum <= value)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        i = rt->checkpoint[lo].run;
+        start = rt->checkpoint[lo].first_sample;
+        acc = rt->checkpoint[lo].sum;
+    }
+    for (; i < rt->run_count; i++)
+    {
+        uint64_t run_sum = (uint64_t)rt->run[i].count * rt->run[i].value;
+        if (value - acc < run_sum)
+        {
+            *first_sample = start;
+            *sum = acc;
+            return (int)i;
+        }
+        start += rt->run[i].count;
+        acc += run_sum;
+    }
+    return -1;
+}
+
+/**
+ *   Find run, containing given sample.
+ *   Returns run number, first sample of this run and sum of preceding runs, or -1
+ */
+static int run_table_find(const MP4D_run_table_t *rt, unsigned nsample, unsigned *first_sample, uint64_t *sum)
+{
+    unsigned i = 0, start = 0;
+    uint64_t acc = 0;
+    if (rt->checkpoint_count)
+    {
+        // last checkpoint at or before given sample
+        unsigned lo = 0, hi = rt->checkpoint_count;
+        while (hi - lo > 1)
+        {
+            unsigned mid = (lo + hi) / 2;
+            if (rt->checkpoint[mid].first_sample <= nsample)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        i = rt->checkpoint[lo].run;
+        start = rt->checkpoint[lo].first_sample;
+        acc = rt->checkpoint[lo].sum;
+    }
+    for (; i < rt->run_count; i++)
+    {
+        if (nsample - start < rt->run[i].count)
+        {
+            *first_sample = start;
+            *sum = acc;
+            return (int)i;
+        }
+        start += rt->run[i].count;
+        acc += (uint64_t)rt->run[i].count * rt->run[i].value;
+    }
+    return -1;
+}
+
 int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size)
 {
     LOG_INFO("MP4D open");
@@ -2181,13 +2429,14 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
 #endif
 #if MP4D_TRACE_TIMESTAMPS
             {BOX_stts, 0, 0},
-            {BOX_ctts, 0, 0},
+            {BOX_ctts, 1, 1},
 #endif
             {BOX_stz2, 0, 1},
             {BOX_stsz, 0, 1},
             {BOX_stsc, 0, 1},
             {BOX_stco, 0, 1},
             {BOX_co64, 0, 1},
+            {BOX_stss, 0, 1},
             {BOX_stsd, 0, 0},
             {BOX_esds, 0, 1} // esds does not use track, but switches to OD mode. Check here, to avoid OD check
         };
@@ -2225,6 +2474,7 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
 #endif
 #if MP4D_HEVC_SUPPORTED
             {BOX_hvc1, BOX_ATOM},
+            {BOX_hev1, BOX_ATOM},
 #endif
             {BOX_udta, BOX_ATOM},
             {BOX_meta, BOX_ATOM},
@@ -2385,12 +2635,21 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
             int size = 0;
             uint32_t sample_size = READ(4);
             tr->sample_count = READ(4);
-            MALLOC(unsigned int *, tr->entry_size, tr->sample_count * 4);
+            if (box_name == BOX_stsz && sample_size)
+            {
+                // all samples have the same size: no per-sample table
+                tr->sample_size = sample_size;
+                break;
+            }
+            if (tr->sample_count)
+            {
+                MALLOC(unsigned int *, tr->entry_size, tr->sample_count * 4);
+            }
             for (i = 0; i < tr->sample_count; i++)
             {
                 if (box_name == BOX_stsz)
                 {
-                    tr->entry_size[i] = (sample_size ? sample_size : READ(4));
+                    tr->entry_size[i] = READ(4);
                 }
                 else
                 {
@@ -2421,22 +2680,48 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
 
         case BOX_stsc: // ISO/IEC 14496-12 Page 38. Section 8.18 - Sample To Chunk Box.
             tr->sample_to_chunk_count = READ(4);
+            if (tr->sample_to_chunk_count > payload_bytes / 12)
+            {
+                ERROR("broken stsc box!");
+            }
             MALLOC(MP4D_sample_to_chunk_t *, tr->sample_to_chunk, tr->sample_to_chunk_count * sizeof(tr->sample_to_chunk[0]));
             for (i = 0; i < tr->sample_to_chunk_count; i++)
             {
                 tr->sample_to_chunk[i].first_chunk = READ(4);
                 tr->sample_to_chunk[i].samples_per_chunk = READ(4);
                 SKIP(4); // sample_description_index
+                // count samples in the preceding groups once, so that lookup does not walk chunks
+                tr->sample_to_chunk[i].first_sample = 0;
+                if (i)
+                {
+                    const MP4D_sample_to_chunk_t *prev = tr->sample_to_chunk + i - 1;
+                    tr->sample_to_chunk[i].first_sample = prev->first_sample;
+                    if (tr->sample_to_chunk[i].first_chunk > prev->first_chunk) // else broken file: empty group
+                    {
+                        tr->sample_to_chunk[i].first_sample += (tr->sample_to_chunk[i].first_chunk - prev->first_chunk) * prev->samples_per_chunk;
+                    }
+                }
             }
             break;
 #if MP4D_TRACE_TIMESTAMPS || MP4D_TIMESTAMPS_SUPPORTED
         case BOX_stts:
         {
             unsigned count = READ(4);
-            unsigned j, k = 0, ts = 0, ts_count = count;
+            if (count > payload_bytes / 8)
+            {
+                ERROR("broken stts box!");
+            }
 #if MP4D_TIMESTAMPS_SUPPORTED
-            MALLOC(unsigned int *, tr->timestamp, ts_count * 4);
-            MALLOC(unsigned int *, tr->duration, ts_count * 4);
+            if (!tr)
+            {
+                ERROR("broken file structure!");
+            }
+            // keep the table run-length coded, as it is stored in the file
+            tr->stts.run_count = count;
+            if (count)
+            {
+                MALLOC(MP4D_run_t *, tr->stts.run, count * sizeof(MP4D_run_t));
+            }
 #endif
 
             for (i = 0; i < count; i++)
@@ -2445,33 +2730,56 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
                 int d = READ(4);
                 TRACE(("sample %8d count %8d duration %8d\n", i, sc, d));
 #if MP4D_TIMESTAMPS_SUPPORTED
-                if (k + sc > ts_count)
-                {
-                    ts_count = k + sc;
-                    tr->timestamp = (unsigned int *)realloc(tr->timestamp, ts_count * sizeof(unsigned));
-                    tr->duration = (unsigned int *)realloc(tr->duration, ts_count * sizeof(unsigned));
-                }
-                for (j = 0; j < sc; j++)
-                {
-                    tr->duration[k] = d;
-                    tr->timestamp[k++] = ts;
-                    ts += d;
-                }
+                tr->stts.run[i].count = sc;
+                tr->stts.run[i].value = d;
 #endif
             }
+#if MP4D_TIMESTAMPS_SUPPORTED
+            if (!run_table_index(&tr->stts))
+            {
+                ERROR("out of memory");
+            }
+#endif
         }
         break;
         case BOX_ctts:
         {
             unsigned count = READ(4);
+            if (count > payload_bytes / 8)
+            {
+                ERROR("broken ctts box!");
+            }
+#if MP4D_TIMESTAMPS_SUPPORTED
+            if (!tr)
+            {
+                ERROR("broken file structure!");
+            }
+            tr->ctts.run_count = count;
+            if (count)
+            {
+                MALLOC(MP4D_run_t *, tr->ctts.run, count * sizeof(MP4D_run_t));
+            }
+#endif
             for (i = 0; i < count; i++)
             {
                 int sc = READ(4);
-                int d = READ(4);
-                (void)sc;
-                (void)d;
+                int d = READ(4); // signed for version 1, and for version 0 in practice
                 TRACE(("sample %8d count %8d decoding to composition offset %8d\n", i, sc, d));
+#if MP4D_TIMESTAMPS_SUPPORTED
+                tr->ctts.run[i].count = sc;
+                tr->ctts.run[i].value = d;
+                if (!i || d < tr->ctts_min_offset)
+                    tr->ctts_min_offset = d;
+                if (!i || d > tr->ctts_max_offset)
+                    tr->ctts_max_offset = d;
+#endif
+            }
+#if MP4D_TIMESTAMPS_SUPPORTED
+            if (!run_table_index(&tr->ctts))
+            {
+                ERROR("out of memory");
             }
+#endif
         }
         break;
 #endif
@@ -2496,6 +2804,24 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
             }
             break;
 
+        case BOX_stss: // ISO/IEC 14496-12 Section 8.6.2 - Sync Sample Box.
+            tr->sync_count = READ(4);
+            if (tr->sync_count > payload_bytes / 4)
+            {
+                ERROR("broken stss box!");
+            }
+            // allocate at least one entry: NULL table means 'all samples are sync'
+            MALLOC(unsigned *, tr->sync_sample, (tr->sync_count + 1) * sizeof(unsigned));
+            for (i = 0; i < tr->sync_count; i++)
+            {
+                tr->sync_sample[i] = READ(4) - 1; // samples counted starting with '1'
+                if (i && tr->sync_sample[i] <= tr->sync_sample[i - 1])
+                {
+                    ERROR("broken stss box!");
+                }
+            }
+            break;
+
 #if MP4D_INFO_SUPPORTED
         case BOX_mvhd:
             SKIP(((FullAtomVersionAndFlags >> 24) == 1) ? 8 + 8 : 4 + 4);
@@ -2591,11 +2917,17 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
 #endif
             break;
 
+#if MP4D_AVC_SUPPORTED || MP4D_HEVC_SUPPORTED
 #if MP4D_AVC_SUPPORTED
         case BOX_avc1: // AVCSampleEntry extends VisualSampleEntry
                        //         case BOX_avc2:   - no test
                        //         case BOX_svc1:   - no test
         case BOX_mp4v:
+#endif
+#if MP4D_HEVC_SUPPORTED
+        case BOX_hvc1: // HEVCSampleEntry extends VisualSampleEntry
+        case BOX_hev1:
+#endif
             if (!tr)
             {
                 ERROR("broken file structure!");
@@ -2617,8 +2949,12 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
             //      BOX_m4ds (optional)
             // for BOX_mp4v:
             //      BOX_esds
+            // for BOX_hvc1, BOX_hev1:
+            //      BOX_hvcC
             break;
+#endif
 
+#if MP4D_AVC_SUPPORTED
         case BOX_avcC: // AVCDecoderConfigurationRecord()
             // hack: AAC-specific DSI field reused (for it have same purpoose as sps/pps)
             // TODO: check this hack if BOX_esds co-exist with BOX_avcC
@@ -2639,7 +2975,7 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
                 (void)AVCProfileIndication;
                 (void)profile_compatibility;
                 (void)AVCLevelIndication;
-                (void)lengthSizeMinusOne;
+                tr->nal_length_size = lengthSizeMinusOne + 1;
 
                 for (spspps = 0; spspps < 2; spspps++)
                 {
@@ -2664,6 +3000,42 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
             break;
 #endif // MP4D_AVC_SUPPORTED
 
+#if MP4D_HEVC_SUPPORTED
+        case BOX_hvcC: // HEVCDecoderConfigurationRecord()
+            // same DSI hack as for BOX_avcC: keep VPS, SPS and PPS arrays
+            if (!tr)
+            {
+                ERROR("broken file structure!");
+            }
+            if (payload_bytes < HVCC_HEADER_BYTES + 1)
+            {
+                ERROR("broken hvcC box!");
+            }
+            {
+                int dsi_bytes;
+                unsigned char *record;
+                unsigned record_bytes = (unsigned)payload_bytes;
+                MALLOC(unsigned char *, record, record_bytes);
+                for (i = 0; i < record_bytes; i++)
+                {
+                    record[i] = minimp4_read(mp4, 1, &eof_flag); // These bytes available due to check above
+                }
+                payload_bytes -= i;
+                tr->nal_length_size = (record[HVCC_HEADER_BYTES - 1] & 3) + 1; // lengthSizeMinusOne
+                free(tr->dsi);
+                tr->dsi = (unsigned char *)malloc(record_bytes + 6);
+                dsi_bytes = tr->dsi ? hvcc_to_dsi(record, record_bytes, tr->dsi) : -1;
+                free(record);
+                if (dsi_bytes < 0)
+                {
+                    ERROR("broken hvcC box!");
+                }
+                tr->object_type_indication = MP4_OBJECT_TYPE_HEVC;
+                tr->dsi_bytes = (unsigned)dsi_bytes;
+            }
+            break;
+#endif // MP4D_HEVC_SUPPORTED
+
         case OD_ESD:
         {
             unsigned flags = READ(3); // ES_ID(2) + flags(1)
@@ -2808,110 +3180,366 @@ int MP4D_open(MP4D_demux_t *mp4, int (*read_callback)(int64_t offset, void *buff
  *   Find chunk, containing given sample.
  *   Returns chunk number, and first sample in this chunk.
  */
-static int sample_to_chunk(MP4D_track_t *tr, unsigned nsample, unsigned *nfirst_sample_in_chunk)
+static int sample_to_chunk(const MP4D_track_t *tr, unsigned nsample, unsigned *nfirst_sample_in_chunk)
 {
-    LOG_INFO("Find chuck, containing given sample");
-    unsigned chunk_group = 0, nc;
-    unsigned sum = 0;
+    unsigned lo = 0, hi, nc;
+    const MP4D_sample_to_chunk_t *group;
     *nfirst_sample_in_chunk = 0;
     if (tr->chunk_count <= 1)
     {
         return 0;
     }
-    for (nc = 0; nc < tr->chunk_count; nc++)
+    if (!tr->sample_to_chunk_count)
     {
-        if (chunk_group + 1 < tr->sample_to_chunk_count              // stuck at last entry till EOF
-            && nc + 1 ==                                             // Chunks counted starting with '1'
-                   tr->sample_to_chunk[chunk_group + 1].first_chunk) // next group?
-        {
-            chunk_group++;
-        }
+        return -1;
+    }
 
-        sum += tr->sample_to_chunk[chunk_group].samples_per_chunk;
-        if (nsample < sum)
-            return nc;
+    // last group, which starts at or before given sample
+    hi = tr->sample_to_chunk_count;
+    while (hi - lo > 1)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (tr->sample_to_chunk[mid].first_sample <= nsample)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    group = tr->sample_to_chunk + lo;
+    if (!group->samples_per_chunk || !group->first_chunk)
+    {
+        return -1;
+    }
 
-        // TODO: this can be calculated once per file
-        *nfirst_sample_in_chunk = sum;
+    // Chunks counted starting with '1'
+    nc = group->first_chunk - 1 + (nsample - group->first_sample) / group->samples_per_chunk;
+    if (nc >= tr->chunk_count)
+    {
+        return -1;
     }
-    return -1;
+    *nfirst_sample_in_chunk = group->first_sample + (nc + 1 - group->first_chunk) * group->samples_per_chunk;
+    return nc;
+}
+
+/**
+ *   Size of given sample
+ */
+static unsigned sample_size(const MP4D_track_t *tr, unsigned nsample)
+{
+    return tr->entry_size ? tr->entry_size[nsample] : tr->sample_size;
+}
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+/**
+ *   Decode time and duration of given sample from 'stts' runs.
+ *   Return 1 on success, 0 if sample is not covered by the table
+ */
+static int sample_time(const MP4D_track_t *tr, unsigned nsample, uint64_t *timestamp, unsigned *duration)
+{
+    unsigned first_sample;
+    uint64_t sum;
+    int nrun = run_table_find(&tr->stts, nsample, &first_sample, &sum);
+    if (nrun < 0)
+    {
+        *timestamp = 0;
+        *duration = 0;
+        return 0;
+    }
+    *duration = tr->stts.run[nrun].value;
+    *timestamp = sum + (uint64_t)(nsample - first_sample) * *duration;
+    return 1;
+}
+
+/**
+ *   Decode-to-presentation offset of given sample from 'ctts' runs
+ */
+static int sample_composition_offset(const MP4D_track_t *tr, unsigned nsample)
+{
+    unsigned first_sample;
+    uint64_t sum;
+    int nrun;
+    if (!tr->ctts.run_count)
+        return 0;
+    nrun = run_table_find(&tr->ctts, nsample, &first_sample, &sum);
+    return nrun < 0 ? 0 : (int)tr->ctts.run[nrun].value;
+}
+
+/**
+ *   Presentation time of given sample
+ */
+static int64_t sample_pts(const MP4D_track_t *tr, unsigned nsample)
+{
+    uint64_t dts;
+    unsigned duration;
+    sample_time(tr, nsample, &dts, &duration);
+    return (int64_t)dts + sample_composition_offset(tr, nsample);
 }
+#endif
 
 // Exported API function
 MP4D_file_offset_t MP4D_frame_offset(const MP4D_demux_t *mp4, unsigned ntrack, unsigned nsample, unsigned *frame_bytes, unsigned *timestamp, unsigned *duration)
 {
-    LOG_INFO("MP4D frame offset");
-    MP4D_track_t *tr = mp4->track + ntrack;
+    MP4D_track_t *tr;
     unsigned ns;
-    int nchunk = sample_to_chunk(tr, nsample, &ns);
+    int nchunk;
     MP4D_file_offset_t offset;
 
+    *frame_bytes = 0;
+    if (ntrack >= mp4->track_count || nsample >= mp4->track[ntrack].sample_count)
+    {
+        return 0;
+    }
+    tr = mp4->track + ntrack;
+    nchunk = sample_to_chunk(tr, nsample, &ns);
     if (nchunk < 0)
     {
-        *frame_bytes = 0;
         return 0;
     }
 
     offset = tr->chunk_offset[nchunk];
-    for (; ns < nsample; ns++)
+    if (tr->entry_size)
+    {
+        for (; ns < nsample; ns++)
+        {
+            offset += tr->entry_size[ns];
+        }
+    }
+    else
     {
-        offset += tr->entry_size[ns];
+        offset += (MP4D_file_offset_t)(nsample - ns) * tr->sample_size;
     }
 
-    *frame_bytes = tr->entry_size[ns];
+    *frame_bytes = sample_size(tr, nsample);
 
-    if (timestamp)
-    {
 #if MP4D_TIMESTAMPS_SUPPORTED
-        *timestamp = tr->timestamp[ns];
+    if (timestamp || duration)
+    {
+        uint64_t ts;
+        unsigned dur;
+        sample_time(tr, nsample, &ts, &dur);
+        if (timestamp)
+            *timestamp = (unsigned)ts;
+        if (duration)
+            *duration = dur;
+    }
 #else
+    if (timestamp)
         *timestamp = 0;
-#endif
-    }
     if (duration)
-    {
-#if MP4D_TIMESTAMPS_SUPPORTED
-        *duration = tr->duration[ns];
-#else
         *duration = 0;
 #endif
-    }
 
     return offset;
 }
 
-#define FREE(x)   \
-    if (x)        \
-    {             \
-        free(x);  \
-        x = NULL; \
+/**
+ *   Find nearest sync sample at or before given sample.
+ *   Returns first sync sample if none precedes, or -1 if track has no sync samples
+ */
+static int sync_sample_before(const MP4D_track_t *tr, unsigned nsample)
+{
+    unsigned lo = 0, hi = tr->sync_count;
+    if (!tr->sync_sample)
+        return (int)nsample; // no 'stss' box: every sample is a sync sample
+    if (!tr->sync_count)
+        return -1;
+    while (hi - lo > 1)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (tr->sync_sample[mid] <= nsample)
+            lo = mid;
+        else
+            hi = mid;
     }
+    return (int)tr->sync_sample[lo];
+}
 
 // Exported API function
-void MP4D_close(MP4D_demux_t *mp4)
+int MP4D_sample_is_sync(const MP4D_demux_t *mp4, unsigned ntrack, unsigned nsample)
 {
-    LOG_INFO("MP4D close");
-    while (mp4->track_count)
-    {
-        MP4D_track_t *tr = mp4->track + --mp4->track_count;
-        FREE(tr->entry_size);
-#if MP4D_TIMESTAMPS_SUPPORTED
-        FREE(tr->timestamp);
-        FREE(tr->duration);
+    int nsync;
+    if (ntrack >= mp4->track_count || nsample >= mp4->track[ntrack].sample_count)
+        return 0;
+    nsync = sync_sample_before(mp4->track + ntrack, nsample);
+    return nsync >= 0 && (unsigned)nsync == nsample;
+}
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+// Exported API function
+int MP4D_seek(const MP4D_demux_t *mp4, unsigned ntrack, uint64_t time, unsigned *sample, unsigned *keyframe_sample)
+{
+    LOG_INFO("MP4D seek");
+    const MP4D_track_t *tr;
+    unsigned first_sample, nsample;
+    uint64_t sum;
+    int nrun, nsync;
+
+    if (!mp4 || ntrack >= mp4->track_count || !mp4->track[ntrack].sample_count)
+        return 0;
+    tr = mp4->track + ntrack;
+
+    nrun = run_table_find_sum(&tr->stts, time, &first_sample, &sum);
+    if (nrun >= 0)
+    {
+        unsigned delta = tr->stts.run[nrun].value;
+        nsample = first_sample + (delta ? (unsigned)((time - sum) / delta) : 0);
+    }
+    else
+    {
+        nsample = tr->sample_count - 1; // past the end (or empty 'stts')
+    }
+    if (nsample >= tr->sample_count)
+        nsample = tr->sample_count - 1;
+
+    nsync = sync_sample_before(tr, nsample);
+    if (nsync < 0)
+        return 0;
+
+    if (sample)
+        *sample = nsample;
+    if (keyframe_sample)
+        *keyframe_sample = (unsigned)nsync;
+    return 1;
+}
+#endif
+
+// Exported API function
+int MP4D_sample_info(const MP4D_demux_t *mp4, unsigned ntrack, unsigned nsample, MP4D_sample_info_t *info)
+{
+    unsigned frame_bytes;
+    if (!mp4 || !info || ntrack >= mp4->track_count || nsample >= mp4->track[ntrack].sample_count)
+        return 0;
+    memset(info, 0, sizeof(*info));
+    info->offset = MP4D_frame_offset(mp4, ntrack, nsample, &frame_bytes, NULL, NULL);
+    info->size = frame_bytes;
+#if MP4D_TIMESTAMPS_SUPPORTED
+    {
+        const MP4D_track_t *tr = mp4->track + ntrack;
+        sample_time(tr, nsample, &info->dts, &info->duration);
+        info->pts = (int64_t)info->dts + sample_composition_offset(tr, nsample);
+    }
+#endif
+    info->is_sync = MP4D_sample_is_sync(mp4, ntrack, nsample);
+    return 1;
+}
+
+#if MP4D_TIMESTAMPS_SUPPORTED
+/**
+ *   Last sample with decode time at or before given time, 0 if time is negative
+ */
+static unsigned sample_at_dts(const MP4D_track_t *tr, int64_t time)
+{
+    unsigned first_sample, nsample;
+    uint64_t sum;
+    int nrun;
+    if (time <= 0)
+        return 0;
+    nrun = run_table_find_sum(&tr->stts, (uint64_t)time, &first_sample, &sum);
+    if (nrun < 0)
+        return tr->sample_count - 1;
+    nsample = first_sample;
+    if (tr->stts.run[nrun].value)
+        nsample += (unsigned)(((uint64_t)time - sum) / tr->stts.run[nrun].value);
+    return MINIMP4_MIN(nsample, tr->sample_count - 1);
+}
+
+// Exported API function
+int MP4D_seek_pts(const MP4D_demux_t *mp4, unsigned ntrack, int64_t time, unsigned *sample, unsigned *keyframe_sample)
+{
+    LOG_INFO("MP4D seek pts");
+    const MP4D_track_t *tr;
+    unsigned lo, hi, ns, best = 0, first = 0, duration;
+    int64_t best_pts = 0, first_pts = 0;
+    uint64_t dts;
+    int found = 0, nsync;
+
+    if (!mp4 || ntrack >= mp4->track_count || !mp4->track[ntrack].sample_count)
+        return 0;
+    tr = mp4->track + ntrack;
+    if (!tr->ctts.run_count)
+        return MP4D_seek(mp4, ntrack, time < 0 ? 0 : (uint64_t)time, sample, keyframe_sample);
+
+    // every sample is displayed before this time: keep the window at the track end
+    sample_time(tr, tr->sample_count - 1, &dts, &duration);
+    if (time > (int64_t)dts + tr->ctts_max_offset)
+        time = (int64_t)dts + tr->ctts_max_offset;
+
+    // pts = dts + offset, offset in [min, max]: samples with dts after (time - min) are
+    // displayed later; sample with dts at or before (time - max) is displayed at or before
+    // given time, so no better candidate can have dts before its dts - (max - min)
+    hi = sample_at_dts(tr, time - tr->ctts_min_offset);
+    lo = sample_at_dts(tr, time - tr->ctts_max_offset);
+    sample_time(tr, lo, &dts, &duration);
+    lo = sample_at_dts(tr, (int64_t)dts - tr->ctts_max_offset + tr->ctts_min_offset);
+    for (ns = lo; ns <= hi; ns++)
+    {
+        int64_t pts = sample_pts(tr, ns);
+        if (pts <= time && (!found || pts > best_pts))
+        {
+            found = 1;
+            best = ns;
+            best_pts = pts;
+        }
+        if (ns == lo || pts < first_pts)
+        {
+            first = ns;
+            first_pts = pts;
+        }
+    }
+    if (!found)
+        best = first; // given time precedes the first displayed sample
+
+    nsync = sync_sample_before(tr, best);
+    if (nsync < 0)
+        return 0;
+    if (sample)
+        *sample = best;
+    if (keyframe_sample)
+        *keyframe_sample = (unsigned)nsync;
+    return 1;
+}
+#endif
+
+#define FREE(x)   \
+    if (x)        \
+    {             \
+        free(x);  \
+        x = NULL; \
+    }
+
+// Exported API function
+void MP4D_close(MP4D_demux_t *mp4)
+{
+    LOG_INFO("MP4D close");
+    while (mp4->track_count)
+    {
+        MP4D_track_t *tr = mp4->track + --mp4->track_count;
+        if (mp4->index)
+            continue; // tables are in index sidecar memory, owned by the caller
+        FREE(tr->entry_size);
+#if MP4D_TIMESTAMPS_SUPPORTED
+        FREE(tr->stts.run);
+        FREE(tr->stts.checkpoint);
+        FREE(tr->ctts.run);
+        FREE(tr->ctts.checkpoint);
 #endif
         FREE(tr->sample_to_chunk);
         FREE(tr->chunk_offset);
+        FREE(tr->sync_sample);
         FREE(tr->dsi);
     }
     FREE(mp4->track);
 #if MP4D_INFO_SUPPORTED
-    FREE(mp4->tag.title);
-    FREE(mp4->tag.artist);
-    FREE(mp4->tag.album);
-    FREE(mp4->tag.year);
-    FREE(mp4->tag.comment);
-    FREE(mp4->tag.genre);
+    if (!mp4->index)
+    {
+        FREE(mp4->tag.title);
+        FREE(mp4->tag.artist);
+        FREE(mp4->tag.album);
+        FREE(mp4->tag.year);
+        FREE(mp4->tag.comment);
+        FREE(mp4->tag.genre);
+    }
 #endif
+    mp4->index = NULL;
 }
 
 static int skip_spspps(const unsigned char *p, int nbytes, int nskip)
@@ -2929,50 +3557,2345 @@ static int skip_spspps(const unsigned char *p, int nbytes, int nskip)
     return k;
 }
 
-static const void *MP4D_read_spspps(const MP4D_demux_t *mp4, unsigned int ntrack, int pps_flag, int nsps, int *sps_bytes)
+#define PARAM_SET_VPS 0
+#define PARAM_SET_SPS 1
+#define PARAM_SET_PPS 2
+
+/**
+ *   Find parameter set in track DSI.
+ *   AVC DSI (from 'avcC') holds SPS and PPS arrays with 1-byte count,
+ *   HEVC DSI (from 'hvcC') holds VPS, SPS and PPS arrays with 2-byte count
+ */
+static const void *MP4D_read_spspps(const MP4D_demux_t *mp4, unsigned int ntrack, int array, int nsps, int *sps_bytes)
 {
     LOG_INFO("MP4D read sps pps");
-    int sps_count, skip_bytes;
-    int bytepos = 0;
-    unsigned char *p = mp4->track[ntrack].dsi;
-    if (ntrack >= mp4->track_count)
+    const MP4D_track_t *tr;
+    const unsigned char *p;
+    int sps_count, skip_bytes, count_bytes, dsi_bytes, nal_bytes;
+    int bytepos = 0, narray;
+    if (!mp4 || ntrack >= mp4->track_count || nsps < 0)
+        return NULL;
+    tr = mp4->track + ntrack;
+    if (tr->object_type_indication == MP4_OBJECT_TYPE_AVC)
+    {
+        count_bytes = 1;
+        narray = PARAM_SET_SPS; // no VPS in AVC
+    }
+    else if (tr->object_type_indication == MP4_OBJECT_TYPE_HEVC)
+    {
+        count_bytes = 2;
+        narray = PARAM_SET_VPS;
+    }
+    else
+    {
+        return NULL; // parameter sets are specific for AVC/HEVC formats only
+    }
+    if (array < narray || !tr->dsi)
         return NULL;
-    if (mp4->track[ntrack].object_type_indication != MP4_OBJECT_TYPE_AVC)
-        return NULL; // SPS/PPS are specific for AVC format only
+    p = tr->dsi;
+    dsi_bytes = (int)tr->dsi_bytes;
 
-    if (pps_flag)
+    // Skip arrays before the given target
+    for (;; narray++)
     {
-        // Skip all SPS
-        sps_count = p[bytepos++];
-        skip_bytes = skip_spspps(p + bytepos, mp4->track[ntrack].dsi_bytes - bytepos, sps_count);
+        if (bytepos + count_bytes > dsi_bytes)
+            return NULL;
+        sps_count = count_bytes == 1 ? p[bytepos] : p[bytepos] * 256 + p[bytepos + 1];
+        bytepos += count_bytes;
+        if (narray == array)
+            break;
+        skip_bytes = skip_spspps(p + bytepos, dsi_bytes - bytepos, sps_count);
         if (skip_bytes < 0)
             return NULL;
         bytepos += skip_bytes;
     }
 
     // Skip sps/pps before the given target
-    sps_count = p[bytepos++];
     if (nsps >= sps_count)
         return NULL;
-    skip_bytes = skip_spspps(p + bytepos, mp4->track[ntrack].dsi_bytes - bytepos, nsps);
-    if (skip_bytes < 0)
+    skip_bytes = skip_spspps(p + bytepos, dsi_bytes - bytepos, nsps);
+    if (skip_bytes < 0 || bytepos + skip_bytes + 2 > dsi_bytes)
         return NULL;
     bytepos += skip_bytes;
-    *sps_bytes = p[bytepos] * 256 + p[bytepos + 1];
+    nal_bytes = p[bytepos] * 256 + p[bytepos + 1];
+    if (bytepos + 2 + nal_bytes > dsi_bytes)
+        return NULL;
+    *sps_bytes = nal_bytes;
     return p + bytepos + 2;
 }
 
+const void *MP4D_read_vps(const MP4D_demux_t *mp4, unsigned int ntrack, int nvps, int *vps_bytes)
+{
+    LOG_INFO("MP4D read vps");
+    return MP4D_read_spspps(mp4, ntrack, PARAM_SET_VPS, nvps, vps_bytes);
+}
+
 const void *MP4D_read_sps(const MP4D_demux_t *mp4, unsigned int ntrack, int nsps, int *sps_bytes)
 {
     LOG_INFO("MP4D read sps");
-    return MP4D_read_spspps(mp4, ntrack, 0, nsps, sps_bytes);
+    return MP4D_read_spspps(mp4, ntrack, PARAM_SET_SPS, nsps, sps_bytes);
 }
 
 const void *MP4D_read_pps(const MP4D_demux_t *mp4, unsigned int ntrack, int npps, int *pps_bytes)
 {
     LOG_INFO("MP4D read pps");
-    return MP4D_read_spspps(mp4, ntrack, 1, npps, pps_bytes);
+    return MP4D_read_spspps(mp4, ntrack, PARAM_SET_PPS, npps, pps_bytes);
+}
+
+/**
+ *   Append start code and NAL to Annex-B output, if it fits.
+ *   Return output position after the NAL
+ */
+static unsigned annexb_put(unsigned char *out, unsigned out_bytes, unsigned pos, const void *nal, unsigned nal_bytes)
+{
+    static const unsigned char start_code[4] = {0, 0, 0, 1};
+    if (out && pos + 4 + nal_bytes <= out_bytes)
+    {
+        memcpy(out + pos, start_code, 4);
+        memcpy(out + pos + 4, nal, nal_bytes);
+    }
+    return pos + 4 + nal_bytes;
+}
+
+// Exported API function
+int MP4D_annexb_sample(const MP4D_demux_t *mp4, unsigned int ntrack, unsigned int nsample,
+                       const void *sample, unsigned int sample_bytes, void *out, unsigned int out_bytes)
+{
+    const MP4D_track_t *tr;
+    const unsigned char *src = (const unsigned char *)sample;
+    unsigned pos = 0, size = 0, nal_length_size;
+
+    if (!mp4 || ntrack >= mp4->track_count || (!sample && sample_bytes))
+        return 0;
+    tr = mp4->track + ntrack;
+    if (tr->object_type_indication != MP4_OBJECT_TYPE_AVC && tr->object_type_indication != MP4_OBJECT_TYPE_HEVC)
+        return 0;
+    nal_length_size = tr->nal_length_size ? tr->nal_length_size : 4;
+
+    // Decoder can start from sync sample only with parameter sets from DSI
+    if (MP4D_sample_is_sync(mp4, ntrack, nsample))
+    {
+        int array, n, nal_bytes;
+        const void *nal;
+        for (array = PARAM_SET_VPS; array <= PARAM_SET_PPS; array++)
+        {
+            for (n = 0; (nal = MP4D_read_spspps(mp4, ntrack, array, n, &nal_bytes)) != NULL; n++)
+            {
+                size = annexb_put((unsigned char *)out, out_bytes, size, nal, (unsigned)nal_bytes);
+            }
+        }
+    }
+
+    while (pos < sample_bytes)
+    {
+        unsigned k, nal_bytes = 0;
+        if (nal_length_size > sample_bytes - pos)
+            return 0;
+        for (k = 0; k < nal_length_size; k++)
+        {
+            nal_bytes = (nal_bytes << 8) | src[pos++];
+        }
+        if (nal_bytes > sample_bytes - pos)
+            return 0;
+        size = annexb_put((unsigned char *)out, out_bytes, size, src + pos, nal_bytes);
+        pos += nal_bytes;
+    }
+    if (out && size > out_bytes)
+        return 0;
+    return (int)size;
+}
+
+#if MP4D_INDEX_SUPPORTED
+/************************************************************************/
+/*  Index sidecar: parsed track tables, saved for fast re-open          */
+/************************************************************************/
+// Layout: header, per-track records, then sections (tables, DSI, tags),
+// each section 8-byte aligned. Values are stored in native byte order and
+// structure layout, so tables are used in-place from mmap()-ed memory;
+// sidecar written by different build or platform is rejected.
+
+#define MP4D_INDEX_VERSION 1
+#define MP4D_INDEX_ENDIAN_TAG 0x01020304u
+#define INDEX_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+static const char g_index_magic[8] = {'M', 'P', '4', 'D', 'I', 'D', 'X', 0};
+
+enum
+{
+    INDEX_DSI,
+    INDEX_ENTRY_SIZE,
+    INDEX_SAMPLE_TO_CHUNK,
+    INDEX_CHUNK_OFFSET,
+    INDEX_SYNC_SAMPLE,
+    INDEX_STTS_RUN,
+    INDEX_STTS_CHECKPOINT,
+    INDEX_CTTS_RUN,
+    INDEX_CTTS_CHECKPOINT,
+    INDEX_TRACK_SECTIONS
+};
+
+#define INDEX_TAG_SECTIONS 6
+
+/**
+ * @brief Section position in the sidecar, zero offset means NULL table
+ */
+typedef struct
+{
+    uint64_t offset;
+    uint64_t bytes;
+} index_section_t;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_tag;
+    uint32_t track_bytes; // sizeof(MP4D_track_t): build configuration check
+    uint32_t track_count;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint64_t index_bytes;
+    uint64_t checksum; // of everything after the header, then of the header itself
+    uint32_t duration_hi;
+    uint32_t duration_lo;
+    uint32_t timescale;
+    uint32_t reserved;
+    index_section_t tag[INDEX_TAG_SECTIONS];
+} index_header_t;
+
+typedef struct
+{
+    MP4D_track_t track; // with all pointers set to NULL
+    index_section_t section[INDEX_TRACK_SECTIONS];
+} index_track_t;
+
+typedef struct
+{
+    int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token);
+    void *token;
+    uint64_t pos;
+    uint64_t sum1;
+    uint64_t sum2;
+    int error;
+} index_writer_t;
+
+/**
+ *   Fletcher-style checksum over 32-bit words, bytes must be multiple of 4
+ */
+static void index_checksum(uint64_t *sum1, uint64_t *sum2, const void *data, size_t bytes)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t s1 = *sum1, s2 = *sum2;
+    size_t i;
+    for (i = 0; i + 4 <= bytes; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, p + i, 4);
+        s1 += word;
+        s2 += s1;
+    }
+    *sum1 = s1;
+    *sum2 = s2;
+}
+
+/**
+ *   Write data padded to 8 bytes, and update checksum
+ */
+static void index_put(index_writer_t *w, const void *data, uint64_t bytes)
+{
+    unsigned char tail[8] = {0};
+    uint64_t aligned = bytes & ~(uint64_t)7;
+    if (w->error)
+        return;
+    if (aligned)
+    {
+        index_checksum(&w->sum1, &w->sum2, data, (size_t)aligned);
+        w->error |= w->write_callback((int64_t)w->pos, data, (size_t)aligned, w->token);
+        w->pos += aligned;
+    }
+    if (bytes > aligned)
+    {
+        memcpy(tail, (const unsigned char *)data + aligned, (size_t)(bytes - aligned));
+        index_checksum(&w->sum1, &w->sum2, tail, 8);
+        w->error |= w->write_callback((int64_t)w->pos, tail, 8, w->token);
+        w->pos += 8;
+    }
+}
+
+/**
+ *   List track tables to be saved: memory and size of each section
+ */
+static void index_track_sections(const MP4D_track_t *tr, const void *ptr[INDEX_TRACK_SECTIONS], uint64_t bytes[INDEX_TRACK_SECTIONS])
+{
+    int i;
+    memset(ptr, 0, INDEX_TRACK_SECTIONS * sizeof(ptr[0]));
+    memset(bytes, 0, INDEX_TRACK_SECTIONS * sizeof(bytes[0]));
+    ptr[INDEX_DSI] = tr->dsi;
+    bytes[INDEX_DSI] = tr->dsi_bytes;
+    ptr[INDEX_ENTRY_SIZE] = tr->entry_size;
+    bytes[INDEX_ENTRY_SIZE] = (uint64_t)tr->sample_count * sizeof(tr->entry_size[0]);
+    ptr[INDEX_SAMPLE_TO_CHUNK] = tr->sample_to_chunk;
+    bytes[INDEX_SAMPLE_TO_CHUNK] = (uint64_t)tr->sample_to_chunk_count * sizeof(tr->sample_to_chunk[0]);
+    ptr[INDEX_CHUNK_OFFSET] = tr->chunk_offset;
+    bytes[INDEX_CHUNK_OFFSET] = (uint64_t)tr->chunk_count * sizeof(tr->chunk_offset[0]);
+    ptr[INDEX_SYNC_SAMPLE] = tr->sync_sample;
+    bytes[INDEX_SYNC_SAMPLE] = (uint64_t)tr->sync_count * sizeof(tr->sync_sample[0]);
+#if MP4D_TIMESTAMPS_SUPPORTED
+    ptr[INDEX_STTS_RUN] = tr->stts.run;
+    bytes[INDEX_STTS_RUN] = (uint64_t)tr->stts.run_count * sizeof(tr->stts.run[0]);
+    ptr[INDEX_STTS_CHECKPOINT] = tr->stts.checkpoint;
+    bytes[INDEX_STTS_CHECKPOINT] = (uint64_t)tr->stts.checkpoint_count * sizeof(tr->stts.checkpoint[0]);
+    ptr[INDEX_CTTS_RUN] = tr->ctts.run;
+    bytes[INDEX_CTTS_RUN] = (uint64_t)tr->ctts.run_count * sizeof(tr->ctts.run[0]);
+    ptr[INDEX_CTTS_CHECKPOINT] = tr->ctts.checkpoint;
+    bytes[INDEX_CTTS_CHECKPOINT] = (uint64_t)tr->ctts.checkpoint_count * sizeof(tr->ctts.checkpoint[0]);
+#endif
+    for (i = 0; i < INDEX_TRACK_SECTIONS; i++)
+    {
+        if (!ptr[i])
+            bytes[i] = 0;
+    }
+}
+
+#if MP4D_INFO_SUPPORTED
+static unsigned char **index_tag(MP4D_demux_t *mp4, int i)
+{
+    unsigned char **tag[INDEX_TAG_SECTIONS] = {&mp4->tag.title, &mp4->tag.artist, &mp4->tag.album,
+                                               &mp4->tag.year, &mp4->tag.comment, &mp4->tag.genre};
+    return tag[i];
+}
+#endif
+
+/**
+ *   Assign sidecar position to the section
+ */
+static void index_place(index_section_t *section, const void *ptr, uint64_t bytes, uint64_t *pos)
+{
+    section->offset = ptr ? *pos : 0;
+    section->bytes = bytes;
+    *pos += INDEX_ALIGN(bytes);
+}
+
+// Exported API function
+int MP4D_write_index(const MP4D_demux_t *mp4, int64_t file_size, int64_t file_mtime,
+                     int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token), void *token)
+{
+    LOG_INFO("MP4D write index");
+    index_writer_t w;
+    index_header_t hdr;
+    const void *ptr[INDEX_TRACK_SECTIONS];
+    uint64_t bytes[INDEX_TRACK_SECTIONS];
+    const void *tag_ptr[INDEX_TAG_SECTIONS] = {0};
+    uint64_t pos;
+    unsigned ntrack;
+    int i;
+
+    if (!mp4 || !write_callback || (mp4->track_count && !mp4->track))
+        return 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, g_index_magic, sizeof(hdr.magic));
+    hdr.version = MP4D_INDEX_VERSION;
+    hdr.endian_tag = MP4D_INDEX_ENDIAN_TAG;
+    hdr.track_bytes = sizeof(MP4D_track_t);
+    hdr.track_count = mp4->track_count;
+    hdr.file_size = (uint64_t)file_size;
+    hdr.file_mtime = file_mtime;
+    pos = sizeof(index_header_t) + (uint64_t)mp4->track_count * sizeof(index_track_t);
+#if MP4D_INFO_SUPPORTED
+    hdr.duration_hi = mp4->duration_hi;
+    hdr.duration_lo = mp4->duration_lo;
+    hdr.timescale = mp4->timescale;
+    for (i = 0; i < INDEX_TAG_SECTIONS; i++)
+    {
+        tag_ptr[i] = *index_tag((MP4D_demux_t *)mp4, i);
+        index_place(&hdr.tag[i], tag_ptr[i], tag_ptr[i] ? strlen((const char *)tag_ptr[i]) + 1 : 0, &pos);
+    }
+#endif
+
+    memset(&w, 0, sizeof(w));
+    w.write_callback = write_callback;
+    w.token = token;
+    w.pos = sizeof(index_header_t);
+
+    // track records, with section positions following the tag sections
+    for (ntrack = 0; ntrack < mp4->track_count; ntrack++)
+    {
+        index_track_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.track = mp4->track[ntrack];
+        rec.track.dsi = NULL;
+        rec.track.entry_size = NULL;
+        rec.track.sample_to_chunk = NULL;
+        rec.track.chunk_offset = NULL;
+        rec.track.sync_sample = NULL;
+#if MP4D_TIMESTAMPS_SUPPORTED
+        rec.track.stts.run = NULL;
+        rec.track.stts.checkpoint = NULL;
+        rec.track.ctts.run = NULL;
+        rec.track.ctts.checkpoint = NULL;
+#endif
+        index_track_sections(mp4->track + ntrack, ptr, bytes);
+        for (i = 0; i < INDEX_TRACK_SECTIONS; i++)
+        {
+            index_place(&rec.section[i], ptr[i], bytes[i], &pos);
+        }
+        index_put(&w, &rec, sizeof(rec));
+    }
+
+    // sections, in the same order as placed
+    for (i = 0; i < INDEX_TAG_SECTIONS; i++)
+    {
+        if (tag_ptr[i])
+            index_put(&w, tag_ptr[i], hdr.tag[i].bytes);
+    }
+    for (ntrack = 0; ntrack < mp4->track_count; ntrack++)
+    {
+        index_track_sections(mp4->track + ntrack, ptr, bytes);
+        for (i = 0; i < INDEX_TRACK_SECTIONS; i++)
+        {
+            if (ptr[i])
+                index_put(&w, ptr[i], bytes[i]);
+        }
+    }
+    if (w.error || w.pos != pos)
+        return 0;
+
+    // header goes last: incomplete sidecar has no valid magic
+    hdr.index_bytes = pos;
+    index_checksum(&w.sum1, &w.sum2, &hdr, sizeof(hdr));
+    hdr.checksum = (w.sum2 << 32) ^ w.sum1;
+    return !write_callback(0, &hdr, sizeof(hdr), token);
+}
+
+/**
+ *   Check that section is inside the sidecar and has expected size.
+ *   Return pointer to section memory (NULL for absent section), or
+ *   set *error if section is broken
+ */
+static void *index_section(const unsigned char *index, uint64_t index_bytes, const index_section_t *section,
+                           uint64_t expected_bytes, int optional, int *error)
+{
+    if (!section->offset)
+    {
+        if (section->bytes || (expected_bytes && !optional))
+            *error = 1;
+        return NULL;
+    }
+    if ((section->offset & 7) || section->offset < sizeof(index_header_t) || section->bytes != expected_bytes ||
+        section->offset > index_bytes || section->bytes > index_bytes - section->offset)
+    {
+        *error = 1;
+        return NULL;
+    }
+    return (void *)(index + section->offset);
+}
+
+// Exported API function
+int MP4D_open_with_index(MP4D_demux_t *mp4, const void *index, size_t index_bytes, int64_t file_mtime,
+                         int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token, int64_t file_size)
+{
+    LOG_INFO("MP4D open with index");
+    const unsigned char *base = (const unsigned char *)index;
+    index_header_t hdr;
+    uint64_t sum1 = 0, sum2 = 0, checksum;
+    unsigned ntrack;
+    int i, error = 0;
+
+    if (!mp4 || !index || !read_callback || ((uintptr_t)index & 7) || index_bytes < sizeof(hdr))
+        return 0;
+    memcpy(&hdr, index, sizeof(hdr));
+    if (memcmp(hdr.magic, g_index_magic, sizeof(hdr.magic)) || hdr.version != MP4D_INDEX_VERSION ||
+        hdr.endian_tag != MP4D_INDEX_ENDIAN_TAG || hdr.track_bytes != sizeof(MP4D_track_t))
+        return 0; // not an index, or written by other build
+    if (hdr.file_size != (uint64_t)file_size || hdr.file_mtime != file_mtime)
+        return 0; // stale index: MP4 file was changed
+    if (hdr.index_bytes != index_bytes || (index_bytes & 7) ||
+        hdr.track_count > (index_bytes - sizeof(hdr)) / sizeof(index_track_t))
+        return 0;
+    index_checksum(&sum1, &sum2, base + sizeof(hdr), index_bytes - sizeof(hdr));
+    checksum = hdr.checksum;
+    hdr.checksum = 0;
+    index_checksum(&sum1, &sum2, &hdr, sizeof(hdr));
+    if (checksum != ((sum2 << 32) ^ sum1))
+        return 0;
+
+    memset(mp4, 0, sizeof(MP4D_demux_t));
+    mp4->read_callback = read_callback;
+    mp4->token = token;
+    mp4->read_size = file_size;
+    mp4->index = index;
+    mp4->track_count = hdr.track_count;
+    if (hdr.track_count)
+    {
+        mp4->track = (MP4D_track_t *)malloc(hdr.track_count * sizeof(MP4D_track_t));
+        if (!mp4->track)
+        {
+            mp4->track_count = 0;
+            return 0;
+        }
+    }
+#if MP4D_INFO_SUPPORTED
+    mp4->duration_hi = hdr.duration_hi;
+    mp4->duration_lo = hdr.duration_lo;
+    mp4->timescale = hdr.timescale;
+    for (i = 0; i < INDEX_TAG_SECTIONS; i++)
+    {
+        unsigned char *tag = (unsigned char *)index_section(base, index_bytes, &hdr.tag[i], hdr.tag[i].bytes, 1, &error);
+        if (tag && (!hdr.tag[i].bytes || tag[hdr.tag[i].bytes - 1]))
+            error = 1; // tag must be zero-terminated
+        *index_tag(mp4, i) = tag;
+    }
+#endif
+
+    for (ntrack = 0; ntrack < hdr.track_count; ntrack++)
+    {
+        const index_track_t *rec = (const index_track_t *)(base + sizeof(hdr)) + ntrack;
+        const index_section_t *s = rec->section;
+        MP4D_track_t *tr = mp4->track + ntrack;
+        *tr = rec->track;
+        tr->dsi = (unsigned char *)index_section(base, index_bytes, s + INDEX_DSI, tr->dsi_bytes, 1, &error);
+        tr->entry_size = (unsigned *)index_section(base, index_bytes, s + INDEX_ENTRY_SIZE,
+                                                   (uint64_t)tr->sample_count * sizeof(tr->entry_size[0]), !!tr->sample_size, &error);
+        tr->sample_to_chunk = (MP4D_sample_to_chunk_t *)index_section(base, index_bytes, s + INDEX_SAMPLE_TO_CHUNK,
+                                                                      (uint64_t)tr->sample_to_chunk_count * sizeof(tr->sample_to_chunk[0]), 0, &error);
+        tr->chunk_offset = (MP4D_file_offset_t *)index_section(base, index_bytes, s + INDEX_CHUNK_OFFSET,
+                                                               (uint64_t)tr->chunk_count * sizeof(tr->chunk_offset[0]), 0, &error);
+        tr->sync_sample = (unsigned *)index_section(base, index_bytes, s + INDEX_SYNC_SAMPLE,
+                                                    (uint64_t)tr->sync_count * sizeof(tr->sync_sample[0]), 1, &error);
+        if (!tr->sync_sample && tr->sync_count)
+            error = 1;
+#if MP4D_TIMESTAMPS_SUPPORTED
+        tr->stts.run = (MP4D_run_t *)index_section(base, index_bytes, s + INDEX_STTS_RUN,
+                                                   (uint64_t)tr->stts.run_count * sizeof(tr->stts.run[0]), 0, &error);
+        tr->stts.checkpoint = (MP4D_run_checkpoint_t *)index_section(base, index_bytes, s + INDEX_STTS_CHECKPOINT,
+                                                                     (uint64_t)tr->stts.checkpoint_count * sizeof(tr->stts.checkpoint[0]), 0, &error);
+        tr->ctts.run = (MP4D_run_t *)index_section(base, index_bytes, s + INDEX_CTTS_RUN,
+                                                   (uint64_t)tr->ctts.run_count * sizeof(tr->ctts.run[0]), 0, &error);
+        tr->ctts.checkpoint = (MP4D_run_checkpoint_t *)index_section(base, index_bytes, s + INDEX_CTTS_CHECKPOINT,
+                                                                     (uint64_t)tr->ctts.checkpoint_count * sizeof(tr->ctts.checkpoint[0]), 0, &error);
+#endif
+    }
+    if (error)
+    {
+        MP4D_close(mp4);
+        return 0;
+    }
+    return 1;
+}
+#endif // MP4D_INDEX_SUPPORTED
+
+#if MP4D_ASYNC_SUPPORTED
+/************************************************************************/
+/*  Batched reads: asynchronous open, coalesced sample reads            */
+/************************************************************************/
+
+// File head and tail, read speculatively in the first batch
+#define ASYNC_EDGE_BYTES (64 * 1024)
+// Read for unknown box header, doubled on each read. The rest of the file is
+// read instead, if it is not bigger than ASYNC_TAIL_BYTES: after 'mdat' it is
+// likely 'moov'. Otherwise the tail of this size is searched for 'moov' once
+#define ASYNC_HEADER_BYTES 4096
+#define ASYNC_TAIL_BYTES (4 * 1024 * 1024)
+// Boxes after 'moov' to reach end of file, when 'moov' is searched in the tail
+#define ASYNC_TAIL_BOXES 8
+// Parser restarts after cache miss, guards against broken files
+#define ASYNC_MAX_ROUNDS 16
+
+static const unsigned char *async_find(MP4D_async_t *a, int64_t offset, uint64_t size)
+{
+    unsigned i;
+    for (i = 0; i < a->chunk_count; i++)
+    {
+        // parser reads byte by byte, start from the last hit
+        unsigned k = (a->last_chunk + i) % a->chunk_count;
+        const MP4D_range_t *c = a->chunk + k;
+        if (offset >= c->offset && offset - c->offset <= (int64_t)c->size && size <= c->size - (uint64_t)(offset - c->offset))
+        {
+            a->last_chunk = k;
+            return (const unsigned char *)c->buffer + (offset - c->offset);
+        }
+    }
+    return NULL;
+}
+
+/**
+ *   MP4D_open() read callback over ranges read so far. First miss is recorded,
+ *   to be requested before parser restart
+ */
+static int async_read(int64_t offset, void *buffer, size_t size, void *token)
+{
+    MP4D_async_t *a = (MP4D_async_t *)token;
+    const unsigned char *p;
+    if (offset >= a->stop)
+        return 1; // parser sees end of file after 'moov'
+    if (offset < a->skip_to)
+    {
+        // 'free' box from file start to 'moov', e.g. all 'mdat' of sequential mode file
+        unsigned char hdr[16] = { 0, 0, 0, 1, 'f', 'r', 'e', 'e' };
+        unsigned i, header_bytes = 16;
+        if ((uint64_t)a->skip_to < 0xFFFFFFFFU)
+        {
+            header_bytes = 8;
+            for (i = 0; i < 4; i++)
+                hdr[i] = (unsigned char)(a->skip_to >> (24 - 8 * i));
+        }
+        else
+        {
+            for (i = 0; i < 8; i++)
+                hdr[8 + i] = (unsigned char)(a->skip_to >> (56 - 8 * i));
+        }
+        if (offset + (int64_t)size > header_bytes)
+            return 1;
+        memcpy(buffer, hdr + offset, size);
+        return 0;
+    }
+    p = async_find(a, offset, size);
+    if (!p)
+    {
+        if (!a->miss_size)
+        {
+            a->miss_offset = offset;
+            a->miss_size = size;
+        }
+        return 1;
+    }
+    memcpy(buffer, p, size);
+    return 0;
+}
+
+/**
+ *   Add range to the next batch, merged with overlapping one. Its head and
+ *   tail already read are not read again
+ */
+static int async_request(MP4D_async_t *a, int64_t offset, uint64_t size)
+{
+    MP4D_range_t *r;
+    unsigned i;
+    int trimmed = 1;
+    if (size > (uint64_t)(a->file_size - offset))
+        size = a->file_size - offset;
+    while (trimmed && size)
+    {
+        trimmed = 0;
+        for (i = 0; i < a->chunk_count && size; i++)
+        {
+            const MP4D_range_t *c = a->chunk + i;
+            int64_t c_end = c->offset + (int64_t)c->size, end = offset + (int64_t)size;
+            if (c->offset <= offset && c_end > offset)
+            {
+                size = c_end < end ? (uint64_t)(end - c_end) : 0;
+                offset = c_end;
+                trimmed = 1;
+            }
+            else if (c->offset < end && c_end >= end)
+            {
+                size = (uint64_t)(c->offset - offset);
+                trimmed = 1;
+            }
+        }
+    }
+    if (!size)
+        return 1;
+    for (i = 0; i < a->request_count; i++)
+    {
+        r = a->request + i;
+        if (offset <= r->offset + (int64_t)r->size && r->offset <= offset + (int64_t)size)
+        {
+            int64_t end = offset + (int64_t)size;
+            if (end < r->offset + (int64_t)r->size)
+                end = r->offset + (int64_t)r->size;
+            r->offset = MINIMP4_MIN(r->offset, offset);
+            r->size = (size_t)(end - r->offset);
+            return 1;
+        }
+    }
+    r = (MP4D_range_t *)realloc(a->request, (a->request_count + 1) * sizeof(MP4D_range_t));
+    if (!r)
+        return 0;
+    a->request = r;
+    r += a->request_count++;
+    r->offset = offset;
+    r->size = (size_t)size;
+    r->buffer = NULL;
+    return 1;
+}
+
+/**
+ *   Box size from header at given position, 0 if not read or broken
+ */
+static uint64_t async_box_bytes(MP4D_async_t *a, int64_t pos, uint32_t *type)
+{
+    const unsigned char *hdr = async_find(a, pos, 8);
+    uint64_t box_bytes;
+    if (!hdr)
+        return 0;
+    box_bytes = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+    *type = ((uint32_t)hdr[4] << 24) | ((uint32_t)hdr[5] << 16) | ((uint32_t)hdr[6] << 8) | hdr[7];
+    if (box_bytes == 1)
+    {
+        if (!(hdr = async_find(a, pos, 16)))
+            return 0;
+        box_bytes = ((uint64_t)hdr[8] << 56) | ((uint64_t)hdr[9] << 48) | ((uint64_t)hdr[10] << 40) |
+                    ((uint64_t)hdr[11] << 32) | ((uint32_t)hdr[12] << 24) | ((uint32_t)hdr[13] << 16) |
+                    ((uint32_t)hdr[14] << 8) | hdr[15];
+    }
+    else if (box_bytes == 0 || box_bytes == 0xFFFFFFFFU)
+    {
+        box_bytes = a->file_size - pos; // 'till eof' size
+    }
+    return box_bytes < 8 ? 0 : box_bytes;
+}
+
+/**
+ *   Search ranges at the end of file for 'moov', followed by a few boxes which
+ *   end exactly at end of file. Saves walking over many 'mdat' headers
+ *
+ *   return 'moov' position, or 0 if not found
+ */
+static int64_t async_find_moov(MP4D_async_t *a)
+{
+    unsigned i;
+    for (i = 0; i < a->chunk_count; i++)
+    {
+        const MP4D_range_t *c = a->chunk + i;
+        const unsigned char *p = (const unsigned char *)c->buffer;
+        size_t k;
+        if (c->offset + (int64_t)c->size != a->file_size || c->size < 8)
+            continue;
+        for (k = 0; k + 8 <= c->size; k++)
+        {
+            int64_t pos = c->offset + (int64_t)k;
+            unsigned n;
+            uint32_t type;
+            if (p[k + 4] != 'm' || p[k + 5] != 'o' || p[k + 6] != 'o' || p[k + 7] != 'v')
+                continue;
+            for (n = 0; n <= ASYNC_TAIL_BOXES && pos < a->file_size; n++)
+            {
+                uint64_t box_bytes = async_box_bytes(a, pos, &type);
+                if (!box_bytes || box_bytes > (uint64_t)(a->file_size - pos))
+                    break;
+                pos += (int64_t)box_bytes;
+            }
+            if (pos == a->file_size)
+                return c->offset + (int64_t)k;
+        }
+    }
+    return 0;
+}
+
+/**
+ *   Allocate buffers for the batch and pass it to the caller
+ */
+static int async_issue(MP4D_async_t *a)
+{
+    unsigned i;
+    for (i = 0; i < a->request_count; i++)
+    {
+        a->request[i].buffer = malloc(a->request[i].size);
+        if (!a->request[i].buffer)
+            return 0;
+    }
+    return MP4D_ASYNC_NEED_DATA;
+}
+
+/**
+ *   Walk top-level boxes up to 'moov' over the ranges read so far, then run
+ *   MP4D_open() on them. Return next batch if something is missing
+ */
+static int async_step(MP4D_async_t *a)
+{
+    int opened;
+    while (!a->parsing)
+    {
+        uint64_t box_bytes;
+        uint32_t type;
+        int64_t end;
+        if (a->pos + 8 > a->file_size)
+        {
+            a->stop = a->file_size; // no 'moov', let the parser report it
+            a->parsing = 1;
+            break;
+        }
+        box_bytes = async_box_bytes(a, a->pos, &type);
+        if (!box_bytes && (async_find(a, a->pos, 16) || (a->pos + 16 > a->file_size && async_find(a, a->pos, 8))))
+        {
+            a->stop = a->file_size; // broken file, let the parser report it
+            a->parsing = 1;
+            break;
+        }
+        if (!box_bytes)
+        {
+            uint64_t rest = a->file_size - a->pos;
+            int64_t moov = async_find_moov(a);
+            if (moov > a->pos)
+            {
+                a->skip_to = moov;
+                a->pos = moov;
+                continue;
+            }
+            if (rest <= ASYNC_TAIL_BYTES)
+            {
+                if (!async_request(a, a->pos, rest))
+                    return 0;
+            }
+            else
+            {
+                a->walk_bytes = a->walk_bytes ? MINIMP4_MIN(a->walk_bytes * 2, ASYNC_TAIL_BYTES) : ASYNC_HEADER_BYTES;
+                if (!async_request(a, a->pos, a->walk_bytes))
+                    return 0;
+                if (!a->tail_read && !async_request(a, a->file_size - ASYNC_TAIL_BYTES, ASYNC_TAIL_BYTES))
+                    return 0;
+                a->tail_read = 1;
+            }
+            return async_issue(a);
+        }
+        end = box_bytes > (uint64_t)(a->file_size - a->pos) ? a->file_size : a->pos + (int64_t)box_bytes;
+
+        // boxes parser descends into are read whole, others are skipped by header
+        if (type == BOX_moov || type == BOX_udta || type == BOX_meta)
+        {
+            if (!async_find(a, a->pos, end - a->pos))
+            {
+                if (!async_request(a, a->pos, end - a->pos))
+                    return 0;
+                return async_issue(a);
+            }
+            if (type == BOX_moov)
+            {
+                a->stop = end;
+                a->parsing = 1;
+                break;
+            }
+        }
+        a->pos = end;
+    }
+
+    a->miss_size = 0;
+    opened = MP4D_open(a->mp4, async_read, a, a->file_size);
+    if (a->miss_size)
+    {
+        // unexpected layout: read what parser wanted and start over
+        if (opened)
+            MP4D_close(a->mp4);
+        if (++a->rounds > ASYNC_MAX_ROUNDS ||
+            !async_request(a, a->miss_offset, a->miss_size > ASYNC_HEADER_BYTES ? a->miss_size : ASYNC_HEADER_BYTES))
+            return 0;
+        return async_issue(a);
+    }
+    if (!opened)
+        return 0;
+    a->mp4->read_callback = NULL;
+    a->mp4->token = NULL;
+    return MP4D_ASYNC_OPENED;
+}
+
+// Exported API function
+int MP4D_async_open(MP4D_async_t *a, MP4D_demux_t *mp4, int64_t file_size)
+{
+    if (!a || !mp4 || file_size <= 0)
+        return 0;
+    memset(a, 0, sizeof(MP4D_async_t));
+    memset(mp4, 0, sizeof(MP4D_demux_t));
+    a->mp4 = mp4;
+    a->file_size = file_size;
+    if (!async_request(a, 0, ASYNC_EDGE_BYTES) ||
+        !async_request(a, file_size > ASYNC_EDGE_BYTES ? file_size - ASYNC_EDGE_BYTES : 0, ASYNC_EDGE_BYTES))
+        return 0;
+    return async_issue(a);
+}
+
+/**
+ *   Join chunks which overlap or touch: a trimmed request completes a range
+ *   that the parser must find in one chunk, e.g. 'moov'
+ */
+static int async_merge(MP4D_async_t *a)
+{
+    unsigned i, k;
+    for (i = 0; i < a->chunk_count; i++)
+    {
+        for (k = i + 1; k < a->chunk_count; k++)
+        {
+            MP4D_range_t *c = a->chunk + i, *d = a->chunk + k;
+            int64_t c_end = c->offset + (int64_t)c->size, d_end = d->offset + (int64_t)d->size;
+            int64_t start = MINIMP4_MIN(c->offset, d->offset), end = c_end > d_end ? c_end : d_end;
+            unsigned char *buffer;
+            if (d->offset > c_end || c->offset > d_end)
+                continue;
+            buffer = (unsigned char *)malloc((size_t)(end - start));
+            if (!buffer)
+                return 0;
+            memcpy(buffer + (d->offset - start), d->buffer, d->size);
+            memcpy(buffer + (c->offset - start), c->buffer, c->size);
+            free(c->buffer);
+            free(d->buffer);
+            c->offset = start;
+            c->size = (size_t)(end - start);
+            c->buffer = buffer;
+            *d = a->chunk[--a->chunk_count];
+            k = i; // c grew, check the others again
+        }
+    }
+    a->last_chunk = 0;
+    return 1;
+}
+
+// Exported API function
+int MP4D_async_resume(MP4D_async_t *a, int error)
+{
+    MP4D_range_t *chunk;
+    if (!a || !a->request_count)
+        return 0;
+    chunk = (MP4D_range_t *)realloc(a->chunk, (a->chunk_count + a->request_count) * sizeof(MP4D_range_t));
+    if (!chunk)
+        return 0;
+    a->chunk = chunk;
+    memcpy(a->chunk + a->chunk_count, a->request, a->request_count * sizeof(MP4D_range_t));
+    a->chunk_count += a->request_count;
+    a->request_count = 0;
+    if (error || !async_merge(a))
+        return 0;
+    return async_step(a);
+}
+
+// Exported API function
+void MP4D_async_close(MP4D_async_t *a)
+{
+    unsigned i;
+    if (!a)
+        return;
+    for (i = 0; i < a->chunk_count; i++)
+        free(a->chunk[i].buffer);
+    for (i = 0; i < a->request_count; i++)
+        free(a->request[i].buffer);
+    FREE(a->chunk);
+    FREE(a->request);
+    a->chunk_count = a->request_count = 0;
+}
+
+// Exported API function
+int MP4D_open_batched(MP4D_demux_t *mp4, int (*read_batch_callback)(MP4D_range_t *ranges, unsigned count, void *token),
+                      void *token, int64_t file_size)
+{
+    MP4D_async_t a;
+    int res;
+    if (!read_batch_callback)
+        return 0;
+    res = MP4D_async_open(&a, mp4, file_size);
+    while (res == MP4D_ASYNC_NEED_DATA)
+        res = MP4D_async_resume(&a, read_batch_callback(a.request, a.request_count, token));
+    MP4D_async_close(&a);
+    return res == MP4D_ASYNC_OPENED;
+}
+
+typedef struct
+{
+    MP4D_file_offset_t offset;
+    unsigned size;
+    unsigned slice;
+} plan_extent_t;
+
+static int plan_extent_cmp(const void *a, const void *b)
+{
+    const plan_extent_t *x = (const plan_extent_t *)a, *y = (const plan_extent_t *)b;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return x->slice < y->slice ? -1 : x->slice > y->slice;
+}
+
+// Exported API function
+int MP4D_plan_reads(const MP4D_demux_t *mp4, const MP4D_sample_range_t *ranges, unsigned range_count,
+                    unsigned gap_bytes, size_t max_read_bytes, MP4D_read_plan_t *plan)
+{
+    plan_extent_t *extent;
+    MP4D_range_t *r = NULL;
+    uint64_t count = 0;
+    unsigned i, n, s;
+
+    if (!mp4 || !plan || (range_count && !ranges))
+        return 0;
+    memset(plan, 0, sizeof(MP4D_read_plan_t));
+    for (i = 0; i < range_count; i++)
+    {
+        if (ranges[i].track >= mp4->track_count || ranges[i].end > mp4->track[ranges[i].track].sample_count ||
+            ranges[i].first > ranges[i].end)
+            return 0;
+        count += ranges[i].end - ranges[i].first;
+    }
+    if (!count)
+        return 1;
+    if (count > UINT_MAX / sizeof(plan_extent_t) ||
+        !(plan->slice = (MP4D_sample_slice_t *)malloc((size_t)count * sizeof(MP4D_sample_slice_t))))
+        return 0;
+    if (!(extent = (plan_extent_t *)malloc((size_t)count * sizeof(plan_extent_t))))
+    {
+        FREE(plan->slice);
+        return 0;
+    }
+
+    for (i = 0, n = 0; i < range_count; i++)
+    {
+        for (s = ranges[i].first; s < ranges[i].end; s++, n++)
+        {
+            unsigned frame_bytes;
+            extent[n].offset = MP4D_frame_offset(mp4, ranges[i].track, s, &frame_bytes, NULL, NULL);
+            extent[n].size = frame_bytes;
+            extent[n].slice = n;
+            plan->slice[n].track = ranges[i].track;
+            plan->slice[n].sample = s;
+            plan->slice[n].size = frame_bytes;
+            plan->slice[n].data = NULL;
+            plan->sample_bytes += frame_bytes;
+        }
+    }
+    plan->slice_count = n;
+    qsort(extent, n, sizeof(plan_extent_t), plan_extent_cmp);
+
+    // sweep in file order: extend current read while the gap and size allow
+    for (i = 0; i < n; i++)
+    {
+        MP4D_file_offset_t end = extent[i].offset + extent[i].size;
+        if (r && extent[i].offset <= (MP4D_file_offset_t)r->offset + r->size + gap_bytes &&
+            (!max_read_bytes || end - (MP4D_file_offset_t)r->offset <= max_read_bytes))
+        {
+            if (end > (MP4D_file_offset_t)r->offset + r->size)
+                r->size = (size_t)(end - r->offset);
+        }
+        else
+        {
+            if (!(plan->read_count & (plan->read_count - 1)))
+            {
+                // grow by powers of two
+                MP4D_range_t *p = (MP4D_range_t *)realloc(plan->read, (plan->read_count ? plan->read_count * 2 : 1) * sizeof(MP4D_range_t));
+                if (!p)
+                    break;
+                plan->read = p;
+            }
+            r = plan->read + plan->read_count++;
+            r->offset = (int64_t)extent[i].offset;
+            r->size = extent[i].size;
+            r->buffer = NULL;
+        }
+        plan->slice[extent[i].slice].read = plan->read_count - 1;
+    }
+
+    for (s = 0; i == n && s < plan->read_count; s++)
+    {
+        if (!(plan->read[s].buffer = malloc(plan->read[s].size ? plan->read[s].size : 1)))
+            break;
+        plan->read_bytes += plan->read[s].size;
+    }
+    if (i != n || s != plan->read_count)
+    {
+        free(extent);
+        MP4D_free_read_plan(plan);
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        const plan_extent_t *e = extent + i;
+        const MP4D_range_t *rd = plan->read + plan->slice[e->slice].read;
+        plan->slice[e->slice].data = (const unsigned char *)rd->buffer + (e->offset - (MP4D_file_offset_t)rd->offset);
+    }
+    free(extent);
+    return 1;
+}
+
+// Exported API function
+void MP4D_free_read_plan(MP4D_read_plan_t *plan)
+{
+    unsigned i;
+    if (!plan)
+        return;
+    for (i = 0; i < plan->read_count; i++)
+        free(plan->read[i].buffer);
+    FREE(plan->read);
+    FREE(plan->slice);
+    plan->read_count = plan->slice_count = 0;
+}
+#endif // MP4D_ASYNC_SUPPORTED
+
+#if MINIMP4_REMUX_SUPPORTED
+/************************************************************************/
+/*  Remux: MP4 to fragmented MP4, payloads are copied as byte ranges    */
+/************************************************************************/
+
+// Bounce buffer size, used when no copy callback is given
+#define REMUX_COPY_BYTES (1024 * 1024)
+
+typedef struct
+{
+    const MP4D_demux_t *mp4;
+    MP4E_mux_t *mux;
+    int (*copy_callback)(int64_t src_offset, int64_t dst_offset, size_t size, void *token);
+    void *token;
+    unsigned char *buf;
+    const uint64_t *dts_shift; // per track decode time offset of output, or NULL
+} remux_t;
+
+/**
+ *   Copy byte range from source file to current output position
+ */
+static int remux_copy(remux_t *r, int64_t src_offset, uint64_t size)
+{
+    MP4E_mux_t *mux = r->mux;
+    if (r->copy_callback)
+    {
+        if (r->copy_callback(src_offset, mux->write_pos, (size_t)size, r->token))
+            return MP4E_STATUS_FILE_WRITE_ERROR;
+        mux->write_pos += size;
+        return MP4E_STATUS_OK;
+    }
+    while (size)
+    {
+        size_t n = (size_t)MINIMP4_MIN(size, REMUX_COPY_BYTES);
+        if (r->mp4->read_callback(src_offset, r->buf, n, r->mp4->token))
+            return MP4E_STATUS_FILE_READ_ERROR;
+        ERR(mux->write_callback(mux->write_pos, r->buf, n, mux->token));
+        mux->write_pos += n;
+        src_offset += n;
+        size -= n;
+    }
+    return MP4E_STATUS_OK;
+}
+
+/**
+ *   Create output track for each source track, with the same parameter sets or DSI
+ */
+static int remux_add_tracks(remux_t *r)
+{
+    const MP4D_demux_t *mp4 = r->mp4;
+    unsigned ntr;
+    for (ntr = 0; ntr < mp4->track_count; ntr++)
+    {
+        const MP4D_track_t *tr = mp4->track + ntr;
+        MP4E_track_t info;
+        int id;
+
+        memset(&info, 0, sizeof(info));
+        info.object_type_indication = tr->object_type_indication;
+        memcpy(info.language, tr->language, sizeof(info.language));
+        info.time_scale = tr->timescale;
+        // the muxer writes a video sample entry for AVC and HEVC only; other video
+        // goes to a private track, which keeps the samples and decoder specific info
+        if (tr->handler_type == MP4D_HANDLER_TYPE_VIDE &&
+            (tr->object_type_indication == MP4_OBJECT_TYPE_AVC || tr->object_type_indication == MP4_OBJECT_TYPE_HEVC))
+        {
+            info.track_media_kind = e_video;
+            info.u.v.width = tr->SampleDescription.video.width;
+            info.u.v.height = tr->SampleDescription.video.height;
+        }
+        else if (tr->handler_type == MP4D_HANDLER_TYPE_SOUN)
+        {
+            info.track_media_kind = e_audio;
+            info.u.a.channelcount = tr->SampleDescription.audio.channelcount;
+        }
+        else
+        {
+            info.track_media_kind = e_private;
+        }
+        if (!info.time_scale)
+            return MP4E_STATUS_BAD_ARGUMENTS;
+        id = MP4E_add_track(r->mux, &info);
+        if (id < 0)
+            return id;
+
+        if (info.track_media_kind == e_video)
+        {
+            const void *nal;
+            int n, nal_bytes;
+            for (n = 0; (nal = MP4D_read_vps(mp4, ntr, n, &nal_bytes)) != NULL; n++)
+                ERR(MP4E_set_vps(r->mux, id, nal, nal_bytes));
+            for (n = 0; (nal = MP4D_read_sps(mp4, ntr, n, &nal_bytes)) != NULL; n++)
+                ERR(MP4E_set_sps(r->mux, id, nal, nal_bytes));
+            for (n = 0; (nal = MP4D_read_pps(mp4, ntr, n, &nal_bytes)) != NULL; n++)
+                ERR(MP4E_set_pps(r->mux, id, nal, nal_bytes));
+        }
+        else if (tr->dsi_bytes)
+        {
+            ERR(MP4E_set_dsi(r->mux, id, tr->dsi, tr->dsi_bytes));
+        }
+    }
+    return MP4E_STATUS_OK;
+}
+
+/**
+ *   First sample with decode time at or after given time, sample_count if none
+ */
+static unsigned remux_sample_from(const MP4D_track_t *tr, uint64_t time)
+{
+    uint64_t dts;
+    unsigned duration, nsample;
+    if (!tr->sample_count)
+        return 0;
+    nsample = sample_at_dts(tr, (int64_t)time);
+    sample_time(tr, nsample, &dts, &duration);
+    return dts < time ? nsample + 1 : nsample;
+}
+
+/**
+ *   First sync sample at or after given sample, sample_count if none
+ */
+static unsigned remux_sync_from(const MP4D_track_t *tr, unsigned nsample)
+{
+    unsigned lo = 0, hi = tr->sync_count;
+    if (!tr->sync_sample || nsample >= tr->sample_count)
+        return MINIMP4_MIN(nsample, tr->sample_count);
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) >> 1;
+        if (tr->sync_sample[mid] < nsample)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < tr->sync_count ? MINIMP4_MIN(tr->sync_sample[lo], tr->sample_count) : tr->sample_count;
+}
+
+/**
+ *   Size of 'moof' box for given sample ranges
+ */
+static unsigned remux_moof_bytes(const MP4D_demux_t *mp4, const unsigned *first, const unsigned *end)
+{
+    unsigned ntr, bytes = 8 + 16; // moof + mfhd
+    for (ntr = 0; ntr < mp4->track_count; ntr++)
+    {
+        const MP4D_track_t *tr = mp4->track + ntr;
+        unsigned sample_bytes = 8 + (tr->sync_sample ? 4 : 0) + (tr->ctts.run_count ? 4 : 0);
+        if (first[ntr] == end[ntr])
+            continue;
+        bytes += 8;                               // traf
+        bytes += 16 + (tr->sync_sample ? 0 : 4);  // tfhd
+        bytes += 20;                              // tfdt
+        bytes += 20 + (end[ntr] - first[ntr]) * sample_bytes; // trun
+    }
+    return bytes;
+}
+
+/**
+ *   Write one fragment: 'moof' with run of samples for each track, and 'mdat'
+ *   with payloads, copied as contiguous byte ranges of the source file
+ */
+static int remux_write_fragment(remux_t *r, const unsigned *first, const unsigned *end)
+{
+    const MP4D_demux_t *mp4 = r->mp4;
+    MP4E_mux_t *mux = r->mux;
+    unsigned char *stack_base[20]; // atoms nesting stack
+    unsigned char **stack = stack_base;
+    unsigned char *base, *p;
+    unsigned ntr, n, moof_bytes = remux_moof_bytes(mp4, first, end);
+    uint64_t mdat_bytes = 8;
+    int err;
+
+    base = (unsigned char *)malloc(moof_bytes);
+    if (!base)
+        return MP4E_STATUS_NO_MEMORY;
+    p = base;
+
+    ATOM(BOX_moof)
+    ATOM_FULL(BOX_mfhd, 0)
+    WRITE_4(++mux->fragments_count);
+    END_ATOM
+    for (ntr = 0; ntr < mp4->track_count; ntr++)
+    {
+        const MP4D_track_t *tr = mp4->track + ntr;
+        uint64_t dts;
+        unsigned duration, flags;
+        if (first[ntr] == end[ntr])
+            continue;
+        ATOM(BOX_traf)
+        // default-base-is-moof, default-sample-flags-present if every sample is sync
+        ATOM_FULL(BOX_tfhd, tr->sync_sample ? 0x20000 : 0x20020)
+        WRITE_4(ntr + 1); // track_ID
+        if (!tr->sync_sample)
+        {
+            WRITE_4(0x2000000); // default_sample_flags: does not depend on others
+        }
+        END_ATOM
+        sample_time(tr, first[ntr], &dts, &duration);
+        if (r->dts_shift)
+            dts += r->dts_shift[ntr];
+        ATOM_FULL(BOX_tfdt, 0x01000000) // version 1
+        WRITE_4(dts >> 32);
+        WRITE_4(dts & 0xffffffff);
+        END_ATOM
+
+        flags = 0;
+        flags |= 0x001; // data-offset-present
+        flags |= 0x100; // sample-duration-present
+        flags |= 0x200; // sample-size-present
+        if (tr->sync_sample)
+            flags |= 0x400; // sample-flags-present
+        if (tr->ctts.run_count)
+            flags |= 0x01000800; // version 1 (signed offsets), sample-composition-time-offsets-present
+        ATOM_FULL(BOX_trun, flags)
+        WRITE_4(end[ntr] - first[ntr]); // sample_count
+        WRITE_4((unsigned)(moof_bytes + mdat_bytes)); // data_offset, from 'moof' start
+        for (n = first[ntr]; n < end[ntr]; n++)
+        {
+            unsigned frame_bytes;
+            MP4D_frame_offset(mp4, ntr, n, &frame_bytes, NULL, NULL);
+            sample_time(tr, n, &dts, &duration);
+            WRITE_4(duration);
+            WRITE_4(frame_bytes);
+            if (tr->sync_sample)
+            {
+                WRITE_4(MP4D_sample_is_sync(mp4, ntr, n) ? 0x2000000 : 0x1010000);
+            }
+            if (tr->ctts.run_count)
+            {
+                WRITE_4(sample_composition_offset(tr, n));
+            }
+            mdat_bytes += frame_bytes;
+        }
+        END_ATOM
+        END_ATOM
+    }
+    END_ATOM
+    assert((unsigned)(p - base) == moof_bytes);
+
+    if (mdat_bytes > 0xffffffffu)
+    {
+        free(base);
+        return MP4E_STATUS_BAD_ARGUMENTS; // fragment does not fit 32-bit 'mdat'
+    }
+    err = mux->write_callback(mux->write_pos, base, moof_bytes, mux->token);
+    mux->write_pos += moof_bytes;
+    free(base);
+    if (err)
+        return err;
+    ERR(mp4e_write_mdat_box(mux, (uint32_t)mdat_bytes));
+
+    // payloads: samples of a chunk are contiguous, so copy them by one range
+    for (ntr = 0; ntr < mp4->track_count; ntr++)
+    {
+        MP4D_file_offset_t range_offset = 0;
+        uint64_t range_bytes = 0;
+        for (n = first[ntr]; n < end[ntr]; n++)
+        {
+            unsigned frame_bytes;
+            MP4D_file_offset_t offset = MP4D_frame_offset(mp4, ntr, n, &frame_bytes, NULL, NULL);
+            if (range_bytes && offset != range_offset + range_bytes)
+            {
+                ERR(remux_copy(r, range_offset, range_bytes));
+                range_bytes = 0;
+            }
+            if (!range_bytes)
+                range_offset = offset;
+            range_bytes += frame_bytes;
+        }
+        if (range_bytes)
+            ERR(remux_copy(r, range_offset, range_bytes));
+    }
+    return MP4E_STATUS_OK;
+}
+
+/**
+ *   Fragment sample ranges: reference track is cut at sync samples, other
+ *   tracks at the same decode time
+ */
+static int remux_fragments(remux_t *r, unsigned ref, unsigned fragment_ms, unsigned *first, unsigned *end)
+{
+    const MP4D_demux_t *mp4 = r->mp4;
+    const MP4D_track_t *rt = mp4->track + ref;
+    unsigned ntr;
+    for (;;)
+    {
+        uint64_t dts, end_dts = 0;
+        unsigned duration, e = rt->sample_count;
+        int done = 1;
+        if (first[ref] < rt->sample_count)
+        {
+            sample_time(rt, first[ref], &dts, &duration);
+            e = remux_sample_from(rt, dts + (uint64_t)fragment_ms * rt->timescale / 1000);
+            if (e <= first[ref])
+                e = first[ref] + 1;
+            e = remux_sync_from(rt, e);
+        }
+        if (e < rt->sample_count)
+            sample_time(rt, e, &end_dts, &duration);
+        for (ntr = 0; ntr < mp4->track_count; ntr++)
+        {
+            const MP4D_track_t *tr = mp4->track + ntr;
+            if (ntr == ref)
+                end[ntr] = e;
+            else if (e >= rt->sample_count)
+                end[ntr] = tr->sample_count; // last fragment takes the rest
+            else
+                end[ntr] = remux_sample_from(tr, (end_dts * tr->timescale + rt->timescale - 1) / rt->timescale);
+            if (end[ntr] < first[ntr])
+                end[ntr] = first[ntr];
+            if (end[ntr] > first[ntr])
+                done = 0;
+        }
+        if (done)
+            return MP4E_STATUS_OK;
+        ERR(remux_write_fragment(r, first, end));
+        memcpy(first, end, mp4->track_count * sizeof(first[0]));
+    }
+}
+
+// Exported API function
+int MP4E_remux_fragmented(const MP4D_demux_t *mp4, MP4E_mux_t *mux, unsigned fragment_ms,
+                          int (*copy_callback)(int64_t src_offset, int64_t dst_offset, size_t size, void *token), void *token)
+{
+    LOG_INFO("MP4E remux fragmented");
+    remux_t r;
+    unsigned *first, ntr, ref = 0;
+    int err;
+
+    if (!mp4 || !mux || !mux->enable_fragmentation || mux->fragments_count || mux->tracks.bytes)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+
+    memset(&r, 0, sizeof(r));
+    r.mp4 = mp4;
+    r.mux = mux;
+    r.copy_callback = copy_callback;
+    r.token = token;
+    if (!copy_callback)
+    {
+        r.buf = (unsigned char *)malloc(REMUX_COPY_BYTES);
+        if (!r.buf)
+            return MP4E_STATUS_NO_MEMORY;
+    }
+    first = (unsigned *)calloc(2 * mp4->track_count + 1, sizeof(unsigned));
+    if (!first)
+    {
+        free(r.buf);
+        return MP4E_STATUS_NO_MEMORY;
+    }
+
+    // fragments start at sync samples of the first video track
+    for (ntr = 0; ntr < mp4->track_count; ntr++)
+    {
+        if (mp4->track[ntr].handler_type == MP4D_HANDLER_TYPE_VIDE && mp4->track[ntr].sample_count)
+        {
+            ref = ntr;
+            break;
+        }
+    }
+
+    err = remux_add_tracks(&r);
+    if (!err)
+        err = mp4e_flush_index(mux); // 'moov' with 'mvex'
+    if (!err && mp4->track_count)
+        err = remux_fragments(&r, ref, fragment_ms, first, first + mp4->track_count);
+    free(first);
+    free(r.buf);
+    return err;
+}
+
+/**
+ *   Append sample descriptor for payload placed at given output position
+ */
+static int remux_add_sample(MP4E_mux_t *mux, unsigned ntr, boxsize_t offset, const MP4D_sample_info_t *info)
+{
+    track_t *tr = ((track_t *)mux->tracks.data) + ntr;
+    sample_t smp;
+    smp.size = info->size;
+    smp.offset = offset;
+    smp.duration = info->duration;
+    smp.flag_random_access = info->is_sync;
+    smp.composition_offset = (int)(info->pts - (int64_t)info->dts);
+    return NULL != minimp4_vector_put(&tr->smpl, &smp, sizeof(sample_t));
+}
+
+/**
+ *   Append samples [first, end) of each track to non-fragmented output, in source
+ *   file order, so contiguous source ranges stay contiguous in output; first is
+ *   advanced to end
+ */
+static int remux_append_samples(remux_t *r, unsigned *first, const unsigned *end)
+{
+    const MP4D_demux_t *mp4 = r->mp4;
+    MP4E_mux_t *mux = r->mux;
+    MP4D_file_offset_t range_offset = 0;
+    uint64_t range_bytes = 0;
+    unsigned ntr;
+    for (;;)
+    {
+        MP4D_sample_info_t info, next;
+        int nnext = -1;
+        for (ntr = 0; ntr < mp4->track_count; ntr++)
+        {
+            if (first[ntr] < end[ntr] && MP4D_sample_info(mp4, ntr, first[ntr], &info) &&
+                (nnext < 0 || info.offset < next.offset))
+            {
+                nnext = (int)ntr;
+                next = info;
+            }
+        }
+        if (nnext < 0)
+            break;
+        first[nnext]++;
+        if (range_bytes && next.offset != range_offset + range_bytes)
+        {
+            ERR(remux_copy(r, range_offset, range_bytes));
+            range_bytes = 0;
+        }
+        if (!range_bytes)
+            range_offset = next.offset;
+        if (!remux_add_sample(mux, nnext, (boxsize_t)(mux->write_pos + range_bytes), &next))
+            return MP4E_STATUS_NO_MEMORY;
+        range_bytes += next.size;
+    }
+    if (range_bytes)
+        ERR(remux_copy(r, range_offset, range_bytes));
+    return MP4E_STATUS_OK;
+}
+
+// Exported API function
+int MP4E_trim(const MP4D_demux_t *mp4, MP4E_mux_t *mux, uint64_t start_ms, uint64_t end_ms,
+              int (*copy_callback)(int64_t src_offset, int64_t dst_offset, size_t size, void *token), void *token)
+{
+    LOG_INFO("MP4E trim");
+    remux_t r;
+    const MP4D_track_t *rt;
+    unsigned *first, *end, ntr, ref = 0;
+    uint64_t start_dts, end_dts = 0;
+    unsigned duration;
+    int nsync, err;
+
+    if (!mp4 || !mux || mux->sequential_mode_flag || mux->tracks.bytes || !mp4->track_count || (end_ms && start_ms > end_ms))
+        return MP4E_STATUS_BAD_ARGUMENTS;
+
+    // clip is cut by sync samples of the first video track
+    for (ntr = 0; ntr < mp4->track_count; ntr++)
+    {
+        if (mp4->track[ntr].handler_type == MP4D_HANDLER_TYPE_VIDE && mp4->track[ntr].sample_count)
+        {
+            ref = ntr;
+            break;
+        }
+    }
+    rt = mp4->track + ref;
+    if (!rt->sample_count || !rt->timescale)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+
+    memset(&r, 0, sizeof(r));
+    r.mp4 = mp4;
+    r.mux = mux;
+    r.copy_callback = copy_callback;
+    r.token = token;
+    if (!copy_callback)
+    {
+        r.buf = (unsigned char *)malloc(REMUX_COPY_BYTES);
+        if (!r.buf)
+            return MP4E_STATUS_NO_MEMORY;
+    }
+    first = (unsigned *)calloc(2 * mp4->track_count, sizeof(unsigned));
+    if (!first)
+    {
+        free(r.buf);
+        return MP4E_STATUS_NO_MEMORY;
+    }
+    end = first + mp4->track_count;
+
+    // sync sample at or before start, and sync sample at or after end
+    nsync = sync_sample_before(rt, sample_at_dts(rt, (int64_t)(start_ms * rt->timescale / 1000)));
+    first[ref] = nsync < 0 ? 0 : (unsigned)nsync;
+    end[ref] = end_ms ? remux_sync_from(rt, remux_sample_from(rt, (end_ms * rt->timescale + 999) / 1000)) : rt->sample_count;
+    if (end[ref] <= first[ref])
+        end[ref] = remux_sync_from(rt, first[ref] + 1);
+    sample_time(rt, first[ref], &start_dts, &duration);
+    if (end[ref] < rt->sample_count)
+        sample_time(rt, end[ref], &end_dts, &duration);
+    for (ntr = 0; ntr < mp4->track_count; ntr++)
+    {
+        const MP4D_track_t *tr = mp4->track + ntr;
+        if (ntr == ref)
+            continue;
+        first[ntr] = remux_sample_from(tr, (start_dts * tr->timescale + rt->timescale - 1) / rt->timescale);
+        if (end[ref] < rt->sample_count)
+            end[ntr] = remux_sample_from(tr, (end_dts * tr->timescale + rt->timescale - 1) / rt->timescale);
+        else
+            end[ntr] = tr->sample_count;
+        if (end[ntr] < first[ntr])
+            end[ntr] = first[ntr];
+    }
+    err = remux_add_tracks(&r);
+    if (!err)
+        err = remux_append_samples(&r, first, end);
+    free(first);
+    free(r.buf);
+    return err;
+}
+
+/**
+ *   Decode time after the last sample of the track
+ */
+static uint64_t remux_track_end(const MP4D_track_t *tr)
+{
+    uint64_t dts;
+    unsigned duration;
+    if (!tr->sample_count)
+        return 0;
+    sample_time(tr, tr->sample_count - 1, &dts, &duration);
+    return dts + duration;
+}
+
+/**
+ *   Check that tracks of two files have the same sample descriptions.
+ *   Video DSI holds all SPS/PPS (and VPS), so it is compared as whole
+ */
+static int remux_compatible(const MP4D_demux_t *a, const MP4D_demux_t *b)
+{
+    unsigned ntr;
+    if (a->track_count != b->track_count)
+        return 0;
+    for (ntr = 0; ntr < a->track_count; ntr++)
+    {
+        const MP4D_track_t *ta = a->track + ntr, *tb = b->track + ntr;
+        if (ta->handler_type != tb->handler_type || ta->object_type_indication != tb->object_type_indication ||
+            ta->timescale != tb->timescale || ta->dsi_bytes != tb->dsi_bytes ||
+            (ta->dsi_bytes && memcmp(ta->dsi, tb->dsi, ta->dsi_bytes)))
+            return 0;
+        if (ta->handler_type == MP4D_HANDLER_TYPE_VIDE &&
+            (ta->SampleDescription.video.width != tb->SampleDescription.video.width ||
+             ta->SampleDescription.video.height != tb->SampleDescription.video.height))
+            return 0;
+        if (ta->handler_type == MP4D_HANDLER_TYPE_SOUN &&
+            ta->SampleDescription.audio.channelcount != tb->SampleDescription.audio.channelcount)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ *   Align end of each output track to given decode time by adjusting duration
+ *   of its last sample, so tracks of next segment start in sync
+ */
+static void remux_align_tracks(MP4E_mux_t *mux, const uint64_t *end_dts, const uint64_t *shift)
+{
+    unsigned ntr, ntracks = mux->tracks.bytes / sizeof(track_t);
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t *)mux->tracks.data) + ntr;
+        sample_t *last;
+        int64_t duration;
+        if (!tr->smpl.bytes)
+            continue;
+        last = (sample_t *)(tr->smpl.data + tr->smpl.bytes) - 1;
+        duration = (int64_t)last->duration + (int64_t)(shift[ntr] - end_dts[ntr]);
+        if (duration > 0 && duration <= 0xffffffff)
+            last->duration = (unsigned)duration;
+    }
+}
+
+// Exported API function
+int MP4E_concat(const MP4D_demux_t *const *segments, unsigned count, MP4E_mux_t *mux, unsigned fragment_ms,
+                int (*copy_callback)(int64_t src_offset, int64_t dst_offset, size_t size, void *token))
+{
+    LOG_INFO("MP4E concat");
+    remux_t r;
+    unsigned *first, *end, nseg, ntr, ntracks, ref = 0;
+    uint64_t *shift, *end_dts, seg_start = 0;
+    const MP4D_track_t *rt;
+    int err;
+
+    if (!segments || !count || !segments[0] || !mux || (mux->sequential_mode_flag && !mux->enable_fragmentation) ||
+        mux->fragments_count || mux->tracks.bytes || !segments[0]->track_count)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    ntracks = segments[0]->track_count;
+    for (nseg = 1; nseg < count; nseg++)
+    {
+        if (!segments[nseg] || !remux_compatible(segments[0], segments[nseg]))
+            return MP4E_STATUS_INCOMPATIBLE_TRACKS;
+    }
+
+    // segments are joined end to end by duration of the first video track
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        if (segments[0]->track[ntr].handler_type == MP4D_HANDLER_TYPE_VIDE)
+        {
+            ref = ntr;
+            break;
+        }
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.mp4 = segments[0];
+    r.mux = mux;
+    r.copy_callback = copy_callback;
+    if (!copy_callback)
+    {
+        r.buf = (unsigned char *)malloc(REMUX_COPY_BYTES);
+        if (!r.buf)
+            return MP4E_STATUS_NO_MEMORY;
+    }
+    shift = (uint64_t *)calloc(ntracks, 2 * sizeof(uint64_t) + 2 * sizeof(unsigned));
+    if (!shift)
+    {
+        free(r.buf);
+        return MP4E_STATUS_NO_MEMORY;
+    }
+    end_dts = shift + ntracks;
+    first = (unsigned *)(end_dts + ntracks);
+    end = first + ntracks;
+    r.dts_shift = shift;
+
+    err = remux_add_tracks(&r);
+    if (!err && mux->enable_fragmentation)
+        err = mp4e_flush_index(mux); // 'moov' with 'mvex'
+    for (nseg = 0; nseg < count && !err; nseg++)
+    {
+        const MP4D_demux_t *mp4 = segments[nseg];
+        r.mp4 = mp4;
+        r.token = mp4->token; // copy_callback identifies source file by its read token
+        rt = mp4->track + ref;
+        for (ntr = 0; ntr < ntracks; ntr++)
+        {
+            const MP4D_track_t *tr = mp4->track + ntr;
+            shift[ntr] = seg_start * tr->timescale / rt->timescale;
+            first[ntr] = 0;
+            end[ntr] = tr->sample_count;
+        }
+        if (mux->enable_fragmentation)
+        {
+            err = remux_fragments(&r, ref, fragment_ms, first, end);
+        }
+        else
+        {
+            if (nseg)
+                remux_align_tracks(mux, end_dts, shift);
+            err = remux_append_samples(&r, first, end);
+        }
+        for (ntr = 0; ntr < ntracks; ntr++)
+            end_dts[ntr] = shift[ntr] + remux_track_end(mp4->track + ntr);
+        seg_start += remux_track_end(rt);
+    }
+    free(shift);
+    free(r.buf);
+    return err;
+}
+#endif // MINIMP4_REMUX_SUPPORTED
+
+#if MINIMP4_RECOVER_SUPPORTED
+/************************************************************************/
+/*  Recovery of unfinished sequential mode file: one 'mdat' per sample  */
+/************************************************************************/
+
+// Payload bytes read at once while walking NAL units of the sample
+#define RECOVER_READ_BYTES 4096
+
+/**
+ *   Check if 'mdat' payload is a chain of 4-byte length prefixed NAL units, which
+ *   covers it exactly. Returns 1 for key frame, 0 for other video frame, -1 if
+ *   payload is not a video frame, -2 on read error
+ */
+static int recover_classify(int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token,
+                            int64_t offset, uint64_t size, int hevc)
+{
+    unsigned char buf[RECOVER_READ_BYTES];
+    uint64_t pos = 0, buf_pos = 0, buf_bytes = 0;
+    unsigned header_bytes = hevc ? 2 : 1; // NAL unit header
+    int sync = 0;
+    while (pos < size)
+    {
+        const unsigned char *p;
+        uint64_t nal_bytes;
+        unsigned type;
+        if (size - pos < 4 + header_bytes)
+            return -1;
+        if (pos + 4 + header_bytes > buf_pos + buf_bytes)
+        {
+            // only length fields and NAL headers are read: frame data is skipped
+            buf_pos = pos;
+            buf_bytes = MINIMP4_MIN(size - pos, sizeof(buf));
+            if (read_callback(offset + pos, buf, (size_t)buf_bytes, token))
+                return -2;
+        }
+        p = buf + (pos - buf_pos);
+        nal_bytes = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        if (nal_bytes < header_bytes || nal_bytes > size - pos - 4 || (p[4] & 0x80)) // forbidden_zero_bit
+            return -1;
+        if (hevc)
+        {
+            type = (p[4] >> 1) & 0x3f;
+            if (type > 40 || !(p[5] & 7)) // reserved type, or zero nuh_temporal_id_plus1
+                return -1;
+            sync |= type >= 16 && type <= 21; // BLA, IDR, CRA
+        }
+        else
+        {
+            type = p[4] & 0x1f;
+            if (!type || type > 23)
+                return -1;
+            sync |= type == 5; // IDR
+        }
+        pos += 4 + nal_bytes;
+    }
+    return sync;
+}
+
+/**
+ *   Walk sample boxes from current write position of sequential mode mux, and
+ *   add them to its first video and audio tracks
+ */
+static int recover_walk(MP4E_mux_t *mux, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token),
+                        void *token, int64_t file_size)
+{
+    track_t *video = NULL, *audio = NULL;
+    int64_t pos = mux->write_pos;
+    unsigned ntr, ntracks = mux->tracks.bytes / sizeof(track_t);
+
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t *)mux->tracks.data) + ntr;
+        if (tr->info.track_media_kind == e_video && !video)
+            video = tr;
+        if (tr->info.track_media_kind == e_audio && !audio)
+            audio = tr;
+    }
+    if (!video && !audio)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+
+    // walk top-level boxes, written by write_pending_data(), up to torn tail
+    while (pos + 8 <= file_size)
+    {
+        unsigned char hdr[16];
+        uint64_t box_bytes;
+        unsigned header_bytes = 8;
+        uint32_t type;
+        if (read_callback(pos, hdr, 8, token))
+            return MP4E_STATUS_FILE_READ_ERROR;
+        box_bytes = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+        type = ((uint32_t)hdr[4] << 24) | ((uint32_t)hdr[5] << 16) | ((uint32_t)hdr[6] << 8) | hdr[7];
+        if (box_bytes == 1)
+        {
+            if (pos + 16 > file_size || read_callback(pos + 8, hdr + 8, 8, token))
+                break;
+            box_bytes = ((uint64_t)hdr[8] << 56) | ((uint64_t)hdr[9] << 48) | ((uint64_t)hdr[10] << 40) |
+                        ((uint64_t)hdr[11] << 32) | ((uint32_t)hdr[12] << 24) | ((uint32_t)hdr[13] << 16) |
+                        ((uint32_t)hdr[14] << 8) | hdr[15];
+            header_bytes = 16;
+        }
+        if (box_bytes < header_bytes || box_bytes > (uint64_t)(file_size - pos) || type == BOX_moov)
+            break; // incomplete box: power lost while writing it; or file was closed
+        if (type == BOX_mdat && box_bytes > header_bytes)
+        {
+            track_t *tr = audio;
+            int64_t offset = pos + header_bytes;
+            uint64_t size = box_bytes - header_bytes;
+            int kind = -1;
+            if (video)
+                kind = recover_classify(read_callback, token, offset, size, video->info.object_type_indication == MP4_OBJECT_TYPE_HEVC);
+            if (kind == -2)
+                return MP4E_STATUS_FILE_READ_ERROR;
+            if (kind >= 0)
+                tr = video;
+            if (tr)
+            {
+                sample_t smp;
+                smp.size = (boxsize_t)size;
+                smp.offset = (boxsize_t)offset;
+                smp.duration = tr->info.default_duration;
+                if (!smp.duration && tr->smpl.bytes)
+                    smp.duration = ((sample_t *)(tr->smpl.data + tr->smpl.bytes) - 1)->duration;
+                smp.flag_random_access = tr == audio || kind == 1;
+                smp.composition_offset = 0;
+                if (!minimp4_vector_put(&tr->smpl, &smp, sizeof(sample_t)))
+                    return MP4E_STATUS_NO_MEMORY;
+            }
+        }
+        pos += box_bytes;
+    }
+    mux->write_pos = pos; // new 'moov' replaces torn tail
+    return MP4E_STATUS_OK;
+}
+
+// Exported API function
+int MP4E_recover(MP4E_mux_t *mux, int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token),
+                 void *token, int64_t file_size)
+{
+    LOG_INFO("MP4E recover");
+    unsigned ntr, ntracks;
+
+    if (!mux || !read_callback || !mux->sequential_mode_flag || mux->enable_fragmentation)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    ntracks = mux->tracks.bytes / sizeof(track_t);
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t *)mux->tracks.data) + ntr;
+        if (tr->smpl.bytes || tr->pending_sample.bytes)
+            return MP4E_STATUS_BAD_ARGUMENTS;
+    }
+    return recover_walk(mux, read_callback, token, file_size);
+}
+#endif // MINIMP4_RECOVER_SUPPORTED
+
+#if MINIMP4_JOURNAL_SUPPORTED
+/************************************************************************/
+/*  Index journal: sample table checkpoints, to rebuild lost 'moov'     */
+/************************************************************************/
+
+#define JOURNAL_MAGIC 0x4c4e4a4d // "MJNL"
+#define JOURNAL_TRACKS 1          // record with tracks, parameter sets and DSI
+#define JOURNAL_SAMPLES 2         // record with new sample descriptors
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t type;
+    uint32_t bytes;    // record size, including this header
+    uint32_t checksum; // of the record body
+} journal_record_t;
+
+typedef struct
+{
+    uint32_t track_count;
+    uint32_t sequential_mode_flag;
+    uint32_t sample_bytes; // sizeof(sample_t): journal is read by the same build
+    uint32_t endian;       // 1, in host byte order
+} journal_tracks_t;
+
+// Each track of JOURNAL_TRACKS record: followed by vsps, vpps and vvps bytes
+typedef struct
+{
+    MP4E_track_t info;
+    uint32_t vsps_bytes;
+    uint32_t vpps_bytes;
+    uint32_t vvps_bytes;
+} journal_track_t;
+
+// Each track of JOURNAL_SAMPLES record: followed by count of sample_t
+typedef struct
+{
+    uint32_t ntrack;
+    uint32_t count;
+} journal_samples_t;
+
+/**
+ *   FNV-1a hash of record body, detects torn record at journal tail
+ */
+static uint32_t journal_checksum(const unsigned char *p, size_t bytes)
+{
+    uint32_t h = 2166136261u;
+    while (bytes--)
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+/**
+ *   Start new record in the journal buffer, returns its position
+ */
+static int journal_begin(minimp4_vector_t *v, uint32_t type)
+{
+    journal_record_t rec;
+    int start = v->bytes;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = JOURNAL_MAGIC;
+    rec.type = type;
+    return minimp4_vector_put(v, &rec, sizeof(rec)) ? start : -1;
+}
+
+/**
+ *   Complete record, started at given position, with its size and checksum
+ */
+static void journal_end(minimp4_vector_t *v, int start)
+{
+    journal_record_t *rec = (journal_record_t *)(v->data + start);
+    rec->bytes = (uint32_t)(v->bytes - start);
+    rec->checksum = journal_checksum(v->data + start + sizeof(*rec), rec->bytes - sizeof(*rec));
+}
+
+/**
+ *   Write one checkpoint: tracks record, if tracks or their parameter sets have
+ *   changed, and descriptors of samples added since previous checkpoint.
+ *   Last sample of each track is kept: it may get continuation, and in
+ *   sequential mode its data is not written yet
+ */
+static int journal_checkpoint(MP4E_mux_t *mux)
+{
+    minimp4_vector_t *v = &mux->journal_buf;
+    unsigned ntr, ntracks = mux->tracks.bytes / sizeof(track_t);
+    int start, changed = (ntracks != mux->journal_tracks);
+
+    v->bytes = 0;
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t *)mux->tracks.data) + ntr;
+        if (tr->vsps.bytes + tr->vpps.bytes + tr->vvps.bytes != tr->journal_param_bytes)
+            changed = 1; // parameter sets are only appended
+    }
+    if (changed)
+    {
+        journal_tracks_t th;
+        if ((start = journal_begin(v, JOURNAL_TRACKS)) < 0)
+            return MP4E_STATUS_NO_MEMORY;
+        th.track_count = ntracks;
+        th.sequential_mode_flag = mux->sequential_mode_flag;
+        th.sample_bytes = sizeof(sample_t);
+        th.endian = 1;
+        if (!minimp4_vector_put(v, &th, sizeof(th)))
+            return MP4E_STATUS_NO_MEMORY;
+        for (ntr = 0; ntr < ntracks; ntr++)
+        {
+            track_t *tr = ((track_t *)mux->tracks.data) + ntr;
+            journal_track_t jt;
+            memset(&jt, 0, sizeof(jt));
+            jt.info = tr->info;
+            jt.vsps_bytes = tr->vsps.bytes;
+            jt.vpps_bytes = tr->vpps.bytes;
+            jt.vvps_bytes = tr->vvps.bytes;
+            if (!minimp4_vector_put(v, &jt, sizeof(jt)) || !minimp4_vector_put(v, tr->vsps.data, tr->vsps.bytes) ||
+                !minimp4_vector_put(v, tr->vpps.data, tr->vpps.bytes) || !minimp4_vector_put(v, tr->vvps.data, tr->vvps.bytes))
+                return MP4E_STATUS_NO_MEMORY;
+            tr->journal_param_bytes = tr->vsps.bytes + tr->vpps.bytes + tr->vvps.bytes;
+        }
+        journal_end(v, start);
+        mux->journal_tracks = ntracks;
+    }
+
+    if ((start = journal_begin(v, JOURNAL_SAMPLES)) < 0)
+        return MP4E_STATUS_NO_MEMORY;
+    for (ntr = 0; ntr < ntracks; ntr++)
+    {
+        track_t *tr = ((track_t *)mux->tracks.data) + ntr;
+        int complete = tr->smpl.bytes / sizeof(sample_t) - 1;
+        journal_samples_t js;
+        tr->journal_duration = 0;
+        if (complete <= tr->journal_samples)
+            continue;
+        js.ntrack = ntr;
+        js.count = complete - tr->journal_samples;
+        if (!minimp4_vector_put(v, &js, sizeof(js)) ||
+            !minimp4_vector_put(v, tr->smpl.data + tr->journal_samples * sizeof(sample_t), js.count * sizeof(sample_t)))
+            return MP4E_STATUS_NO_MEMORY;
+        tr->journal_samples = complete;
+    }
+    if (v->bytes == start + (int)sizeof(journal_record_t))
+        v->bytes = start; // nothing new
+    else
+        journal_end(v, start);
+
+    if (!v->bytes)
+        return MP4E_STATUS_OK;
+    ERR(mux->journal_callback(mux->journal_pos, v->data, v->bytes, mux->journal_token));
+    mux->journal_pos += v->bytes;
+    return MP4E_STATUS_OK;
+}
+
+/**
+ *   Account new sample of the track, write checkpoint when interval is passed
+ */
+static int journal_on_sample(MP4E_mux_t *mux, track_t *tr, unsigned duration)
+{
+    tr->journal_duration += duration ? duration : tr->info.default_duration;
+    if (tr->journal_duration * 1000 < (uint64_t)mux->journal_interval_ms * tr->info.time_scale)
+        return MP4E_STATUS_OK;
+    return journal_checkpoint(mux);
+}
+
+// Exported API function
+int MP4E_set_journal(MP4E_mux_t *mux, unsigned interval_ms,
+                     int (*write_callback)(int64_t offset, const void *buffer, size_t size, void *token), void *token)
+{
+    LOG_INFO("MP4E set journal");
+    if (!mux || mux->enable_fragmentation)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    mux->journal_callback = write_callback;
+    mux->journal_token = token;
+    mux->journal_interval_ms = interval_ms;
+    return MP4E_STATUS_OK;
+}
+
+// Exported API function
+int MP4E_replay_journal(MP4E_mux_t *mux, const void *journal, size_t journal_bytes,
+                        int (*read_callback)(int64_t offset, void *buffer, size_t size, void *token), void *token,
+                        int64_t file_size)
+{
+    LOG_INFO("MP4E replay journal");
+    const unsigned char *p = (const unsigned char *)journal;
+    const unsigned char *end = p + journal_bytes;
+    int64_t data_end = 0;
+    int have_tracks = 0;
+
+    if (!mux || !journal || !mux->sequential_mode_flag || mux->enable_fragmentation || mux->tracks.bytes)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+
+    // records are parsed up to the first torn or corrupted one
+    while ((size_t)(end - p) >= sizeof(journal_record_t))
+    {
+        journal_record_t rec;
+        const unsigned char *body, *body_end;
+        memcpy(&rec, p, sizeof(rec));
+        if (rec.magic != JOURNAL_MAGIC || rec.bytes < sizeof(rec) || rec.bytes > (size_t)(end - p) ||
+            rec.checksum != journal_checksum(p + sizeof(rec), rec.bytes - sizeof(rec)))
+            break;
+        body = p + sizeof(rec);
+        body_end = p + rec.bytes;
+        p = body_end;
+
+        if (rec.type == JOURNAL_TRACKS)
+        {
+            journal_tracks_t th;
+            unsigned ntr;
+            if ((size_t)(body_end - body) < sizeof(th))
+                break;
+            memcpy(&th, body, sizeof(th));
+            body += sizeof(th);
+            if (th.sample_bytes != sizeof(sample_t) || th.endian != 1)
+                return MP4E_STATUS_BAD_ARGUMENTS; // written by other build
+            // journal tells the mode; 'ftyp' and 'mdat' filler are already in the file
+            mux->sequential_mode_flag = th.sequential_mode_flag;
+            for (ntr = 0; ntr < th.track_count; ntr++)
+            {
+                journal_track_t jt;
+                track_t *tr;
+                if ((size_t)(body_end - body) < sizeof(jt))
+                    return MP4E_STATUS_BAD_ARGUMENTS;
+                memcpy(&jt, body, sizeof(jt));
+                body += sizeof(jt);
+                if ((size_t)(body_end - body) < (size_t)jt.vsps_bytes + jt.vpps_bytes + jt.vvps_bytes)
+                    return MP4E_STATUS_BAD_ARGUMENTS;
+                if (ntr >= mux->tracks.bytes / sizeof(track_t))
+                {
+                    int id = MP4E_add_track(mux, &jt.info);
+                    if (id < 0)
+                        return id;
+                }
+                tr = ((track_t *)mux->tracks.data) + ntr;
+                tr->vsps.bytes = tr->vpps.bytes = tr->vvps.bytes = 0;
+                if (!minimp4_vector_put(&tr->vsps, body, jt.vsps_bytes) ||
+                    !minimp4_vector_put(&tr->vpps, body + jt.vsps_bytes, jt.vpps_bytes) ||
+                    !minimp4_vector_put(&tr->vvps, body + jt.vsps_bytes + jt.vpps_bytes, jt.vvps_bytes))
+                    return MP4E_STATUS_NO_MEMORY;
+                body += jt.vsps_bytes + jt.vpps_bytes + jt.vvps_bytes;
+            }
+            have_tracks = 1;
+        }
+        else if (rec.type == JOURNAL_SAMPLES && have_tracks)
+        {
+            while ((size_t)(body_end - body) >= sizeof(journal_samples_t))
+            {
+                journal_samples_t js;
+                track_t *tr;
+                unsigned i;
+                memcpy(&js, body, sizeof(js));
+                body += sizeof(js);
+                if (js.ntrack >= mux->tracks.bytes / sizeof(track_t) ||
+                    (size_t)(body_end - body) / sizeof(sample_t) < js.count)
+                    return MP4E_STATUS_BAD_ARGUMENTS;
+                tr = ((track_t *)mux->tracks.data) + js.ntrack;
+                for (i = 0; i < js.count; i++, body += sizeof(sample_t))
+                {
+                    sample_t smp;
+                    memcpy(&smp, body, sizeof(smp));
+                    if ((int64_t)(smp.offset + smp.size) > file_size)
+                        continue; // file data lost, e.g. not synced to disk
+                    if (!minimp4_vector_put(&tr->smpl, &smp, sizeof(smp)))
+                        return MP4E_STATUS_NO_MEMORY;
+                    if ((int64_t)(smp.offset + smp.size) > data_end)
+                        data_end = (int64_t)(smp.offset + smp.size);
+                }
+            }
+        }
+    }
+    if (!have_tracks)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    if (!mux->sequential_mode_flag)
+    {
+        // samples after the last checkpoint have no boundaries: keep them in
+        // 'mdat', which MP4E_close() extends up to 'moov' at the file end
+        mux->write_pos = file_size;
+        return MP4E_STATUS_OK;
+    }
+    if (data_end > mux->write_pos)
+        mux->write_pos = data_end;
+#if MINIMP4_RECOVER_SUPPORTED
+    // sample boxes written after the last checkpoint
+    if (read_callback)
+        return recover_walk(mux, read_callback, token, file_size);
+#else
+    (void)read_callback;
+    (void)token;
+#endif
+    return MP4E_STATUS_OK;
+}
+#endif // MINIMP4_JOURNAL_SUPPORTED
+
+#if MINIMP4_INTERLEAVE_SUPPORTED
+/************************************************************************/
+/*  Interleaver: write samples of all tracks in decode time order       */
+/************************************************************************/
+
+typedef struct
+{
+    int bytes;
+    int duration;
+    int kind;
+} interleave_sample_t; // followed by sample data in track_t::queue
+
+/**
+ *   Decode time of track a is earlier than of track b
+ */
+static int interleave_earlier(const track_t *a, uint64_t dts_a, const track_t *b, uint64_t dts_b)
+{
+    return dts_a * b->info.time_scale < dts_b * a->info.time_scale;
+}
+
+/**
+ *   Queued sample is complete when the next one is queued: till then
+ *   continuations may come
+ */
+static int interleave_ready(const track_t *tr, int final)
+{
+    return tr->queue_samples >= (final ? 1 : 2);
+}
+
+/**
+ *   Write first queued sample of the track with its continuations
+ */
+static int interleave_write(MP4E_mux_t *mux, int track_num)
+{
+    track_t *tr = ((track_t *)mux->tracks.data) + track_num;
+    int direct = mux->sequential_mode_flag && !mux->enable_fragmentation;
+    interleave_sample_t head, smp;
+    int pos, end, bytes = 0;
+
+    memcpy(&head, tr->queue.data + tr->queue_read, sizeof(head));
+    for (end = tr->queue_read; end < tr->queue.bytes; end += sizeof(smp) + smp.bytes)
+    {
+        memcpy(&smp, tr->queue.data + end, sizeof(smp));
+        if (end != tr->queue_read && smp.kind != MP4E_SAMPLE_CONTINUATION)
+            break;
+        bytes += smp.bytes;
+    }
+    if (direct)
+    {
+        // sample is complete: write its 'mdat' from the queue, not staged in
+        // pending_sample till the next sample of the track
+        unsigned char base[8], *p = base;
+        ERR(write_pending_data(mux, tr)); // sample put before MP4E_set_interleave()
+        WRITE_4(bytes + 8);
+        WRITE_4(BOX_mdat);
+        ERR(mux->write_callback(mux->write_pos, base, p - base, mux->token));
+        mux->write_pos += p - base;
+        if (!add_sample_descriptor(mux, tr, bytes, head.duration, head.kind))
+            return MP4E_STATUS_NO_MEMORY;
+#if MINIMP4_JOURNAL_SUPPORTED
+        if (mux->journal_callback)
+            ERR(journal_on_sample(mux, tr, head.duration));
+#endif
+    }
+    for (pos = tr->queue_read; pos < end; pos += sizeof(smp) + smp.bytes)
+    {
+        const unsigned char *data = tr->queue.data + pos + sizeof(smp);
+        memcpy(&smp, tr->queue.data + pos, sizeof(smp));
+        if (direct)
+        {
+            ERR(mux->write_callback(mux->write_pos, data, smp.bytes, mux->token));
+            mux->write_pos += smp.bytes;
+        }
+        else
+        {
+            ERR(mp4e_put_sample(mux, track_num, data, smp.bytes, smp.duration, smp.kind));
+        }
+    }
+    tr->queue_read = end;
+    tr->queue_dts += head.duration;
+    tr->queue_duration -= head.duration;
+    tr->queue_samples--;
+    if (tr->queue_read * 2 >= tr->queue.bytes)
+    {
+        // compact, queue is at most half full here
+        tr->queue.bytes -= tr->queue_read;
+        memmove(tr->queue.data, tr->queue.data + tr->queue_read, tr->queue.bytes);
+        tr->queue_read = 0;
+    }
+    return MP4E_STATUS_OK;
+}
+
+/**
+ *   Write queued samples which are next in decode time order. A track with
+ *   no complete sample holds others back, unless some track queued more
+ *   than the window
+ */
+static int interleave_flush(MP4E_mux_t *mux, int final)
+{
+    int ntracks = mux->tracks.bytes / sizeof(track_t);
+    track_t *tracks = (track_t *)mux->tracks.data;
+    for (;;)
+    {
+        int i, best = -1, wait = 0, full = 0;
+        for (i = 0; i < ntracks; i++)
+            if (interleave_ready(tracks + i, final) &&
+                (best < 0 || interleave_earlier(tracks + i, tracks[i].queue_dts, tracks + best, tracks[best].queue_dts)))
+                best = i;
+        if (best < 0)
+            return MP4E_STATUS_OK;
+        for (i = 0; i < ntracks; i++)
+        {
+            track_t *tr = tracks + i;
+            if (!interleave_ready(tr, final) && interleave_earlier(tr, tr->queue_dts, tracks + best, tracks[best].queue_dts))
+                wait = 1;
+            if (tr->queue_duration * 1000 > (uint64_t)mux->interleave_window_ms * tr->info.time_scale)
+                full = 1;
+        }
+        if (wait && !full && !final)
+            return MP4E_STATUS_OK;
+        ERR(interleave_write(mux, best));
+    }
+}
+
+static int interleave_put(MP4E_mux_t *mux, int track_num, const void *data, int data_bytes, int duration, int kind)
+{
+    track_t *tr;
+    interleave_sample_t smp;
+    unsigned char *p;
+    if (!data || data_bytes < 0 || track_num < 0 || track_num >= (int)(mux->tracks.bytes / sizeof(track_t)))
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    tr = ((track_t *)mux->tracks.data) + track_num;
+    if (kind == MP4E_SAMPLE_CONTINUATION && tr->queue_read == tr->queue.bytes)
+        return mp4e_put_sample(mux, track_num, data, data_bytes, duration, kind); // sample written before MP4E_set_interleave()
+
+    smp.bytes = data_bytes;
+    smp.duration = duration ? duration : (int)tr->info.default_duration;
+    smp.kind = kind;
+    p = minimp4_vector_alloc_tail(&tr->queue, sizeof(smp) + data_bytes);
+    if (!p)
+        return MP4E_STATUS_NO_MEMORY;
+    memcpy(p, &smp, sizeof(smp));
+    memcpy(p + sizeof(smp), data, data_bytes);
+    if (kind != MP4E_SAMPLE_CONTINUATION)
+    {
+        tr->queue_duration += smp.duration;
+        tr->queue_samples++;
+    }
+    return interleave_flush(mux, 0);
+}
+
+// Exported API function
+int MP4E_set_interleave(MP4E_mux_t *mux, unsigned window_ms)
+{
+    int ntr, ntracks;
+    if (!mux)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    ntracks = mux->tracks.bytes / sizeof(track_t);
+    if (!window_ms)
+    {
+        int err = mux->interleave_window_ms ? interleave_flush(mux, 1) : MP4E_STATUS_OK;
+        mux->interleave_window_ms = 0;
+        return err;
+    }
+    if (!mux->interleave_window_ms)
+    {
+        // continue decode time of samples written so far
+        for (ntr = 0; ntr < ntracks; ntr++)
+        {
+            track_t *tr = ((track_t *)mux->tracks.data) + ntr;
+            const sample_t *smp = (const sample_t *)tr->smpl.data;
+            int i, nsamples = tr->smpl.bytes / sizeof(sample_t);
+            tr->queue_dts = 0;
+            for (i = 0; i < nsamples; i++)
+                tr->queue_dts += smp[i].duration;
+        }
+    }
+    mux->interleave_window_ms = window_ms;
+    return interleave_flush(mux, 0);
 }
+#endif // MINIMP4_INTERLEAVE_SUPPORTED
 
 // #if MP4D_PRINT_INFO_SUPPORTED
 /************************************************************************/
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "../log/log.h"
+#include "mp4mux.h"
+
+typedef struct
+{
+    const void *data;
+    int size;
+    int64_t timestamp;
+    int duration;
+    int kind;
+    mp4mux_release_cb release_cb;
+    void *user;
+} mux_entry_t;
+
+typedef struct
+{
+    MP4E_mux_t *mux;
+    int track_id;
+    mp4_h26x_writer_t *writer; // H.26x track, if not NULL
+
+    // SPSC ring: tail is written by the producer only, head by the worker only
+    mux_entry_t *ring;
+    unsigned head;
+    unsigned tail;
+    unsigned dropped;
+    int full;          // push failed, space_cb is due when the worker frees a slot
+} mux_track_t;
+
+struct mp4mux
+{
+    mux_track_t track[MP4MUX_MAX_TRACKS];
+    int track_count;
+    unsigned mask;     // ring size - 1
+    int64_t max_delay;
+
+    sem_t wake;        // posted on every push and on stop
+    pthread_t thread;
+    int running;
+    int stop;
+    int error;         // first muxing error, samples are released without muxing after it
+    mp4mux_space_cb space_cb;
+    void *space_user;
+};
+
+static void mux_free_copy(const void *data, void *user)
+{
+    (void)user;
+    free((void *)data);
+}
+
+/**
+ *   Track with the oldest queued sample, or -1 if the worker should wait:
+ *   some track is empty and the oldest sample is not max_delay old yet
+ */
+static int mux_pick(mp4mux_t *m, int flush)
+{
+    int i, best = -1, empty = 0;
+    int64_t best_ts = 0, newest = INT64_MIN;
+    for (i = 0; i < m->track_count; i++)
+    {
+        mux_track_t *tr = m->track + i;
+        unsigned tail = __atomic_load_n(&tr->tail, __ATOMIC_ACQUIRE);
+        const mux_entry_t *e;
+        if (tr->head == tail)
+        {
+            empty = 1;
+            continue;
+        }
+        e = tr->ring + (tr->head & m->mask);
+        if (best < 0 || e->timestamp < best_ts)
+        {
+            best = i;
+            best_ts = e->timestamp;
+        }
+        e = tr->ring + ((tail - 1) & m->mask);
+        if (newest < e->timestamp)
+            newest = e->timestamp;
+    }
+    if (best >= 0 && empty && !flush && newest - best_ts < m->max_delay)
+        return -1;
+    return best;
+}
+
+static void mux_write(mp4mux_t *m, mux_track_t *tr)
+{
+    const mux_entry_t *e = tr->ring + (tr->head & m->mask);
+    if (m->error == MP4E_STATUS_OK)
+    {
+        if (tr->writer)
+            m->error = mp4_h26x_write_nal(tr->writer, (const unsigned char *)e->data, e->size, e->duration);
+        else
+            m->error = MP4E_put_sample(tr->mux, tr->track_id, e->data, e->size, e->duration, e->kind);
+        if (m->error != MP4E_STATUS_OK)
+            log_error("mux track %d failed: %d", (int)(tr - m->track), m->error);
+    }
+    if (e->release_cb)
+        e->release_cb(e->data, e->user);
+    __atomic_store_n(&tr->head, tr->head + 1, __ATOMIC_RELEASE);
+    if (m->space_cb)
+    {
+        // pairs with the fence of mp4mux_push(): either it sees the slot or we see full
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tr->full, __ATOMIC_RELAXED) && __atomic_exchange_n(&tr->full, 0, __ATOMIC_RELAXED))
+            m->space_cb((int)(tr - m->track), m->space_user);
+    }
+}
+
+static void *mux_worker(void *arg)
+{
+    mp4mux_t *m = (mp4mux_t *)arg;
+    for (;;)
+    {
+        int stop = __atomic_load_n(&m->stop, __ATOMIC_ACQUIRE);
+        int k;
+        while ((k = mux_pick(m, stop)) >= 0)
+            mux_write(m, m->track + k);
+        if (stop)
+            break;
+        // picking changes only after a push, no timeout needed
+        while (sem_wait(&m->wake) && !__atomic_load_n(&m->stop, __ATOMIC_ACQUIRE))
+            ;
+    }
+    return NULL;
+}
+
+mp4mux_t *mp4mux_create(unsigned ring_size, int64_t max_delay)
+{
+    mp4mux_t *m;
+    unsigned size = 1;
+    if (!ring_size)
+        ring_size = MP4MUX_RING_SIZE;
+    while (size < ring_size)
+        size <<= 1;
+    m = (mp4mux_t *)calloc(1, sizeof(mp4mux_t));
+    if (!m)
+        return NULL;
+    if (sem_init(&m->wake, 0, 0))
+    {
+        free(m);
+        return NULL;
+    }
+    m->mask = size - 1;
+    m->max_delay = max_delay;
+    return m;
+}
+
+static int mux_add(mp4mux_t *m, MP4E_mux_t *mux, int track_id, mp4_h26x_writer_t *writer)
+{
+    mux_track_t *tr;
+    if (!m || m->running || m->track_count == MP4MUX_MAX_TRACKS)
+        return -1;
+    tr = m->track + m->track_count;
+    tr->ring = (mux_entry_t *)calloc(m->mask + 1, sizeof(mux_entry_t));
+    if (!tr->ring)
+        return -1;
+    tr->mux = mux;
+    tr->track_id = track_id;
+    tr->writer = writer;
+    return m->track_count++;
+}
+
+int mp4mux_add_track(mp4mux_t *m, MP4E_mux_t *mux, int track_id)
+{
+    return mux ? mux_add(m, mux, track_id, NULL) : -1;
+}
+
+int mp4mux_add_h26x_track(mp4mux_t *m, mp4_h26x_writer_t *writer)
+{
+    return writer ? mux_add(m, writer->mux, 0, writer) : -1;
+}
+
+int mp4mux_start(mp4mux_t *m)
+{
+    if (!m || m->running)
+        return -1;
+    if (pthread_create(&m->thread, NULL, mux_worker, m))
+    {
+        log_error("can't create mux worker");
+        return -1;
+    }
+    m->running = 1;
+    return 0;
+}
+
+void mp4mux_set_space_cb(mp4mux_t *m, mp4mux_space_cb cb, void *user)
+{
+    if (!m || m->running)
+        return;
+    m->space_cb = cb;
+    m->space_user = user;
+}
+
+int mp4mux_push(mp4mux_t *m, int track, const void *data, int size, int64_t timestamp, int duration, int kind,
+                mp4mux_release_cb release_cb, void *user)
+{
+    mux_track_t *tr;
+    mux_entry_t *e;
+    unsigned tail;
+    if (!m || track < 0 || track >= m->track_count || !data)
+        return -1;
+    tr = m->track + track;
+    tail = tr->tail;
+    if (tail - __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE) > m->mask)
+    {
+        int full = 1;
+        if (m->space_cb)
+        {
+            // the worker may have freed a slot before seeing the flag: check again
+            __atomic_store_n(&tr->full, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            full = tail - __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE) > m->mask;
+        }
+        if (full)
+        {
+            __atomic_fetch_add(&tr->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    e = tr->ring + (tail & m->mask);
+    e->data = data;
+    e->size = size;
+    e->timestamp = timestamp;
+    e->duration = duration;
+    e->kind = kind;
+    e->release_cb = release_cb;
+    e->user = user;
+    __atomic_store_n(&tr->tail, tail + 1, __ATOMIC_RELEASE);
+    sem_post(&m->wake);
+    return 0;
+}
+
+int mp4mux_push_copy(mp4mux_t *m, int track, const void *data, int size, int64_t timestamp, int duration, int kind)
+{
+    void *copy;
+    if (!data || size <= 0 || !(copy = malloc(size)))
+        return -1;
+    memcpy(copy, data, size);
+    if (mp4mux_push(m, track, copy, size, timestamp, duration, kind, mux_free_copy, NULL))
+    {
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+unsigned mp4mux_dropped(const mp4mux_t *m, int track)
+{
+    if (!m || track < 0 || track >= m->track_count)
+        return 0;
+    return __atomic_load_n(&m->track[track].dropped, __ATOMIC_RELAXED);
+}
+
+unsigned mp4mux_queued(const mp4mux_t *m, int track)
+{
+    if (!m || track < 0 || track >= m->track_count)
+        return 0;
+    return __atomic_load_n(&m->track[track].tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&m->track[track].head, __ATOMIC_ACQUIRE);
+}
+
+int mp4mux_close(mp4mux_t *m)
+{
+    int i, err;
+    if (!m)
+        return MP4E_STATUS_BAD_ARGUMENTS;
+    __atomic_store_n(&m->stop, 1, __ATOMIC_RELEASE);
+    if (m->running)
+    {
+        sem_post(&m->wake);
+        pthread_join(m->thread, NULL);
+    }
+    else
+    {
+        mux_worker(m); // never started: mux queued samples here
+    }
+    err = m->error;
+    for (i = 0; i < m->track_count; i++)
+        free(m->track[i].ring);
+    sem_destroy(&m->wake);
+    free(m);
+    return err;
+}
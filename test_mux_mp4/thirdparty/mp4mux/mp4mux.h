@@ -0,0 +1,103 @@
+#ifndef MP4MUX_H
+#define MP4MUX_H
+
+#include <stdint.h>
+#include "minimp4.h"
+
+/**
+ *   Thread-safe front-end of MP4E_mux_t: every track has a lock-free
+ *   single-producer ring, and one worker thread takes samples from the rings
+ *   in timestamp order and does all muxing and file I/O.
+ *   Each track must be fed by one thread only; tracks are added before
+ *   mp4mux_start()
+ */
+
+// Maximum number of tracks
+#define MP4MUX_MAX_TRACKS 4
+
+// Default ring size per track, in samples
+#define MP4MUX_RING_SIZE 256
+
+/**
+ *   Called by the worker when the sample is written (or dropped after mux
+ *   failure): ownership of data returns to the producer
+ */
+typedef void (*mp4mux_release_cb)(const void *data, void *user);
+
+/**
+ *   Called by the worker when a track ring that was full has room again
+ */
+typedef void (*mp4mux_space_cb)(int track, void *user);
+
+typedef struct mp4mux mp4mux_t;
+
+/**
+ *   Create front-end. ring_size is rounded up to power of 2 (0 - default).
+ *   Worker waits for samples of all tracks to interleave them, but not for
+ *   longer than max_delay in timestamp units: a stalled track does not block
+ *   the others
+ *
+ *   return front-end, or NULL on failure
+ */
+extern mp4mux_t *mp4mux_create(unsigned ring_size, int64_t max_delay);
+
+/**
+ *   Add track written with MP4E_put_sample()
+ *
+ *   return track number for mp4mux_push(), or -1 on failure
+ */
+extern int mp4mux_add_track(mp4mux_t *m, MP4E_mux_t *mux, int track_id);
+
+/**
+ *   Add H.264/H.265 track written with mp4_h26x_write_nal(); samples are
+ *   Annex-B NAL units, duration is in 90 kHz units
+ *
+ *   return track number for mp4mux_push(), or -1 on failure
+ */
+extern int mp4mux_add_h26x_track(mp4mux_t *m, mp4_h26x_writer_t *writer);
+
+/**
+ *   Start the worker
+ *
+ *   return 0 on success, -1 on failure
+ */
+extern int mp4mux_start(mp4mux_t *m);
+
+/**
+ *   Set callback for producers that wait instead of dropping: after
+ *   mp4mux_push() fails on a full ring, cb is called once the ring has room.
+ *   Set before mp4mux_start()
+ */
+extern void mp4mux_set_space_cb(mp4mux_t *m, mp4mux_space_cb cb, void *user);
+
+/**
+ *   Queue sample by reference, O(1) and without locks. Timestamps of all
+ *   tracks must use the same clock. kind is MP4E_SAMPLE_* (ignored for H.26x).
+ *   release_cb (may be NULL) is called from the worker when data is not needed
+ *
+ *   return 0, or -1 if the ring is full: sample is dropped, data stays owned
+ *   by the caller and release_cb is not called
+ */
+extern int mp4mux_push(mp4mux_t *m, int track, const void *data, int size, int64_t timestamp, int duration, int kind,
+                       mp4mux_release_cb release_cb, void *user);
+
+/**
+ *   Same as mp4mux_push() for buffers reused by the producer: data is copied
+ */
+extern int mp4mux_push_copy(mp4mux_t *m, int track, const void *data, int size, int64_t timestamp, int duration, int kind);
+
+/**
+ *   Number of samples dropped by mp4mux_push() on full ring, and queued now
+ */
+extern unsigned mp4mux_dropped(const mp4mux_t *m, int track);
+extern unsigned mp4mux_queued(const mp4mux_t *m, int track);
+
+/**
+ *   Mux all queued samples, stop the worker and free the front-end.
+ *   Producers must be stopped before. MP4E_close() is left to the caller
+ *
+ *   return MP4E_STATUS_OK, or the first error of muxing
+ */
+extern int mp4mux_close(mp4mux_t *m);
+
+#endif /*MP4MUX_H*/
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../log/log.h"
+#include "mp4sink.h"
+
+struct mp4direct
+{
+    int fd;
+    int error;                 // first failed write, sticky
+    size_t block;              // buffer size, multiple of MP4DIRECT_ALIGN
+    unsigned char *buf[2];     // one is filled while the other is written
+    unsigned char *scratch;    // MP4DIRECT_ALIGN bytes for read-modify-write
+    int cur;
+    int64_t pos;               // file offset of buf[cur], aligned
+    size_t fill;               // bytes in buf[cur]
+    int64_t size;              // end of written data
+    unsigned patches;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const unsigned char *job;  // buffer being written by the thread
+    int64_t job_offset;
+    int busy, stop, job_error;
+};
+
+static int direct_io(int fd, int write, unsigned char *data, size_t size, int64_t offset)
+{
+    while (size)
+    {
+        ssize_t n = write ? pwrite(fd, data, size, offset) : pread(fd, data, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? -errno : -EIO;
+        data += n;
+        offset += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+static void *direct_worker(void *arg)
+{
+    mp4direct_t *d = (mp4direct_t *)arg;
+    pthread_mutex_lock(&d->lock);
+    for (;;)
+    {
+        int err;
+        while (!d->busy && !d->stop)
+            pthread_cond_wait(&d->cond, &d->lock);
+        if (!d->busy)
+            break;
+        pthread_mutex_unlock(&d->lock);
+        err = direct_io(d->fd, 1, (unsigned char *)d->job, d->block, d->job_offset);
+        pthread_mutex_lock(&d->lock);
+        if (err && !d->job_error)
+            d->job_error = err;
+        d->busy = 0;
+        pthread_cond_broadcast(&d->cond);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+/**
+ *   Wait until the thread has written the other buffer
+ */
+static int direct_wait(mp4direct_t *d)
+{
+    pthread_mutex_lock(&d->lock);
+    while (d->busy)
+        pthread_cond_wait(&d->cond, &d->lock);
+    if (d->job_error && !d->error)
+        d->error = d->job_error;
+    pthread_mutex_unlock(&d->lock);
+    return d->error;
+}
+
+/**
+ *   Hand full buffer to the thread and continue in the other one
+ */
+static int direct_flush_block(mp4direct_t *d)
+{
+    if (direct_wait(d))
+        return d->error;
+    pthread_mutex_lock(&d->lock);
+    d->job = d->buf[d->cur];
+    d->job_offset = d->pos;
+    d->busy = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    d->cur ^= 1;
+    d->pos += (int64_t)d->block;
+    d->fill = 0;
+    return 0;
+}
+
+/**
+ *   Patch data already on the disk, e.g. 'mdat' size after 'ftyp': read the
+ *   aligned block, modify and write it back
+ */
+static int direct_patch(mp4direct_t *d, int64_t offset, const unsigned char *data, size_t size)
+{
+    if (direct_wait(d))
+        return d->error;
+    while (size)
+    {
+        int64_t start = offset & ~(int64_t)(MP4DIRECT_ALIGN - 1);
+        size_t n = (size_t)(start + MP4DIRECT_ALIGN - offset);
+        int err;
+        if (n > size)
+            n = size;
+        if ((err = direct_io(d->fd, 0, d->scratch, MP4DIRECT_ALIGN, start)))
+            return err;
+        memcpy(d->scratch + (offset - start), data, n);
+        if ((err = direct_io(d->fd, 1, d->scratch, MP4DIRECT_ALIGN, start)))
+            return err;
+        d->patches++;
+        offset += (int64_t)n;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+mp4direct_t *mp4direct_open(const char *path, size_t block)
+{
+    mp4direct_t *d = (mp4direct_t *)calloc(1, sizeof(mp4direct_t));
+    if (!d)
+        return NULL;
+    if (!block)
+        block = MP4DIRECT_BLOCK;
+    d->block = (block + MP4DIRECT_ALIGN - 1) & ~(size_t)(MP4DIRECT_ALIGN - 1);
+    if (posix_memalign((void **)&d->buf[0], MP4DIRECT_ALIGN, d->block) ||
+        posix_memalign((void **)&d->buf[1], MP4DIRECT_ALIGN, d->block) ||
+        posix_memalign((void **)&d->scratch, MP4DIRECT_ALIGN, MP4DIRECT_ALIGN))
+        goto fail;
+
+    d->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (d->fd < 0 && errno == EINVAL)
+    {
+        // e.g. tmpfs: same block writes, through the page cache
+        log_warn("%s: O_DIRECT not supported", path);
+        d->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    if (d->fd < 0)
+    {
+        log_error("can't open %s", path);
+        goto fail;
+    }
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    if (pthread_create(&d->thread, NULL, direct_worker, d))
+    {
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->cond);
+        close(d->fd);
+        goto fail;
+    }
+    return d;
+fail:
+    free(d->buf[0]);
+    free(d->buf[1]);
+    free(d->scratch);
+    free(d);
+    return NULL;
+}
+
+int mp4direct_write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    mp4direct_t *d = (mp4direct_t *)token;
+    const unsigned char *data = (const unsigned char *)buffer;
+    int64_t end = offset + (int64_t)size;
+
+    if (!d || d->error || offset < 0)
+        return 1;
+    if (offset < d->pos)
+    {
+        size_t n = (size_t)(d->pos - offset);
+        if (n > size)
+            n = size;
+        if ((d->error = direct_patch(d, offset, data, n)))
+            return 1;
+        offset += (int64_t)n;
+        data += n;
+        size -= n;
+    }
+    while (size)
+    {
+        // offset is inside or past the current buffer: copy, zero any gap
+        size_t at = (size_t)(offset - d->pos), n;
+        if (at >= d->block)
+        {
+            memset(d->buf[d->cur] + d->fill, 0, d->block - d->fill);
+            d->fill = d->block;
+        }
+        else
+        {
+            if (at > d->fill)
+                memset(d->buf[d->cur] + d->fill, 0, at - d->fill);
+            n = d->block - at;
+            if (n > size)
+                n = size;
+            memcpy(d->buf[d->cur] + at, data, n);
+            if (at + n > d->fill)
+                d->fill = at + n;
+            offset += (int64_t)n;
+            data += n;
+            size -= n;
+        }
+        if (d->fill == d->block && direct_flush_block(d))
+            return 1;
+    }
+    if (end > d->size)
+        d->size = end;
+    return 0;
+}
+
+int64_t mp4direct_size(const mp4direct_t *d)
+{
+    return d ? d->size : 0;
+}
+
+unsigned mp4direct_patches(const mp4direct_t *d)
+{
+    return d ? d->patches : 0;
+}
+
+int mp4direct_close(mp4direct_t *d)
+{
+    int err;
+    if (!d)
+        return -EINVAL;
+    err = direct_wait(d);
+    if (!err && d->fill)
+    {
+        // last block is padded to alignment, the file is truncated below
+        size_t tail = (d->fill + MP4DIRECT_ALIGN - 1) & ~(size_t)(MP4DIRECT_ALIGN - 1);
+        memset(d->buf[d->cur] + d->fill, 0, tail - d->fill);
+        err = direct_io(d->fd, 1, d->buf[d->cur], tail, d->pos);
+    }
+    if (ftruncate(d->fd, d->size) && !err)
+        err = -errno;
+
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+
+    if (close(d->fd) && !err)
+        err = -errno;
+    free(d->buf[0]);
+    free(d->buf[1]);
+    free(d->scratch);
+    free(d);
+    return err;
+}
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../log/log.h"
+#include "mp4sink.h"
+
+struct mp4mmap
+{
+    int fd;
+    int error;          // first failed write, sticky
+    int64_t size;       // end of written data, file is truncated to it at close
+    int64_t allocated;  // file length reserved so far
+    int64_t extent;     // allocation step after the initial estimate
+    int fallocate_ok;   // 0 if filesystem can't fallocate(), file is extended sparse
+
+    unsigned char *map; // write window
+    int64_t map_offset; // page aligned file offset of the window
+    size_t map_size;
+    unsigned remaps;
+};
+
+static int64_t mmap_round_up(int64_t value, int64_t step)
+{
+    return (value + step - 1) / step * step;
+}
+
+/**
+ *   Make sure file is at least end bytes long, so the window never maps past EOF
+ */
+static int mmap_reserve(mp4mmap_t *m, int64_t end)
+{
+    int64_t want;
+    if (end <= m->allocated)
+        return 0;
+    want = m->allocated ? mmap_round_up(end, m->extent) : end;
+    if (m->fallocate_ok && fallocate(m->fd, 0, m->allocated, want - m->allocated))
+    {
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            return -errno; // e.g. ENOSPC: better to fail here than SIGBUS in memcpy
+        log_warn("fallocate not supported, file is extended without preallocation");
+        m->fallocate_ok = 0;
+    }
+    if (!m->fallocate_ok && ftruncate(m->fd, want))
+        return -errno;
+    m->allocated = want;
+    return 0;
+}
+
+static void mmap_unmap(mp4mmap_t *m)
+{
+    if (!m->map)
+        return;
+    // start writeback of the finished window, so dirty pages don't pile up
+    sync_file_range(m->fd, m->map_offset, m->map_size, SYNC_FILE_RANGE_WRITE);
+    munmap(m->map, m->map_size);
+    m->map = NULL;
+}
+
+/**
+ *   Move window to the page containing offset
+ */
+static int mmap_slide(mp4mmap_t *m, int64_t offset)
+{
+    int64_t start = offset & ~(int64_t)(sysconf(_SC_PAGESIZE) - 1);
+    int err;
+
+    mmap_unmap(m);
+    if ((err = mmap_reserve(m, start + MP4MMAP_WINDOW)))
+        return err;
+    m->map = (unsigned char *)mmap(NULL, MP4MMAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, start);
+    if (m->map == MAP_FAILED)
+    {
+        m->map = NULL;
+        return -errno;
+    }
+    madvise(m->map, MP4MMAP_WINDOW, MADV_SEQUENTIAL);
+    m->map_offset = start;
+    m->map_size = MP4MMAP_WINDOW;
+    m->remaps++;
+    return 0;
+}
+
+static int mmap_pwrite(mp4mmap_t *m, int64_t offset, const unsigned char *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t n = pwrite(m->fd, data, size, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        offset += n;
+        data += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+mp4mmap_t *mp4mmap_open(const char *path, int64_t expected_size)
+{
+    mp4mmap_t *m = (mp4mmap_t *)calloc(1, sizeof(mp4mmap_t));
+    if (!m)
+        return NULL;
+    m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m->fd < 0)
+    {
+        log_error("can't open %s", path);
+        free(m);
+        return NULL;
+    }
+    m->extent = MP4MMAP_EXTENT;
+    m->fallocate_ok = 1;
+    if (expected_size > 0 && mmap_reserve(m, mmap_round_up(expected_size, MP4MMAP_WINDOW)))
+        log_warn("%s: can't preallocate %lld bytes", path, (long long)expected_size);
+    return m;
+}
+
+int mp4mmap_write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    mp4mmap_t *m = (mp4mmap_t *)token;
+    const unsigned char *data = (const unsigned char *)buffer;
+    int64_t end = offset + (int64_t)size;
+
+    if (!m || m->error || offset < 0)
+        return 1;
+    while (size)
+    {
+        size_t n;
+        if (m->map && offset >= m->map_offset && offset < m->map_offset + (int64_t)m->map_size)
+        {
+            n = (size_t)(m->map_offset + (int64_t)m->map_size - offset);
+            if (n > size)
+                n = size;
+            memcpy(m->map + (offset - m->map_offset), data, n);
+        }
+        else if (m->map && offset < m->map_offset)
+        {
+            // back-patch behind the window, e.g. 'mdat' size after 'ftyp':
+            // pwrite() goes through the same page cache as the mapping
+            n = (size_t)(m->map_offset - offset);
+            if (n > size)
+                n = size;
+            if ((m->error = mmap_pwrite(m, offset, data, n)))
+                return 1;
+        }
+        else
+        {
+            if ((m->error = mmap_slide(m, offset)))
+            {
+                log_error("can't map output at %lld: %s", (long long)offset, strerror(-m->error));
+                return 1;
+            }
+            continue;
+        }
+        offset += (int64_t)n;
+        data += n;
+        size -= n;
+    }
+    if (end > m->size)
+        m->size = end;
+    return 0;
+}
+
+int64_t mp4mmap_size(const mp4mmap_t *m)
+{
+    return m ? m->size : 0;
+}
+
+unsigned mp4mmap_remaps(const mp4mmap_t *m)
+{
+    return m ? m->remaps : 0;
+}
+
+int mp4mmap_close(mp4mmap_t *m)
+{
+    int err;
+    if (!m)
+        return -EINVAL;
+    err = m->error;
+    mmap_unmap(m);
+    // drop preallocated tail
+    if (ftruncate(m->fd, m->size) && !err)
+        err = -errno;
+    if (close(m->fd) && !err)
+        err = -errno;
+    free(m);
+    return err;
+}
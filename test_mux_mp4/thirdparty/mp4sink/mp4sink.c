@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../log/log.h"
+#include "mp4sink.h"
+
+// Longest backend request: result of partial write must fit int
+#define SINK_MAX_REQUEST (1u << 30)
+
+typedef struct
+{
+    int busy;
+    int64_t offset;
+    const unsigned char *data; // data to write
+    size_t size;
+    size_t done;               // bytes written, writes may be partial
+
+    void *buffer;              // caller buffer, returned by complete_cb
+    mp4sink_complete_cb complete_cb;
+    void *user;
+
+    unsigned char *copy;       // own buffer for mp4sink_write_callback()
+    size_t copy_capacity;
+} sink_slot_t;
+
+struct mp4sink
+{
+    mp4sink_dev_t dev; // backend instance
+    int fd;
+    int queue_depth;
+    int in_flight;
+    int error;         // first failed write, sticky
+    unsigned stalls;
+    sink_slot_t *slots;
+};
+
+/**
+ *   Backend completion of the slot: continue partial write, or release slot
+ */
+static void sink_done(void *ctx, int slot, int result)
+{
+    mp4sink_t *sink = (mp4sink_t *)ctx;
+    sink_slot_t *s = sink->slots + slot;
+
+    if (result > 0)
+    {
+        s->done += (size_t)result;
+        if (s->done < s->size)
+        {
+            size_t left = s->size - s->done;
+            result = sink->dev.submit(&sink->dev, slot, s->offset + s->done, s->data + s->done,
+                                      left < SINK_MAX_REQUEST ? left : SINK_MAX_REQUEST);
+            if (!result)
+                return;
+        }
+        else
+            result = 0;
+    }
+    else if (!result)
+        result = -EIO; // no progress
+
+    if (result && !sink->error)
+    {
+        sink->error = result;
+        log_error("write of %zu bytes at %lld failed: %s", s->size, (long long)s->offset, strerror(-result));
+    }
+    s->busy = 0;
+    sink->in_flight--;
+    if (s->complete_cb)
+        s->complete_cb(s->buffer, s->size, result, s->user);
+}
+
+static int sink_reap(mp4sink_t *sink, int wait)
+{
+    int n = sink->dev.reap(&sink->dev, wait, sink_done, sink);
+    if (n < 0 && !sink->error)
+        sink->error = n;
+    return n;
+}
+
+/**
+ *   Find free slot, waiting for completions if the queue is full
+ */
+static int sink_get_slot(mp4sink_t *sink)
+{
+    int i;
+    if (sink->in_flight == sink->queue_depth)
+    {
+        sink_reap(sink, 0);
+        if (sink->in_flight == sink->queue_depth)
+            sink->stalls++;
+        while (sink->in_flight == sink->queue_depth)
+        {
+            if (sink_reap(sink, 1) < 0)
+                return -1;
+        }
+    }
+    for (i = 0; i < sink->queue_depth; i++)
+    {
+        if (!sink->slots[i].busy)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ *   Wait for writes in flight, which overlap given range (e.g. header back-patch)
+ */
+static void sink_order_after_overlapping(mp4sink_t *sink, int64_t offset, size_t size)
+{
+    int i;
+    for (i = 0; i < sink->queue_depth; i++)
+    {
+        sink_slot_t *s = sink->slots + i;
+        while (s->busy && s->offset < offset + (int64_t)size && offset < s->offset + (int64_t)s->size)
+        {
+            if (sink_reap(sink, 1) < 0)
+                return;
+        }
+    }
+}
+
+static int sink_start(mp4sink_t *sink, int slot, int64_t offset, const void *data, size_t size)
+{
+    sink_slot_t *s = sink->slots + slot;
+    int err;
+    s->busy = 1;
+    s->offset = offset;
+    s->data = (const unsigned char *)data;
+    s->size = size;
+    s->done = 0;
+    sink->in_flight++;
+    err = sink->dev.submit(&sink->dev, slot, offset, data, size < SINK_MAX_REQUEST ? size : SINK_MAX_REQUEST);
+    if (err)
+    {
+        s->busy = 0;
+        sink->in_flight--;
+        if (!sink->error)
+            sink->error = err;
+    }
+    return err;
+}
+
+mp4sink_t *mp4sink_open(const char *path, int queue_depth)
+{
+    return mp4sink_open_dev(path, queue_depth, NULL);
+}
+
+mp4sink_t *mp4sink_open_dev(const char *path, int queue_depth, const mp4sink_dev_t *dev)
+{
+    mp4sink_t *sink = (mp4sink_t *)calloc(1, sizeof(mp4sink_t));
+    if (!sink)
+        return NULL;
+    if (queue_depth <= 0)
+        queue_depth = MP4SINK_QUEUE_DEPTH;
+    sink->queue_depth = queue_depth;
+    sink->slots = (sink_slot_t *)calloc(queue_depth, sizeof(sink_slot_t));
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!sink->slots || sink->fd < 0)
+    {
+        log_error("can't open %s", path);
+        if (sink->fd >= 0)
+            close(sink->fd);
+        free(sink->slots);
+        free(sink);
+        return NULL;
+    }
+
+    sink->dev = dev ? *dev : uring_sink;
+    if (sink->dev.open(&sink->dev, sink->fd, queue_depth))
+    {
+        sink->dev = thread_sink; // e.g. old kernel, or io_uring disabled by seccomp
+        if ((dev && dev->open == thread_sink.open) || sink->dev.open(&sink->dev, sink->fd, queue_depth))
+        {
+            close(sink->fd);
+            free(sink->slots);
+            free(sink);
+            return NULL;
+        }
+    }
+    log_debug("%s: %s sink, queue depth %d", path, sink->dev.name, queue_depth);
+    return sink;
+}
+
+int mp4sink_submit(mp4sink_t *sink, int64_t offset, void *buffer, size_t size,
+                   mp4sink_complete_cb complete_cb, void *user)
+{
+    int slot;
+    if (!sink || !buffer)
+        return -EINVAL;
+    if (sink->error)
+        return sink->error;
+    sink_order_after_overlapping(sink, offset, size);
+    slot = sink_get_slot(sink);
+    if (slot < 0)
+        return sink->error ? sink->error : -EIO;
+    sink->slots[slot].buffer = buffer;
+    sink->slots[slot].complete_cb = complete_cb;
+    sink->slots[slot].user = user;
+    return sink_start(sink, slot, offset, buffer, size);
+}
+
+int mp4sink_poll(mp4sink_t *sink)
+{
+    int n;
+    if (!sink)
+        return -EINVAL;
+    n = sink_reap(sink, 0);
+    return sink->error ? sink->error : n;
+}
+
+int mp4sink_flush(mp4sink_t *sink)
+{
+    if (!sink)
+        return -EINVAL;
+    while (sink->in_flight)
+    {
+        if (sink_reap(sink, 1) < 0)
+            break;
+    }
+    return sink->error;
+}
+
+int mp4sink_sync(mp4sink_t *sink)
+{
+    int err = mp4sink_flush(sink);
+    if (!err && fdatasync(sink->fd))
+        err = -errno;
+    return err;
+}
+
+int mp4sink_queue_depth(mp4sink_t *sink)
+{
+    if (!sink)
+        return 0;
+    if (sink->in_flight)
+        sink_reap(sink, 0);
+    return sink->in_flight;
+}
+
+int mp4sink_queue_capacity(const mp4sink_t *sink)
+{
+    return sink ? sink->queue_depth : 0;
+}
+
+unsigned mp4sink_stalls(const mp4sink_t *sink)
+{
+    return sink ? sink->stalls : 0;
+}
+
+const char *mp4sink_backend(const mp4sink_t *sink)
+{
+    return sink ? sink->dev.name : NULL;
+}
+
+int mp4sink_close(mp4sink_t *sink)
+{
+    int i, err;
+    if (!sink)
+        return -EINVAL;
+    err = mp4sink_flush(sink);
+    sink->dev.close(&sink->dev);
+    if (close(sink->fd) && !err)
+        err = -errno;
+    for (i = 0; i < sink->queue_depth; i++)
+        free(sink->slots[i].copy);
+    free(sink->slots);
+    free(sink);
+    return err;
+}
+
+int mp4sink_write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    mp4sink_t *sink = (mp4sink_t *)token;
+    sink_slot_t *s;
+    int slot;
+    if (!sink || sink->error)
+        return 1;
+    sink_order_after_overlapping(sink, offset, size);
+    slot = sink_get_slot(sink);
+    if (slot < 0)
+        return 1;
+    s = sink->slots + slot;
+    if (s->copy_capacity < size)
+    {
+        // slot buffers grow to the biggest write, e.g. key frame or 'moov'
+        unsigned char *p = (unsigned char *)realloc(s->copy, size);
+        if (!p)
+            return 1;
+        s->copy = p;
+        s->copy_capacity = size;
+    }
+    memcpy(s->copy, buffer, size);
+    s->buffer = s->copy;
+    s->complete_cb = NULL;
+    s->user = NULL;
+    return sink_start(sink, slot, offset, s->copy, size) != 0;
+}
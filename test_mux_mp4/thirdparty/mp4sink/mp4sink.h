@@ -0,0 +1,189 @@
+#ifndef MP4SINK_H
+#define MP4SINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *   Asynchronous file sink for the muxer: writes are queued to a backend and
+ *   complete later, so the capture thread does not wait for storage.
+ *   All functions must be called from one thread.
+ */
+
+// Default number of writes in flight
+#define MP4SINK_QUEUE_DEPTH 32
+
+/**
+ *   Called when write of submitted buffer is complete; ownership of the buffer
+ *   returns to the caller. result is 0 or negative errno
+ */
+typedef void (*mp4sink_complete_cb)(void *buffer, size_t size, int result, void *user);
+
+/**
+ *   Write backend. Each request has slot number in [0, queue_depth); backend
+ *   reports completion of the slot with number of bytes written or negative errno
+ */
+typedef struct mp4sink_dev_t
+{
+    const char *name;
+    int (*open)(struct mp4sink_dev_t *dev, int fd, int queue_depth);
+    int (*submit)(struct mp4sink_dev_t *dev, int slot, int64_t offset, const void *buffer, size_t size);
+    // reap completions, if wait is set block until at least one is available
+    int (*reap)(struct mp4sink_dev_t *dev, int wait, void (*done)(void *sink, int slot, int result), void *sink);
+    void (*close)(struct mp4sink_dev_t *dev);
+    void *priv;
+} mp4sink_dev_t;
+
+extern mp4sink_dev_t uring_sink;  // Linux io_uring, without liburing
+extern mp4sink_dev_t thread_sink; // worker thread with pwrite()
+
+typedef struct mp4sink mp4sink_t;
+
+/**
+ *   Create file and sink with up to queue_depth writes in flight (0 - default).
+ *   io_uring backend is used where the kernel allows it, worker thread otherwise
+ *
+ *   return sink, or NULL on failure
+ */
+extern mp4sink_t *mp4sink_open(const char *path, int queue_depth);
+
+/**
+ *   Same as mp4sink_open(), with given backend, e.g. &thread_sink
+ */
+extern mp4sink_t *mp4sink_open_dev(const char *path, int queue_depth, const mp4sink_dev_t *dev);
+
+/**
+ *   Queue write of the buffer, which is owned by the sink until complete_cb is
+ *   called from mp4sink_poll(), mp4sink_flush() or mp4sink_close().
+ *   Writes overlapping ones in flight are ordered after them.
+ *   Blocks only if the queue is full, see mp4sink_queue_depth()
+ *
+ *   return 0, or negative errno of failed earlier write
+ */
+extern int mp4sink_submit(mp4sink_t *sink, int64_t offset, void *buffer, size_t size,
+                          mp4sink_complete_cb complete_cb, void *user);
+
+/**
+ *   Process completed writes without blocking
+ *
+ *   return number of completed writes, or negative errno of failed write
+ */
+extern int mp4sink_poll(mp4sink_t *sink);
+
+/**
+ *   Wait for all writes in flight
+ *
+ *   return 0, or negative errno of failed write
+ */
+extern int mp4sink_flush(mp4sink_t *sink);
+
+/**
+ *   Wait for all writes in flight and make them durable with fdatasync()
+ *
+ *   return 0, or negative errno of failed write or sync
+ */
+extern int mp4sink_sync(mp4sink_t *sink);
+
+/**
+ *   Number of writes in flight and queue capacity. Capture code can drop frames
+ *   when the queue is (nearly) full, rather than block in the muxer
+ */
+extern int mp4sink_queue_depth(mp4sink_t *sink);
+extern int mp4sink_queue_capacity(const mp4sink_t *sink);
+
+/**
+ *   Number of times submit has waited for the queue to drain
+ */
+extern unsigned mp4sink_stalls(const mp4sink_t *sink);
+
+extern const char *mp4sink_backend(const mp4sink_t *sink);
+
+/**
+ *   Wait for all writes, close backend and file, free the sink
+ *
+ *   return 0, or negative errno of the first failed write
+ */
+extern int mp4sink_close(mp4sink_t *sink);
+
+/**
+ *   MP4E_open() write_callback, token is mp4sink_t. Data is copied to a buffer
+ *   owned by the sink and queued; returns non-zero after failed write
+ */
+extern int mp4sink_write_callback(int64_t offset, const void *buffer, size_t size, void *token);
+
+/**
+ *   Preallocating file sink: the file is reserved with fallocate() in large
+ *   extents and written through a sliding mmap() window, so block allocation
+ *   is out of the write path. Writes behind the window (the 'mdat' size patch
+ *   in non-sequential mode) go to the file directly. Synchronous, like fwrite
+ */
+typedef struct mp4mmap mp4mmap_t;
+
+// Write window, and file growth step once the estimate is exceeded
+#define MP4MMAP_WINDOW (4 << 20)
+#define MP4MMAP_EXTENT (64 << 20)
+
+/**
+ *   Create file, reserving expected_size bytes up front (0 - grow by extents)
+ *
+ *   return sink, or NULL on failure
+ */
+extern mp4mmap_t *mp4mmap_open(const char *path, int64_t expected_size);
+
+/**
+ *   MP4E_open() write_callback, token is mp4mmap_t
+ */
+extern int mp4mmap_write_callback(int64_t offset, const void *buffer, size_t size, void *token);
+
+/**
+ *   Bytes written so far (end of data), and number of window moves
+ */
+extern int64_t mp4mmap_size(const mp4mmap_t *m);
+extern unsigned mp4mmap_remaps(const mp4mmap_t *m);
+
+/**
+ *   Unmap, truncate file to the written size and close, free the sink
+ *
+ *   return 0, or negative errno of the first failed write
+ */
+extern int mp4mmap_close(mp4mmap_t *m);
+
+/**
+ *   O_DIRECT file sink: writes are gathered into aligned blocks, and a worker
+ *   thread writes one block while the next is being filled, so the page cache
+ *   is bypassed. Writes behind the current block (the 'mdat' size patch) do
+ *   read-modify-write of the aligned blocks on the disk. Falls back to
+ *   buffered I/O where the filesystem rejects O_DIRECT
+ */
+typedef struct mp4direct mp4direct_t;
+
+// Offset, size and memory alignment of direct I/O; default block size
+#define MP4DIRECT_ALIGN 4096
+#define MP4DIRECT_BLOCK (1 << 20)
+
+/**
+ *   Create file with two buffers of block bytes (0 - default)
+ *
+ *   return sink, or NULL on failure
+ */
+extern mp4direct_t *mp4direct_open(const char *path, size_t block);
+
+/**
+ *   MP4E_open() write_callback, token is mp4direct_t
+ */
+extern int mp4direct_write_callback(int64_t offset, const void *buffer, size_t size, void *token);
+
+/**
+ *   Bytes written so far (end of data), and number of read-modify-write blocks
+ */
+extern int64_t mp4direct_size(const mp4direct_t *d);
+extern unsigned mp4direct_patches(const mp4direct_t *d);
+
+/**
+ *   Write the last block, truncate file to the written size and close, free the sink
+ *
+ *   return 0, or negative errno of the first failed write
+ */
+extern int mp4direct_close(mp4direct_t *d);
+
+#endif /*MP4SINK_H*/
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mp4sink.h"
+
+typedef struct
+{
+    int slot;
+    int64_t offset;
+    const void *data;
+    size_t size;
+    int result;
+} thread_req_t;
+
+typedef struct
+{
+    int fd;
+    int capacity;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_req;
+    pthread_cond_t cond_done;
+    int stop;
+
+    // requests: FIFO ring; completed requests are moved to done ring
+    thread_req_t *req;
+    int req_head, req_count;
+    thread_req_t *done;
+    int done_head, done_count;
+} thread_sink_t;
+
+static void *thread_sink_worker(void *arg)
+{
+    thread_sink_t *ts = (thread_sink_t *)arg;
+    pthread_mutex_lock(&ts->lock);
+    for (;;)
+    {
+        thread_req_t r;
+        const char *p;
+        size_t left;
+        while (!ts->req_count && !ts->stop)
+            pthread_cond_wait(&ts->cond_req, &ts->lock);
+        if (!ts->req_count)
+            break;
+        r = ts->req[ts->req_head];
+        pthread_mutex_unlock(&ts->lock);
+
+        p = (const char *)r.data;
+        left = r.size;
+        r.result = 0;
+        while (left)
+        {
+            ssize_t n = pwrite(ts->fd, p, left, r.offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                r.result = n < 0 ? -errno : -EIO;
+                break;
+            }
+            p += n;
+            r.offset += n;
+            left -= (size_t)n;
+        }
+        if (!r.result)
+            r.result = (int)r.size; // requests are below 2 GB
+
+        pthread_mutex_lock(&ts->lock);
+        ts->req_head = (ts->req_head + 1) % ts->capacity;
+        ts->req_count--;
+        ts->done[(ts->done_head + ts->done_count) % ts->capacity] = r;
+        ts->done_count++;
+        pthread_cond_signal(&ts->cond_done);
+    }
+    pthread_mutex_unlock(&ts->lock);
+    return NULL;
+}
+
+static int thread_sink_open(mp4sink_dev_t *dev, int fd, int queue_depth)
+{
+    thread_sink_t *ts = (thread_sink_t *)calloc(1, sizeof(thread_sink_t));
+    if (!ts)
+        return -ENOMEM;
+    ts->fd = fd;
+    ts->capacity = queue_depth;
+    ts->req = (thread_req_t *)calloc(queue_depth, sizeof(thread_req_t));
+    ts->done = (thread_req_t *)calloc(queue_depth, sizeof(thread_req_t));
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->cond_req, NULL);
+    pthread_cond_init(&ts->cond_done, NULL);
+    if (!ts->req || !ts->done || pthread_create(&ts->thread, NULL, thread_sink_worker, ts))
+    {
+        pthread_mutex_destroy(&ts->lock);
+        pthread_cond_destroy(&ts->cond_req);
+        pthread_cond_destroy(&ts->cond_done);
+        free(ts->req);
+        free(ts->done);
+        free(ts);
+        return -ENOMEM;
+    }
+    dev->priv = ts;
+    return 0;
+}
+
+static int thread_sink_submit(mp4sink_dev_t *dev, int slot, int64_t offset, const void *buffer, size_t size)
+{
+    thread_sink_t *ts = (thread_sink_t *)dev->priv;
+    thread_req_t *r;
+    pthread_mutex_lock(&ts->lock);
+    r = ts->req + (ts->req_head + ts->req_count) % ts->capacity;
+    r->slot = slot;
+    r->offset = offset;
+    r->data = buffer;
+    r->size = size;
+    ts->req_count++;
+    pthread_cond_signal(&ts->cond_req);
+    pthread_mutex_unlock(&ts->lock);
+    return 0;
+}
+
+static int thread_sink_reap(mp4sink_dev_t *dev, int wait, void (*done)(void *sink, int slot, int result), void *sink)
+{
+    thread_sink_t *ts = (thread_sink_t *)dev->priv;
+    int n = 0;
+    pthread_mutex_lock(&ts->lock);
+    while (wait && !ts->done_count && ts->req_count)
+        pthread_cond_wait(&ts->cond_done, &ts->lock);
+    while (ts->done_count)
+    {
+        thread_req_t r = ts->done[ts->done_head];
+        ts->done_head = (ts->done_head + 1) % ts->capacity;
+        ts->done_count--;
+        // callback may submit the rest of partial write
+        pthread_mutex_unlock(&ts->lock);
+        done(sink, r.slot, r.result);
+        n++;
+        pthread_mutex_lock(&ts->lock);
+    }
+    pthread_mutex_unlock(&ts->lock);
+    return n;
+}
+
+static void thread_sink_close(mp4sink_dev_t *dev)
+{
+    thread_sink_t *ts = (thread_sink_t *)dev->priv;
+    if (!ts)
+        return;
+    pthread_mutex_lock(&ts->lock);
+    ts->stop = 1;
+    pthread_cond_signal(&ts->cond_req);
+    pthread_mutex_unlock(&ts->lock);
+    pthread_join(ts->thread, NULL);
+    pthread_mutex_destroy(&ts->lock);
+    pthread_cond_destroy(&ts->cond_req);
+    pthread_cond_destroy(&ts->cond_done);
+    free(ts->req);
+    free(ts->done);
+    free(ts);
+    dev->priv = NULL;
+}
+
+mp4sink_dev_t thread_sink =
+    {
+        .name = "thread",
+        .open = thread_sink_open,
+        .submit = thread_sink_submit,
+        .reap = thread_sink_reap,
+        .close = thread_sink_close,
+};
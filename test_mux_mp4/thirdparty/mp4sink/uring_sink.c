@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "mp4sink.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MP4SINK_URING 1
+#endif
+#endif
+
+#if MP4SINK_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Rings are set up with raw syscalls, no liburing dependency.
+ * Head/tail indexes are shared with the kernel: loads of the kernel side use
+ * acquire, stores of our side use release ordering.
+ */
+typedef struct
+{
+    int ring_fd;
+    int fd;
+
+    void *sq_ptr;
+    size_t sq_map_bytes;
+    void *cq_ptr;
+    size_t cq_map_bytes;
+    struct io_uring_sqe *sqes;
+    size_t sqes_map_bytes;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct iovec *iov; // one per slot, must live until completion
+} uring_sink_t;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_sink_free(uring_sink_t *us)
+{
+    if (us->sqes)
+        munmap(us->sqes, us->sqes_map_bytes);
+    if (us->cq_ptr && us->cq_ptr != us->sq_ptr)
+        munmap(us->cq_ptr, us->cq_map_bytes);
+    if (us->sq_ptr)
+        munmap(us->sq_ptr, us->sq_map_bytes);
+    if (us->ring_fd >= 0)
+        close(us->ring_fd);
+    free(us->iov);
+    free(us);
+}
+
+static int uring_sink_open(mp4sink_dev_t *dev, int fd, int queue_depth)
+{
+    struct io_uring_params p;
+    uring_sink_t *us = (uring_sink_t *)calloc(1, sizeof(uring_sink_t));
+    unsigned char *sq, *cq;
+    if (!us)
+        return -ENOMEM;
+    us->fd = fd;
+    us->iov = (struct iovec *)calloc(queue_depth, sizeof(struct iovec));
+    memset(&p, 0, sizeof(p));
+    us->ring_fd = uring_setup((unsigned)queue_depth, &p);
+    if (!us->iov || us->ring_fd < 0)
+    {
+        int err = us->ring_fd < 0 ? -errno : -ENOMEM;
+        uring_sink_free(us);
+        return err;
+    }
+
+    us->sq_map_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    us->cq_map_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (us->cq_map_bytes > us->sq_map_bytes)
+            us->sq_map_bytes = us->cq_map_bytes;
+        us->cq_map_bytes = us->sq_map_bytes;
+    }
+    us->sq_ptr = mmap(NULL, us->sq_map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, us->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (us->sq_ptr == MAP_FAILED)
+    {
+        us->sq_ptr = NULL;
+        uring_sink_free(us);
+        return -ENOMEM;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        us->cq_ptr = us->sq_ptr;
+    else
+    {
+        us->cq_ptr = mmap(NULL, us->cq_map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, us->ring_fd,
+                          IORING_OFF_CQ_RING);
+        if (us->cq_ptr == MAP_FAILED)
+        {
+            us->cq_ptr = NULL;
+            uring_sink_free(us);
+            return -ENOMEM;
+        }
+    }
+    us->sqes_map_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+    us->sqes = (struct io_uring_sqe *)mmap(NULL, us->sqes_map_bytes, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, us->ring_fd, IORING_OFF_SQES);
+    if (us->sqes == MAP_FAILED)
+    {
+        us->sqes = NULL;
+        uring_sink_free(us);
+        return -ENOMEM;
+    }
+
+    sq = (unsigned char *)us->sq_ptr;
+    cq = (unsigned char *)us->cq_ptr;
+    us->sq_head = (unsigned *)(sq + p.sq_off.head);
+    us->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    us->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    us->sq_array = (unsigned *)(sq + p.sq_off.array);
+    us->cq_head = (unsigned *)(cq + p.cq_off.head);
+    us->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    us->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    us->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    dev->priv = us;
+    return 0;
+}
+
+static int uring_sink_submit(mp4sink_dev_t *dev, int slot, int64_t offset, const void *buffer, size_t size)
+{
+    uring_sink_t *us = (uring_sink_t *)dev->priv;
+    unsigned tail = *us->sq_tail;
+    unsigned index = tail & *us->sq_mask;
+    struct io_uring_sqe *sqe = us->sqes + index;
+    int ret;
+
+    // ring has entries for all slots, so it is never full here
+    us->iov[slot].iov_base = (void *)buffer;
+    us->iov[slot].iov_len = size;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = us->fd;
+    sqe->off = (uint64_t)offset;
+    sqe->addr = (uint64_t)(uintptr_t)(us->iov + slot);
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)slot;
+    us->sq_array[index] = index;
+    __atomic_store_n(us->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do
+        ret = uring_enter(us->ring_fd, 1, 0, 0);
+    while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -errno : 0;
+}
+
+static int uring_sink_reap(mp4sink_dev_t *dev, int wait, void (*done)(void *sink, int slot, int result), void *sink)
+{
+    uring_sink_t *us = (uring_sink_t *)dev->priv;
+    int n = 0;
+    for (;;)
+    {
+        unsigned head = *us->cq_head;
+        while (head != __atomic_load_n(us->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe cqe = us->cqes[head & *us->cq_mask];
+            head++;
+            // release the entry before callback, which may submit the rest of partial write
+            __atomic_store_n(us->cq_head, head, __ATOMIC_RELEASE);
+            done(sink, (int)cqe.user_data, cqe.res);
+            n++;
+        }
+        if (n || !wait)
+            return n;
+        if (uring_enter(us->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            return -errno;
+    }
+}
+
+static void uring_sink_close(mp4sink_dev_t *dev)
+{
+    if (dev->priv)
+        uring_sink_free((uring_sink_t *)dev->priv);
+    dev->priv = NULL;
+}
+
+#else
+
+static int uring_sink_open(mp4sink_dev_t *dev, int fd, int queue_depth)
+{
+    (void)dev;
+    (void)fd;
+    (void)queue_depth;
+    return -ENOSYS;
+}
+
+#define uring_sink_submit NULL
+#define uring_sink_reap NULL
+#define uring_sink_close NULL
+
+#endif // MP4SINK_URING
+
+mp4sink_dev_t uring_sink =
+    {
+        .name = "io_uring",
+        .open = uring_sink_open,
+        .submit = uring_sink_submit,
+        .reap = uring_sink_reap,
+        .close = uring_sink_close,
+};
@@ -0,0 +1,680 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include "../log/log.h"
+#include "minimp4.h"
+#include "mp4mux.h"
+#include "mp4sink.h"
+#include "framepool.h"
+#include "preroll.h"
+#include "pipeline.h"
+
+struct pipeline
+{
+    pipeline_param_t param;
+    ipc_dev_t *dev;          // capture, set while running, read by the mux worker
+
+    // current file, opened and closed by the thread of pipeline_create()/pipeline_wait();
+    // one of the sinks is set, by param.sink
+    mp4sink_t *sink;
+    mp4mmap_t *mmap;
+    mp4direct_t *direct;
+    MP4E_mux_t *mux;
+    mp4_h26x_writer_t writer;
+    int writer_ok;
+    int audio_track_id;      // of the muxer
+    mp4mux_t *queue;         // set while recording, under lock in event mode
+    int video_track;         // tracks of the queue
+    int audio_track;
+    int64_t file_size;
+    unsigned segments;       // one writer, read by pipeline_stats()
+    int journal_fd;          // index journal of the file, -1 - none
+    char journal_path[PATH_MAX];
+
+    framepool_t *pool;       // capture buffers, queued without copy
+    pthread_mutex_t lock;    // event mode: capture callbacks vs. segment open and close
+    preroll_t *preroll;      // event mode, capture while not recording
+
+    // pre-roll writes are coalesced into one mp4sink write
+    int staging;
+    unsigned char *stage;
+    size_t stage_size;
+    size_t stage_capacity;
+    int64_t stage_offset;
+
+    int event_fd;            // written once on stop
+    int motion_fd;           // written on each motion event, event mode
+    int motion;              // last motion event: detected or disappeared
+    int64_t postroll_end;    // ms, 0 if the segment is not closing
+    int stopping;            // frames are not recorded after it is set
+    int64_t start_ms;
+    unsigned video_frames;   // recorded, atomic
+    unsigned audio_frames;
+    int64_t bytes;           // written by mux worker, all files
+};
+
+/**
+ *   A file is open: recording, or closing after the post-roll
+ */
+static int pipeline_has_file(const pipeline_t *p)
+{
+    return p->sink || p->mmap || p->direct;
+}
+
+static int64_t pipeline_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void pipeline_stop(pipeline_t *p)
+{
+    uint64_t one = 1;
+    if (!p || __atomic_exchange_n(&p->stopping, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (write(p->event_fd, &one, sizeof(one)) < 0)
+        return; // can't overflow, the counter is written once
+}
+
+static void pipeline_stage_done(void *buffer, size_t size, int result, void *user)
+{
+    (void)size;
+    (void)result; // reported by the sink
+    (void)user;
+    free(buffer);
+}
+
+/**
+ *   Submit coalesced writes, the sink owns the buffer until written
+ */
+static int pipeline_stage_flush(pipeline_t *p)
+{
+    int err = 0;
+    if (p->stage_size)
+    {
+        log_debug("pre-roll write: %zu bytes at %lld", p->stage_size, (long long)p->stage_offset);
+        err = mp4sink_submit(p->sink, p->stage_offset, p->stage, p->stage_size, pipeline_stage_done, NULL);
+    }
+    if (!p->stage_size || err)
+        free(p->stage); // not taken by the sink
+    p->stage = NULL;
+    p->stage_size = 0;
+    p->stage_capacity = 0;
+    return err;
+}
+
+static int pipeline_stage(pipeline_t *p, int64_t offset, const void *buffer, size_t size)
+{
+    if (p->stage_size + size > p->stage_capacity)
+    {
+        size_t capacity = p->stage_capacity ? p->stage_capacity * 2 : 256 * 1024;
+        unsigned char *stage;
+        while (capacity < p->stage_size + size)
+            capacity *= 2;
+        stage = (unsigned char *)realloc(p->stage, capacity);
+        if (!stage)
+            return 1;
+        p->stage = stage;
+        p->stage_capacity = capacity;
+    }
+    if (!p->stage_size)
+        p->stage_offset = offset;
+    memcpy(p->stage + p->stage_size, buffer, size);
+    p->stage_size += size;
+    return 0;
+}
+
+static int pipeline_write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    pipeline_t *p = (pipeline_t *)token;
+    int64_t end = offset + (int64_t)size;
+    int err;
+    if (p->mmap)
+        err = mp4mmap_write_callback(offset, buffer, size, p->mmap);
+    else if (p->direct)
+        err = mp4direct_write_callback(offset, buffer, size, p->direct);
+    else if (p->staging && (!p->stage_size || offset == p->stage_offset + (int64_t)p->stage_size))
+        err = pipeline_stage(p, offset, buffer, size);
+    else if (pipeline_stage_flush(p)) // keep write order
+        err = 1;
+    else
+        err = mp4sink_write_callback(offset, buffer, size, p->sink);
+    if (end > p->file_size)
+    {
+        // one writer at a time, read by pipeline_stats()
+        __atomic_store_n(&p->bytes, p->bytes + end - p->file_size, __ATOMIC_RELAXED);
+        p->file_size = end;
+    }
+    if (err || (p->param.stop_bytes && p->bytes >= p->param.stop_bytes))
+        pipeline_stop(p);
+    return err;
+}
+
+/**
+ *   MP4E_set_journal() write_callback: the samples a record refers to are made
+ *   durable before it, and the record itself before the next samples
+ */
+static int pipeline_journal_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    pipeline_t *p = (pipeline_t *)token;
+    int err = pipeline_stage_flush(p) || mp4sink_sync(p->sink);
+    while (!err && size)
+    {
+        ssize_t n = pwrite(p->journal_fd, buffer, size, offset);
+        if (n <= 0)
+            break;
+        buffer = (const char *)buffer + n;
+        offset += n;
+        size -= (size_t)n;
+    }
+    if (!err && (size || fdatasync(p->journal_fd)))
+    {
+        log_error("can't write %s", p->journal_path);
+        err = 1;
+    }
+    if (err)
+        pipeline_stop(p);
+    return err;
+}
+
+static void pipeline_release(const void *data, void *user)
+{
+    (void)data;
+    framepool_unref((frame_buf_t *)user);
+}
+
+/**
+ *   Queue a capture frame, a buffer of the pool: it is referenced until muxed
+ */
+static int pipeline_push(pipeline_t *p, int track, uint8_t *frame, int len, int64_t timestamp, int duration,
+                         int kind)
+{
+    frame_buf_t *fb = framepool_buf(frame);
+    framepool_ref(fb);
+    if (mp4mux_push(p->queue, track, frame, len, timestamp, duration, kind, pipeline_release, fb))
+    {
+        framepool_unref(fb);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *   Key frame with parameter sets starts a GOP: H.264 SPS, H.265 VPS.
+ *   Frames are access units, the parameter sets may follow an AUD
+ */
+static int pipeline_gop_start(const pipeline_t *p, const uint8_t *frame, int len)
+{
+    int i, type;
+    for (i = 2; i < len - 1; i++)
+    {
+        if (frame[i] != 1 || frame[i - 1] || frame[i - 2])
+            continue;
+        type = p->param.is_hevc ? (frame[i + 1] >> 1) & 0x3f : frame[i + 1] & 0x1f;
+        if (type == (p->param.is_hevc ? 32 : 7))
+            return 1;
+        if (p->param.is_hevc ? type < 32 : type >= 1 && type <= 5)
+            return 0; // slice: parameter sets come before it
+    }
+    return 0;
+}
+
+/**
+ *   Queue frame while recording, else keep it in the pre-roll. Continuous mode
+ *   does not lock: its queue is set before capture starts and closed after it
+ *   stops
+ *
+ *   return 1 if recorded, 0 if kept or dropped, -1 if the queue is full
+ */
+static int pipeline_record(pipeline_t *p, int video, uint8_t *frame, int len, int64_t timestamp, int duration,
+                           int kind, int gop_start)
+{
+    int ret = 0;
+    if (p->param.event_mode)
+        pthread_mutex_lock(&p->lock);
+    if (p->queue)
+    {
+        int track = video ? p->video_track : p->audio_track;
+        ret = pipeline_push(p, track, frame, len, timestamp, duration, kind) ? -1 : 1;
+    }
+    else if (p->preroll)
+    {
+        // queue tracks are not known before the first file: pre-roll track is 1 for video
+        preroll_sample_t s = {video, framepool_buf(frame), timestamp, duration, kind, gop_start};
+        preroll_push(p->preroll, &s);
+    }
+    if (p->param.event_mode)
+        pthread_mutex_unlock(&p->lock);
+    if (ret > 0)
+        __atomic_add_fetch(video ? &p->video_frames : &p->audio_frames, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+static int pipeline_video_cb(uint8_t *frame, int len, int iskey, int64_t timestamp, void *user)
+{
+    pipeline_t *p = (pipeline_t *)user;
+    int ret;
+    if (!p || len <= 0 || __atomic_load_n(&p->stopping, __ATOMIC_ACQUIRE))
+        return -1;
+    ret = pipeline_record(p, 1, frame, len, timestamp, 90000 / p->param.video_fps, 0,
+                          p->preroll && iskey && pipeline_gop_start(p, frame, len));
+    if (ret < 0)
+        return IPC_FRAME_BUSY; // counted by the queue
+    if (ret > 0 && p->param.stop_frames && __atomic_load_n(&p->video_frames, __ATOMIC_RELAXED) >= p->param.stop_frames)
+        pipeline_stop(p);
+    return 0;
+}
+
+static int pipeline_audio_cb(uint8_t *frame, int len, int64_t timestamp, void *user)
+{
+    pipeline_t *p = (pipeline_t *)user;
+    if (!p || len <= 0 || __atomic_load_n(&p->stopping, __ATOMIC_ACQUIRE))
+        return -1;
+    if (pipeline_record(p, 0, frame, len, timestamp, 1024 * 90000 / p->param.audio_rate,
+                        MP4E_SAMPLE_DEFAULT, 0) < 0)
+        return IPC_FRAME_BUSY;
+    return 0;
+}
+
+static int pipeline_event_cb(int event, void *data, void *user)
+{
+    pipeline_t *p = (pipeline_t *)user;
+    uint64_t one = 1;
+    (void)data;
+    if (!p || (event != EVENT_MOTION_DETECTION && event != EVENT_MOTION_DETECTION_DISAPEER))
+        return 0;
+    __atomic_store_n(&p->motion, event == EVENT_MOTION_DETECTION, __ATOMIC_RELEASE);
+    if (write(p->motion_fd, &one, sizeof(one)) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ *   Queue has room again: a capture that got IPC_FRAME_BUSY may deliver again
+ */
+static void pipeline_space(int track, void *user)
+{
+    pipeline_t *p = (pipeline_t *)user;
+    ipc_dev_t *dev = __atomic_load_n(&p->dev, __ATOMIC_ACQUIRE);
+    (void)track;
+    if (dev && dev->resume)
+        dev->resume(dev);
+}
+
+static int pipeline_init_mux(pipeline_t *p)
+{
+    MP4E_track_t tr;
+
+    p->mux = MP4E_open(p->param.sequential_mode, p->param.fragmentation_mode, p, pipeline_write_callback);
+    if (!p->mux)
+        return -1;
+    if (p->journal_fd >= 0 &&
+        MP4E_STATUS_OK != MP4E_set_journal(p->mux, p->param.journal_ms, pipeline_journal_callback, p))
+        return -1;
+
+    memset(&tr, 0, sizeof(tr));
+    tr.track_media_kind = e_audio;
+    tr.language[0] = 'u';
+    tr.language[1] = 'n';
+    tr.language[2] = 'd';
+    tr.object_type_indication = MP4_OBJECT_TYPE_AUDIO_ISO_IEC_14496_3;
+    tr.time_scale = 90000;
+    tr.u.a.channelcount = p->param.audio_channels;
+    p->audio_track_id = MP4E_add_track(p->mux, &tr);
+    if (p->audio_track_id < 0)
+        return -1;
+
+    if (MP4E_STATUS_OK != mp4_h26x_write_init(&p->writer, p->mux, p->param.width, p->param.height, p->param.is_hevc))
+        return -1;
+    p->writer_ok = 1;
+
+    // capture timestamps may drift from sample durations: keep 'mdat' in decode time order
+    if (p->param.sequential_mode && MP4E_STATUS_OK != MP4E_set_interleave(p->mux, (unsigned)p->param.max_delay_ms))
+        log_warn("MP4E_set_interleave failed");
+
+    p->queue = mp4mux_create(p->param.ring_size, p->param.max_delay_ms);
+    if (!p->queue)
+        return -1;
+    mp4mux_set_space_cb(p->queue, pipeline_space, p);
+    p->video_track = mp4mux_add_h26x_track(p->queue, &p->writer);
+    p->audio_track = mp4mux_add_track(p->queue, p->mux, p->audio_track_id);
+    if (p->video_track < 0 || p->audio_track < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ *   Finish the current file: stop queueing, mux queued frames, write the index
+ */
+static int pipeline_close_file(pipeline_t *p)
+{
+    mp4mux_t *queue;
+    int err = 0;
+
+    pthread_mutex_lock(&p->lock);
+    queue = p->queue;
+    p->queue = NULL; // capture goes to the pre-roll again
+    pthread_mutex_unlock(&p->lock);
+
+    if (queue)
+    {
+        log_debug("queue full: video %u, audio %u times", mp4mux_dropped(queue, p->video_track),
+                  mp4mux_dropped(queue, p->audio_track));
+        if (mp4mux_close(queue) != MP4E_STATUS_OK)
+        {
+            log_error("mux worker failed");
+            err = -1;
+        }
+    }
+    p->staging = 0;
+    if (p->mux && MP4E_close(p->mux) != MP4E_STATUS_OK)
+    {
+        log_error("can't write file index");
+        err = -1;
+    }
+    p->mux = NULL;
+    if (p->writer_ok)
+        mp4_h26x_write_close(&p->writer);
+    p->writer_ok = 0;
+    if (p->sink)
+    {
+        if (pipeline_stage_flush(p))
+            err = -1;
+        log_debug("sink stalls: %u", mp4sink_stalls(p->sink));
+        if (mp4sink_close(p->sink) != 0)
+        {
+            log_error("write mp4 file failed");
+            err = -1;
+        }
+    }
+    if ((p->mmap && mp4mmap_close(p->mmap)) || (p->direct && mp4direct_close(p->direct)))
+    {
+        log_error("write mp4 file failed");
+        err = -1;
+    }
+    p->sink = NULL;
+    p->mmap = NULL;
+    p->direct = NULL;
+    if (p->journal_fd >= 0)
+    {
+        close(p->journal_fd);
+        p->journal_fd = -1;
+        if (!err)
+            unlink(p->journal_path); // the file has its index
+    }
+    return err;
+}
+
+static int pipeline_mux_preroll(const preroll_sample_t *s, void *user)
+{
+    pipeline_t *p = (pipeline_t *)user;
+    int err;
+    if (s->track)
+    {
+        err = mp4_h26x_write_nal(&p->writer, s->buf->data, s->buf->size, s->duration);
+        __atomic_add_fetch(&p->video_frames, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        err = MP4E_put_sample(p->mux, p->audio_track_id, s->buf->data, s->buf->size, s->duration, s->kind);
+        __atomic_add_fetch(&p->audio_frames, 1, __ATOMIC_RELAXED);
+    }
+    return err;
+}
+
+/**
+ *   Open a file; in event mode mux the pre-roll into it with one write.
+ *   Capture is not blocked meanwhile: once the queue is set it takes the new
+ *   frames, and the worker muxes them after the pre-roll
+ */
+static int pipeline_open_file(pipeline_t *p)
+{
+    char name[PATH_MAX];
+    const char *path = p->param.path;
+    int err = 0;
+
+    if (p->param.event_mode)
+    {
+        snprintf(name, sizeof(name), p->param.path, p->segments);
+        path = name;
+    }
+    __atomic_store_n(&p->segments, p->segments + 1, __ATOMIC_RELAXED);
+    p->file_size = 0;
+    if (p->param.sink == PIPELINE_SINK_MMAP)
+        p->mmap = mp4mmap_open(path, p->param.stop_bytes);
+    else if (p->param.sink == PIPELINE_SINK_DIRECT)
+        p->direct = mp4direct_open(path, 0);
+    else
+        p->sink = mp4sink_open(path, p->param.sink_depth);
+    if (!pipeline_has_file(p))
+    {
+        log_error("can't open %s", path);
+        return -1;
+    }
+    if (p->param.journal_ms)
+    {
+        snprintf(p->journal_path, sizeof(p->journal_path), "%s.journal", path);
+        p->journal_fd = open(p->journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (p->journal_fd < 0)
+        {
+            log_error("can't create %s", p->journal_path);
+            return -1;
+        }
+    }
+
+    p->staging = p->preroll && p->sink;
+    pthread_mutex_lock(&p->lock);
+    err = pipeline_init_mux(p); // sets the queue: the pre-roll is no longer fed, it is ours to mux
+    pthread_mutex_unlock(&p->lock);
+    if (err)
+        log_error("can't create muxer");
+    else if (p->preroll)
+    {
+        unsigned count = preroll_count(p->preroll);
+        int64_t duration = preroll_duration(p->preroll);
+        if (preroll_drain(p->preroll, pipeline_mux_preroll, p) != MP4E_STATUS_OK)
+        {
+            log_error("can't mux pre-roll");
+            err = -1;
+        }
+        p->staging = 0;
+        if (!err && pipeline_stage_flush(p))
+            err = -1;
+        log_info("segment %s: pre-roll %u samples, %lld ms", path, count, (long long)duration);
+    }
+    if (!err && p->param.event_mode && mp4mux_start(p->queue))
+        err = -1;
+    if (err)
+    {
+        // frames are not queued, the caller closes the file
+        mp4mux_t *queue;
+        pthread_mutex_lock(&p->lock);
+        queue = p->queue;
+        p->queue = NULL;
+        pthread_mutex_unlock(&p->lock);
+        mp4mux_close(queue);
+    }
+    return err;
+}
+
+pipeline_t *pipeline_create(const pipeline_param_t *param)
+{
+    pipeline_t *p;
+    if (!param || !param->path || param->video_fps <= 0 || param->audio_rate <= 0 ||
+        (param->journal_ms && (param->sink != PIPELINE_SINK_QUEUE || param->fragmentation_mode)))
+        return NULL;
+    p = (pipeline_t *)calloc(1, sizeof(pipeline_t));
+    if (!p)
+        return NULL;
+    p->param = *param;
+    pthread_mutex_init(&p->lock, NULL);
+    p->motion_fd = -1;
+    p->journal_fd = -1;
+    // keep as many free buffers per size class as a track queue holds
+    p->pool = framepool_create(param->ring_size ? param->ring_size : MP4MUX_RING_SIZE);
+    p->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (p->event_fd < 0 || !p->pool)
+    {
+        log_error("can't create pipeline");
+        pipeline_close(p);
+        return NULL;
+    }
+    if (param->event_mode)
+    {
+        p->motion_fd = eventfd(0, EFD_CLOEXEC);
+        p->preroll = preroll_create(param->preroll_bytes ? param->preroll_bytes : PIPELINE_PREROLL_BYTES,
+                                    param->preroll_ms);
+        if (p->motion_fd < 0 || !p->preroll)
+        {
+            log_error("can't create pre-roll");
+            pipeline_close(p);
+            return NULL;
+        }
+        return p;
+    }
+    if (pipeline_open_file(p))
+    {
+        pipeline_close(p);
+        return NULL;
+    }
+    return p;
+}
+
+int pipeline_start(pipeline_t *p, ipc_param_t *ipc_param)
+{
+    return pipeline_start_dev(p, ipc_dev_get(), ipc_param);
+}
+
+int pipeline_start_dev(pipeline_t *p, ipc_dev_t *dev, ipc_param_t *ipc_param)
+{
+    if (!p || !dev || !dev->init || !dev->run || !ipc_param || p->dev)
+        return -1;
+    if (p->queue && mp4mux_start(p->queue))
+        return -1;
+    p->start_ms = pipeline_now_ms();
+    ipc_param->video_cb = pipeline_video_cb;
+    ipc_param->audio_cb = pipeline_audio_cb;
+    if (p->param.event_mode)
+        ipc_param->event_cb = pipeline_event_cb;
+    ipc_param->user = p;
+    ipc_param->frame_pool = p->pool;
+    if (dev->init(dev, ipc_param))
+    {
+        log_error("ipc init error");
+        return -1;
+    }
+    __atomic_store_n(&p->dev, dev, __ATOMIC_RELEASE);
+    dev->run(dev);
+    return 0;
+}
+
+/**
+ *   Motion detected: record, starting with the pre-roll. Disappeared: close the
+ *   segment after the post-roll
+ */
+static void pipeline_motion(pipeline_t *p)
+{
+    uint64_t events;
+    if (read(p->motion_fd, &events, sizeof(events)) < 0)
+        return;
+    if (__atomic_load_n(&p->motion, __ATOMIC_ACQUIRE))
+    {
+        p->postroll_end = 0;
+        if (!pipeline_has_file(p) && pipeline_open_file(p))
+        {
+            log_error("can't start event recording");
+            pipeline_close_file(p);
+        }
+    }
+    else if (pipeline_has_file(p) && !p->postroll_end)
+        p->postroll_end = pipeline_now_ms() + p->param.postroll_ms;
+}
+
+int pipeline_wait(pipeline_t *p)
+{
+    struct pollfd pfd[2];
+    if (!p)
+        return -1;
+    pfd[0].fd = p->event_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = p->motion_fd;
+    pfd[1].events = POLLIN;
+    for (;;)
+    {
+        int64_t now = pipeline_now_ms();
+        int64_t stop_end = p->param.stop_ms ? p->start_ms + p->param.stop_ms : INT64_MAX;
+        int64_t deadline = p->postroll_end && p->postroll_end < stop_end ? p->postroll_end : stop_end;
+        int n;
+        if (now >= stop_end)
+            break;
+        if (p->postroll_end && now >= p->postroll_end)
+        {
+            p->postroll_end = 0;
+            if (pipeline_close_file(p))
+                log_error("event recording failed");
+            continue;
+        }
+        n = poll(pfd, p->motion_fd >= 0 ? 2 : 1, deadline == INT64_MAX ? -1 : (int)(deadline - now));
+        if (n < 0 && errno != EINTR)
+        {
+            log_error("poll failed: %s", strerror(errno));
+            return -1;
+        }
+        if (n > 0 && (pfd[0].revents & POLLIN))
+            break;
+        if (n > 0 && (pfd[1].revents & POLLIN))
+            pipeline_motion(p);
+    }
+    pipeline_stop(p);
+    return 0;
+}
+
+void pipeline_stats(pipeline_t *p, pipeline_stats_t *stats)
+{
+    if (!p || !stats)
+        return;
+    stats->video_frames = __atomic_load_n(&p->video_frames, __ATOMIC_RELAXED);
+    stats->audio_frames = __atomic_load_n(&p->audio_frames, __ATOMIC_RELAXED);
+    stats->segments = __atomic_load_n(&p->segments, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&p->bytes, __ATOMIC_RELAXED);
+}
+
+int pipeline_close(pipeline_t *p)
+{
+    int err = 0;
+    if (!p)
+        return -1;
+    if (p->dev && p->dev->stop)
+        p->dev->stop(p->dev); // no callbacks after it
+    __atomic_store_n(&p->dev, NULL, __ATOMIC_RELEASE);
+    if (pipeline_has_file(p))
+        err = pipeline_close_file(p);
+    if (p->preroll)
+        preroll_destroy(p->preroll);
+    if (p->pool)
+    {
+        framepool_stats_t s;
+        framepool_stats(p->pool, &s);
+        log_debug("frame pool: hit rate %.1f%% of %llu gets, high-water %u buffers, %zu bytes",
+                  s.gets ? 100.0 * s.hits / s.gets : 0.0, (unsigned long long)s.gets, s.in_use_high, s.bytes_high);
+        framepool_destroy(p->pool); // queue is closed, all buffers are back
+    }
+    log_info("recorded video %u, audio %u frames, %lld bytes in %u files", p->video_frames, p->audio_frames,
+             (long long)p->bytes, p->segments);
+    if (p->event_fd >= 0)
+        close(p->event_fd);
+    if (p->motion_fd >= 0)
+        close(p->motion_fd);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    return err;
+}
@@ -0,0 +1,115 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include "ipc.h"
+
+/**
+ *   Recording pipeline: ipc capture callbacks -> per-track bounded queues ->
+ *   mux worker -> asynchronous file sink. All stages block on events, so
+ *   the recorder takes no CPU while waiting for frames or for the stop.
+ *   Pipelines are independent: one per camera (ipc device instance)
+ *
+ *   In event mode nothing is written until a motion event: capture is kept in
+ *   a pre-roll ring, and each event records a segment file that starts with
+ *   the pre-roll and ends postroll_ms after the motion disappears
+ */
+
+// Default pre-roll memory cap, bytes
+#define PIPELINE_PREROLL_BYTES (8 << 20)
+
+// File sink of the recording, see mp4sink.h
+enum
+{
+    PIPELINE_SINK_QUEUE,    // mp4sink: asynchronous writes, io_uring or worker thread
+    PIPELINE_SINK_MMAP,     // mp4mmap: preallocated file written through mmap()
+    PIPELINE_SINK_DIRECT,   // mp4direct: O_DIRECT aligned blocks
+};
+
+typedef struct
+{
+    const char *path;       // output file, printf pattern of the segment number in event mode,
+                            // e.g. "event_%03u.mp4"
+    int sequential_mode;
+    int fragmentation_mode;
+    int is_hevc;
+    int width;
+    int height;
+    int video_fps;          // video sample duration is 90000 / video_fps
+    int audio_rate;         // AAC, audio sample duration is 1024 * 90000 / audio_rate
+    int audio_channels;
+    unsigned ring_size;     // samples per track queue, 0 - MP4MUX_RING_SIZE
+    int64_t max_delay_ms;   // longest wait of the mux for a late track
+    int sink;               // PIPELINE_SINK_*
+    int sink_depth;         // PIPELINE_SINK_QUEUE: writes in flight, 0 - MP4SINK_QUEUE_DEPTH
+    unsigned journal_ms;    // PIPELINE_SINK_QUEUE, not fragmented: index journal checkpoint interval
+                            // (0 - none), written to <file>.journal and removed when the file is
+                            // closed; an unclosed file is recovered from it by mp4_recover -j
+
+    // stop conditions, first reached one stops recording (0 - not used)
+    unsigned stop_frames;   // video frames recorded
+    unsigned stop_ms;       // time since pipeline_start()
+    int64_t stop_bytes;     // bytes written; queued frames and index still follow
+
+    int event_mode;         // record on ipc motion events only
+    unsigned preroll_ms;    // kept before the event, 0 - as much as preroll_bytes holds
+    size_t preroll_bytes;   // pre-roll memory cap, 0 - PIPELINE_PREROLL_BYTES
+    unsigned postroll_ms;   // recorded after the motion disappears
+} pipeline_param_t;
+
+typedef struct pipeline pipeline_t;
+
+typedef struct
+{
+    unsigned video_frames;  // recorded
+    unsigned audio_frames;
+    int64_t bytes;          // written so far, all files
+    unsigned segments;      // files opened
+} pipeline_stats_t;
+
+/**
+ *   Create output file, muxer and queues; in event mode the pre-roll ring only
+ *
+ *   return pipeline, or NULL on failure
+ */
+extern pipeline_t *pipeline_create(const pipeline_param_t *param);
+
+/**
+ *   Start mux worker and capture from the registered ipc device: video_cb, audio_cb,
+ *   user, frame_pool and, in event mode, event_cb of ipc_param are set by the pipeline.
+ *   The device must pass frames in buffers of frame_pool, they are queued by reference
+ *
+ *   return 0 on success, -1 on failure
+ */
+extern int pipeline_start(pipeline_t *p, ipc_param_t *ipc_param);
+
+/**
+ *   Same as pipeline_start(), capturing from given device instance, e.g. ipc_dev_new(&sim_ipc).
+ *   The device is stopped by pipeline_close(), and freed by the caller after it
+ */
+extern int pipeline_start_dev(pipeline_t *p, ipc_dev_t *dev, ipc_param_t *ipc_param);
+
+/**
+ *   Block until a stop condition is reached or pipeline_stop() is called.
+ *   Frames coming after that are not recorded. Motion events are handled
+ *   here: segments are opened and closed by the thread calling it
+ *
+ *   return 0 on success, -1 on failure
+ */
+extern int pipeline_wait(pipeline_t *p);
+
+extern void pipeline_stats(pipeline_t *p, pipeline_stats_t *stats);
+
+/**
+ *   Request stop, async-signal-safe, e.g. from SIGINT handler
+ */
+extern void pipeline_stop(pipeline_t *p);
+
+/**
+ *   Stop capture, mux queued frames, finish the file (segment) and free the pipeline
+ *
+ *   return 0 on success, -1 if muxing or writing failed
+ */
+extern int pipeline_close(pipeline_t *p);
+
+#endif /*PIPELINE_H*/
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log/log.h"
+#include "preroll.h"
+
+#define PREROLL_MIN_SAMPLES 256
+
+struct preroll
+{
+    preroll_sample_t *ring;
+    unsigned mask;      // ring size - 1
+    unsigned head;      // positions grow, index is position & mask
+    unsigned tail;
+    unsigned gops;      // GOP starts held, the head is one of them
+    unsigned next_gop;  // position of the second GOP start, if gops > 1
+    size_t bytes;
+    size_t max_bytes;
+    int64_t max_ms;
+};
+
+preroll_t *preroll_create(size_t max_bytes, int64_t max_ms)
+{
+    preroll_t *r = (preroll_t *)calloc(1, sizeof(preroll_t));
+    if (!r)
+        return NULL;
+    r->ring = (preroll_sample_t *)malloc(PREROLL_MIN_SAMPLES * sizeof(preroll_sample_t));
+    if (!r->ring)
+    {
+        free(r);
+        return NULL;
+    }
+    r->mask = PREROLL_MIN_SAMPLES - 1;
+    r->max_bytes = max_bytes ? max_bytes : PREROLL_MAX_BYTES;
+    r->max_ms = max_ms;
+    return r;
+}
+
+static preroll_sample_t *preroll_at(const preroll_t *r, unsigned pos)
+{
+    return r->ring + (pos & r->mask);
+}
+
+static void preroll_release(preroll_t *r)
+{
+    preroll_sample_t *s = preroll_at(r, r->head++);
+    r->bytes -= s->buf->capacity;
+    framepool_unref(s->buf);
+}
+
+/**
+ *   Drop the oldest GOP, and samples of other tracks queued with it
+ */
+static void preroll_drop_gop(preroll_t *r)
+{
+    unsigned end = r->gops > 1 ? r->next_gop : r->tail;
+    while (r->head != end)
+        preroll_release(r);
+    if (r->gops)
+        r->gops--;
+    if (r->gops > 1)
+    {
+        unsigned pos = r->head + 1;
+        while (!preroll_at(r, pos)->gop_start)
+            pos++;
+        r->next_gop = pos;
+    }
+}
+
+static int preroll_grow(preroll_t *r)
+{
+    unsigned size = (r->mask + 1) * 2, pos;
+    preroll_sample_t *ring = (preroll_sample_t *)malloc(size * sizeof(preroll_sample_t));
+    if (!ring)
+        return -1;
+    for (pos = r->head; pos != r->tail; pos++)
+        ring[pos & (size - 1)] = *preroll_at(r, pos);
+    free(r->ring);
+    r->ring = ring;
+    r->mask = size - 1;
+    return 0;
+}
+
+int preroll_push(preroll_t *r, const preroll_sample_t *s)
+{
+    int64_t newest;
+    if (!r || !s || !s->buf)
+        return -1;
+    if (r->head == r->tail && !s->gop_start)
+        return -1;
+    if (r->tail - r->head > r->mask && preroll_grow(r))
+    {
+        log_warn("pre-roll ring is full, dropping oldest GOP");
+        preroll_drop_gop(r);
+        if (r->head == r->tail && !s->gop_start)
+            return -1;
+    }
+    if (s->gop_start && ++r->gops == 2)
+        r->next_gop = r->tail;
+    framepool_ref(s->buf);
+    *preroll_at(r, r->tail++) = *s;
+    r->bytes += s->buf->capacity;
+
+    newest = s->timestamp;
+    while (r->head != r->tail && r->bytes > r->max_bytes)
+        preroll_drop_gop(r);
+    // keep max_ms: the oldest GOP goes once the rest covers it
+    while (r->max_ms && r->gops > 1 && newest - preroll_at(r, r->next_gop)->timestamp >= r->max_ms)
+        preroll_drop_gop(r);
+    return r->head != r->tail ? 0 : -1;
+}
+
+int preroll_drain(preroll_t *r, int (*cb)(const preroll_sample_t *s, void *user), void *user)
+{
+    int err = 0;
+    if (!r)
+        return -1;
+    while (r->head != r->tail)
+    {
+        if (!err && cb)
+            err = cb(preroll_at(r, r->head), user);
+        preroll_release(r);
+    }
+    r->gops = 0;
+    return err;
+}
+
+void preroll_clear(preroll_t *r)
+{
+    preroll_drain(r, NULL, NULL);
+}
+
+unsigned preroll_count(const preroll_t *r)
+{
+    return r ? r->tail - r->head : 0;
+}
+
+size_t preroll_bytes(const preroll_t *r)
+{
+    return r ? r->bytes : 0;
+}
+
+int64_t preroll_duration(const preroll_t *r)
+{
+    if (!r || r->head == r->tail)
+        return 0;
+    return preroll_at(r, r->tail - 1)->timestamp - preroll_at(r, r->head)->timestamp;
+}
+
+void preroll_destroy(preroll_t *r)
+{
+    if (!r)
+        return;
+    preroll_clear(r);
+    free(r->ring);
+    free(r);
+}
@@ -0,0 +1,66 @@
+#ifndef PREROLL_H
+#define PREROLL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "framepool.h"
+
+/**
+ *   Pre-roll ring: the latest encoded A/V samples kept in memory while not
+ *   recording, so a recording started by an event begins before the event.
+ *   Samples are pool buffers held by reference, not copied. The ring always
+ *   starts at a GOP start and whole GOPs are dropped from its head to stay
+ *   within the memory cap and the kept duration. Not thread-safe
+ */
+
+// Default memory cap, bytes of buffer capacity held
+#define PREROLL_MAX_BYTES (8 << 20)
+
+typedef struct
+{
+    int track;           // caller's track number
+    frame_buf_t *buf;    // data is buf->data, buf->size bytes
+    int64_t timestamp;   // ms
+    int duration;
+    int kind;
+    int gop_start;       // video sample decoding can start from, e.g. SPS before IDR
+} preroll_sample_t;
+
+typedef struct preroll preroll_t;
+
+/**
+ *   Create ring keeping up to max_bytes (0 - PREROLL_MAX_BYTES) and at least
+ *   max_ms of samples when they fit (0 - as many as fit)
+ *
+ *   return ring, or NULL on failure
+ */
+extern preroll_t *preroll_create(size_t max_bytes, int64_t max_ms);
+
+/**
+ *   Add sample, taking a reference to its buffer. Samples before the first
+ *   GOP start are dropped, they can't be decoded
+ *
+ *   return 0 if kept, -1 if dropped
+ */
+extern int preroll_push(preroll_t *r, const preroll_sample_t *s);
+
+/**
+ *   Pass samples to cb oldest first and empty the ring. After cb returns
+ *   non-zero the rest is dropped
+ *
+ *   return 0, or the first non-zero cb result
+ */
+extern int preroll_drain(preroll_t *r, int (*cb)(const preroll_sample_t *s, void *user), void *user);
+
+extern void preroll_clear(preroll_t *r);
+
+/**
+ *   Samples and bytes held, time from the oldest to the newest sample (ms)
+ */
+extern unsigned preroll_count(const preroll_t *r);
+extern size_t preroll_bytes(const preroll_t *r);
+extern int64_t preroll_duration(const preroll_t *r);
+
+extern void preroll_destroy(preroll_t *r);
+
+#endif /*PREROLL_H*/
@@ -0,0 +1,198 @@
+/**
+ *   h26x_index: random access to raw H.264/H.265 (Annex B) files through an
+ *   access unit index kept in a sidecar file <stream>.idx
+ *
+ *   usage: h26x_index [-5] [-f n] [-m out.mp4] [-r fps] [-s WxH] <stream.h264>
+ *   The index is built (one scan of the stream) if the sidecar is missing,
+ *   stale or made for the other codec, else loaded. -5: stream is H.265.
+ *   -f n: write access units from the key frame before n up to n to stdout.
+ *   -m: remux the stream into MP4 at fps (25) and size (1920x1080); access
+ *   units are read at their indexed offsets, the muxer still splits each one
+ *   into NAL units
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../thirdparty/h264reader/h264reader.h"
+#include "../thirdparty/minimp4/include/minimp4.h"
+#include "../thirdparty/log/log.h"
+
+static int write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    FILE *f = (FILE *)token;
+    fseeko(f, offset, SEEK_SET);
+    return fwrite(buffer, 1, size, f) != size;
+}
+
+/**
+ *   Read access units first..last with reader, pass each to cb
+ */
+static int for_each_au(void *reader, void *index, int first, int last,
+                       int (*cb)(const unsigned char *au, int size, void *user), void *user)
+{
+    unsigned char *buf = NULL;
+    int capacity = 0, n, err = 0;
+    for (n = first; n <= last && !err; n++)
+    {
+        const tH264IndexEntry *e = H264IndexGet(index, n);
+        int size = e->size;
+        if (size > capacity)
+        {
+            free(buf);
+            capacity = size * 2;
+            buf = (unsigned char *)malloc(capacity);
+            if (!buf)
+                return -1;
+        }
+        if (H264FileReaderReadFrame(reader, e, buf, &size) < 0)
+        {
+            log_error("can't read access unit %d", n);
+            err = -1;
+            break;
+        }
+        err = cb(buf, size, user);
+    }
+    free(buf);
+    return err;
+}
+
+static int dump_au(const unsigned char *au, int size, void *user)
+{
+    (void)user;
+    return fwrite(au, 1, size, stdout) != (size_t)size ? -1 : 0;
+}
+
+typedef struct
+{
+    mp4_h26x_writer_t writer;
+    unsigned duration; // 90 kHz
+} remux_t;
+
+static int remux_au(const unsigned char *au, int size, void *user)
+{
+    remux_t *remux = (remux_t *)user;
+    return mp4_h26x_write_nal(&remux->writer, au, size, remux->duration) != MP4E_STATUS_OK ? -1 : 0;
+}
+
+static int remux(void *reader, void *index, const char *path, int fps, int width, int height, int hevc)
+{
+    remux_t remux;
+    MP4E_mux_t *mux;
+    int err;
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        log_error("can't create %s", path);
+        return -1;
+    }
+    mux = MP4E_open(0, 0, f, write_callback);
+    if (!mux || mp4_h26x_write_init(&remux.writer, mux, width, height, hevc) != MP4E_STATUS_OK)
+    {
+        log_error("can't start MP4 muxer");
+        if (mux)
+            MP4E_close(mux);
+        fclose(f);
+        return -1;
+    }
+    remux.duration = 90000 / fps;
+    err = for_each_au(reader, index, 0, H264IndexCount(index) - 1, remux_au, &remux);
+    if (MP4E_close(mux) != MP4E_STATUS_OK && !err)
+        err = -1;
+    mp4_h26x_write_close(&remux.writer);
+    if (fclose(f) && !err)
+        err = -1;
+    return err;
+}
+
+int main(int argc, char **argv)
+{
+    const char *mp4 = NULL;
+    char *stream, *sidecar;
+    void *index, *reader;
+    int hevc = 0, frame = -1, fps = 25, width = 1920, height = 1080;
+    int opt, n, keys = 0, err = 0;
+
+    while ((opt = getopt(argc, argv, "5f:m:r:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case '5':
+            hevc = 1;
+            break;
+        case 'f':
+            frame = atoi(optarg);
+            break;
+        case 'm':
+            mp4 = optarg;
+            break;
+        case 'r':
+            fps = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2)
+                width = 0;
+            break;
+        default:
+            width = 0;
+        }
+    }
+    if (optind != argc - 1 || fps <= 0 || width <= 0 || height <= 0)
+    {
+        printf("usage: %s [-5] [-f n] [-m out.mp4] [-r fps] [-s WxH] <stream.h264>\n", argv[0]);
+        return 1;
+    }
+    stream = argv[optind];
+    sidecar = (char *)malloc(strlen(stream) + 5);
+    if (!sidecar)
+        return 1;
+    sprintf(sidecar, "%s.idx", stream);
+
+    index = H264IndexLoad(sidecar, stream, hevc);
+    if (!index)
+    {
+        index = H264IndexBuild(stream, hevc);
+        if (!index)
+        {
+            log_error("can't index %s", stream);
+            free(sidecar);
+            return 1;
+        }
+        if (H264IndexSave(index, sidecar))
+            log_warn("can't write %s", sidecar);
+    }
+    for (n = 0; n < H264IndexCount(index); n++)
+        keys += H264IndexGet(index, n)->key;
+    log_info("%s: %d access units, %d key frames", stream, H264IndexCount(index), keys);
+
+    reader = H264FileReaderCreate(stream);
+    if (!reader)
+    {
+        log_error("can't open %s", stream);
+        err = 1;
+    }
+    else if (frame >= 0)
+    {
+        int key = H264IndexFindKey(index, frame);
+        if (frame >= H264IndexCount(index) || key < 0)
+        {
+            log_error("no access unit %d, or no key frame before it", frame);
+            err = 1;
+        }
+        else
+            err = for_each_au(reader, index, key, frame, dump_au, NULL) != 0;
+    }
+    if (!err && reader && mp4)
+    {
+        err = remux(reader, index, mp4, fps, width, height, hevc) != 0;
+        if (err)
+            log_error("remux to %s failed", mp4);
+        else
+            log_info("%s -> %s", stream, mp4);
+    }
+
+    H264FileReaderRemove(reader);
+    H264IndexRemove(index);
+    free(sidecar);
+    return err;
+}
@@ -0,0 +1,154 @@
+/**
+ *   mp4_concat: join consecutive MP4 segments into one file without re-encoding
+ *
+ *   usage: mp4_concat [-f fragment_ms] <out.mp4> <in1.mp4> <in2.mp4> ...
+ *   with -f, output is fragmented MP4 with fragments of given duration
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../thirdparty/minimp4/include/minimp4.h"
+#include "../thirdparty/log/log.h"
+
+typedef struct
+{
+    int fd_in;
+    int fd_out;
+    MP4D_demux_t mp4;
+} concat_segment_t;
+
+static int read_callback(int64_t offset, void *buffer, size_t size, void *token)
+{
+    concat_segment_t *seg = (concat_segment_t *)token;
+    while (size)
+    {
+        ssize_t n = pread(seg->fd_in, buffer, size, offset);
+        if (n <= 0)
+            return 1;
+        buffer = (char *)buffer + n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    int fd = *(const int *)token;
+    while (size)
+    {
+        ssize_t n = pwrite(fd, buffer, size, offset);
+        if (n <= 0)
+            return 1;
+        buffer = (const char *)buffer + n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ *   Copy segment payload range to output file, kernel side where supported
+ */
+static int copy_callback(int64_t src_offset, int64_t dst_offset, size_t size, void *token)
+{
+    concat_segment_t *seg = (concat_segment_t *)token;
+    loff_t src = src_offset, dst = dst_offset;
+    while (size)
+    {
+        ssize_t n = copy_file_range(seg->fd_in, &src, seg->fd_out, &dst, size, 0);
+        if (n <= 0)
+        {
+            // e.g. EXDEV on old kernels: plain copy of the rest
+            char buf[65536];
+            size_t chunk = size < sizeof(buf) ? size : sizeof(buf);
+            if (read_callback(src, buf, chunk, token) || write_callback(dst, buf, chunk, &seg->fd_out))
+                return 1;
+            n = (ssize_t)chunk;
+            src += n;
+            dst += n;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    concat_segment_t *segs;
+    const MP4D_demux_t **segments;
+    MP4E_mux_t *mux;
+    unsigned fragment_ms = 0;
+    int i, count, fd_out, err = 0;
+    char **args = argv + 1;
+
+    if (argc > 2 && !strcmp(argv[1], "-f"))
+    {
+        fragment_ms = (unsigned)atoi(argv[2]);
+        args += 2;
+        argc -= 2;
+    }
+    if (argc < 3)
+    {
+        printf("usage: %s [-f fragment_ms] <out.mp4> <in1.mp4> <in2.mp4> ...\n", argv[0]);
+        return 1;
+    }
+    count = argc - 2;
+    segs = (concat_segment_t *)calloc(count, sizeof(concat_segment_t));
+    segments = (const MP4D_demux_t **)calloc(count, sizeof(segments[0]));
+    if (!segs || !segments)
+        return 1;
+
+    fd_out = open(args[0], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_out < 0)
+    {
+        log_error("can't create %s", args[0]);
+        return 1;
+    }
+    for (i = 0; i < count; i++)
+        segs[i].fd_in = -1;
+    for (i = 0; i < count && !err; i++)
+    {
+        struct stat st;
+        segs[i].fd_out = fd_out;
+        segs[i].fd_in = open(args[i + 1], O_RDONLY);
+        if (segs[i].fd_in < 0 || fstat(segs[i].fd_in, &st) ||
+            !MP4D_open(&segs[i].mp4, read_callback, segs + i, st.st_size))
+        {
+            log_error("can't open %s", args[i + 1]);
+            err = 1;
+        }
+        segments[i] = &segs[i].mp4;
+    }
+
+    if (!err)
+    {
+        mux = MP4E_open(0, fragment_ms != 0, &fd_out, write_callback);
+        err = MP4E_concat(segments, (unsigned)count, mux, fragment_ms, copy_callback);
+        if (MP4E_close(mux) != MP4E_STATUS_OK && !err)
+            err = MP4E_STATUS_FILE_WRITE_ERROR;
+        if (err == MP4E_STATUS_INCOMPATIBLE_TRACKS)
+            log_error("segments have different tracks or codec parameters");
+        else if (err)
+            log_error("concat failed: %d", err);
+        else
+            log_info("%d segments -> %s", count, args[0]);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        MP4D_close(&segs[i].mp4);
+        if (segs[i].fd_in >= 0)
+            close(segs[i].fd_in);
+    }
+    close(fd_out);
+    free(segments);
+    free(segs);
+    return err ? 1 : 0;
+}
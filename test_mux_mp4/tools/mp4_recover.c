@@ -0,0 +1,221 @@
+/**
+ *   mp4_recover: rebuild 'moov' of sequential mode MP4 file, left unclosed by
+ *   power loss, in place
+ *
+ *   usage: mp4_recover <broken.mp4> <reference.mp4> [fps]
+ *          mp4_recover <broken.mp4> -j <journal>
+ *   reference.mp4 is a closed file from the same recorder: tracks, SPS/PPS and
+ *   DSI are taken from it. Video frame rate is fps, or that of reference file.
+ *   With index journal, written by the recorder with MP4E_set_journal() (the
+ *   pipeline with journal_ms: <file>.journal), the file is not scanned
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../thirdparty/minimp4/include/minimp4.h"
+#include "../thirdparty/log/log.h"
+
+typedef struct
+{
+    int fd;
+    int64_t end; // end of last write
+    int discard; // recovery failed: drop writes, the file is left as it was
+} recover_file_t;
+
+static int read_callback(int64_t offset, void *buffer, size_t size, void *token)
+{
+    recover_file_t *file = (recover_file_t *)token;
+    while (size)
+    {
+        ssize_t n = pread(file->fd, buffer, size, offset);
+        if (n <= 0)
+            return 1;
+        buffer = (char *)buffer + n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    recover_file_t *file = (recover_file_t *)token;
+    if (file->discard)
+        return 0;
+    if (offset + (int64_t)size > file->end)
+        file->end = offset + (int64_t)size;
+    while (size)
+    {
+        ssize_t n = pwrite(file->fd, buffer, size, offset);
+        if (n <= 0)
+            return 1;
+        buffer = (const char *)buffer + n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ *   Load whole journal file to memory
+ */
+static void *load_journal(const char *path, size_t *bytes)
+{
+    recover_file_t file = { -1, 0, 0 };
+    struct stat st;
+    void *data = NULL;
+    file.fd = open(path, O_RDONLY);
+    if (file.fd < 0)
+        return NULL;
+    if (!fstat(file.fd, &st) && st.st_size > 0 && (data = malloc((size_t)st.st_size)) != NULL &&
+        read_callback(0, data, (size_t)st.st_size, &file))
+    {
+        free(data);
+        data = NULL;
+    }
+    *bytes = data ? (size_t)st.st_size : 0;
+    close(file.fd);
+    return data;
+}
+
+/**
+ *   Add tracks of reference file to the mux, with the same parameter sets and DSI
+ */
+static int add_reference_tracks(MP4E_mux_t *mux, const MP4D_demux_t *ref, unsigned fps)
+{
+    unsigned ntr;
+    for (ntr = 0; ntr < ref->track_count; ntr++)
+    {
+        const MP4D_track_t *tr = ref->track + ntr;
+        MP4E_track_t info;
+        MP4D_sample_info_t first;
+        const void *nal;
+        int n, nal_bytes, id;
+
+        memset(&info, 0, sizeof(info));
+        info.object_type_indication = tr->object_type_indication;
+        memcpy(info.language, tr->language, sizeof(info.language));
+        info.time_scale = tr->timescale;
+        if (MP4D_sample_info(ref, ntr, 0, &first))
+            info.default_duration = first.duration;
+        if (tr->handler_type == MP4D_HANDLER_TYPE_VIDE)
+        {
+            info.track_media_kind = e_video;
+            info.u.v.width = tr->SampleDescription.video.width;
+            info.u.v.height = tr->SampleDescription.video.height;
+            if (fps)
+                info.default_duration = tr->timescale / fps;
+        }
+        else if (tr->handler_type == MP4D_HANDLER_TYPE_SOUN)
+        {
+            info.track_media_kind = e_audio;
+            info.u.a.channelcount = tr->SampleDescription.audio.channelcount;
+        }
+        else
+        {
+            continue;
+        }
+        id = MP4E_add_track(mux, &info);
+        if (id < 0)
+            return id;
+        if (info.track_media_kind == e_video)
+        {
+            for (n = 0; (nal = MP4D_read_vps(ref, ntr, n, &nal_bytes)) != NULL; n++)
+                MP4E_set_vps(mux, id, nal, nal_bytes);
+            for (n = 0; (nal = MP4D_read_sps(ref, ntr, n, &nal_bytes)) != NULL; n++)
+                MP4E_set_sps(mux, id, nal, nal_bytes);
+            for (n = 0; (nal = MP4D_read_pps(ref, ntr, n, &nal_bytes)) != NULL; n++)
+                MP4E_set_pps(mux, id, nal, nal_bytes);
+        }
+        else if (tr->dsi_bytes)
+        {
+            MP4E_set_dsi(mux, id, tr->dsi, tr->dsi_bytes);
+        }
+    }
+    return MP4E_STATUS_OK;
+}
+
+int main(int argc, char **argv)
+{
+    recover_file_t file = { -1, 0, 0 }, ref_file = { -1, 0, 0 };
+    MP4D_demux_t mp4, ref;
+    MP4E_mux_t *mux;
+    struct stat st;
+    void *journal = NULL;
+    size_t journal_bytes = 0;
+    int err;
+
+    if (argc < 3 || (!strcmp(argv[2], "-j") && argc < 4))
+    {
+        printf("usage: %s <broken.mp4> <reference.mp4> [fps]\n", argv[0]);
+        printf("       %s <broken.mp4> -j <journal>\n", argv[0]);
+        return 1;
+    }
+    memset(&ref, 0, sizeof(ref));
+    if (!strcmp(argv[2], "-j"))
+    {
+        journal = load_journal(argv[3], &journal_bytes);
+        if (!journal)
+        {
+            log_error("can't read journal %s", argv[3]);
+            return 1;
+        }
+    }
+    else
+    {
+        ref_file.fd = open(argv[2], O_RDONLY);
+        if (ref_file.fd < 0 || fstat(ref_file.fd, &st) || !MP4D_open(&ref, read_callback, &ref_file, st.st_size) ||
+            !ref.track_count)
+        {
+            log_error("can't open reference %s", argv[2]);
+            return 1;
+        }
+    }
+    file.fd = open(argv[1], O_RDWR);
+    if (file.fd < 0 || fstat(file.fd, &st))
+    {
+        log_error("can't open %s", argv[1]);
+        return 1;
+    }
+
+    // do not touch files with index
+    memset(&mp4, 0, sizeof(mp4));
+    if (MP4D_open(&mp4, read_callback, &file, st.st_size) && mp4.track_count)
+    {
+        log_info("%s has index, nothing to recover", argv[1]);
+        MP4D_close(&mp4);
+        MP4D_close(&ref);
+        free(journal);
+        return 0;
+    }
+    MP4D_close(&mp4);
+
+    mux = MP4E_open(1, 0, &file, write_callback);
+    if (!mux)
+        err = MP4E_STATUS_FILE_WRITE_ERROR;
+    else if (journal)
+        err = MP4E_replay_journal(mux, journal, journal_bytes, read_callback, &file, st.st_size);
+    else if (!(err = add_reference_tracks(mux, &ref, argc > 3 ? (unsigned)atoi(argv[3]) : 0)))
+        err = MP4E_recover(mux, read_callback, &file, st.st_size);
+    // MP4E_close() of failed recovery would write an empty index over the first 'mdat'
+    if (err)
+        file.discard = 1;
+    if (mux && MP4E_close(mux) != MP4E_STATUS_OK && !err)
+        err = MP4E_STATUS_FILE_WRITE_ERROR;
+    if (!err && ftruncate(file.fd, file.end))
+        err = MP4E_STATUS_FILE_WRITE_ERROR;
+    if (err)
+        log_error("recovery failed: %d", err);
+    else
+        log_info("%s recovered, %lld of %lld bytes", argv[1], (long long)file.end, (long long)st.st_size);
+
+    MP4D_close(&ref);
+    free(journal);
+    close(file.fd);
+    if (ref_file.fd >= 0)
+        close(ref_file.fd);
+    return err ? 1 : 0;
+}
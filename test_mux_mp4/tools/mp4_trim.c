@@ -0,0 +1,129 @@
+/**
+ *   mp4_trim: cut [t0, t1] clip from MP4 file at key frames, without re-encoding
+ *
+ *   usage: mp4_trim <in.mp4> <out.mp4> <t0_ms> <t1_ms>
+ *   t1_ms of 0 cuts to the end of the file
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../thirdparty/minimp4/include/minimp4.h"
+#include "../thirdparty/log/log.h"
+
+typedef struct
+{
+    int fd_in;
+    int fd_out;
+} trim_files_t;
+
+static int read_callback(int64_t offset, void *buffer, size_t size, void *token)
+{
+    trim_files_t *files = (trim_files_t *)token;
+    while (size)
+    {
+        ssize_t n = pread(files->fd_in, buffer, size, offset);
+        if (n <= 0)
+            return 1;
+        buffer = (char *)buffer + n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int write_callback(int64_t offset, const void *buffer, size_t size, void *token)
+{
+    trim_files_t *files = (trim_files_t *)token;
+    while (size)
+    {
+        ssize_t n = pwrite(files->fd_out, buffer, size, offset);
+        if (n <= 0)
+            return 1;
+        buffer = (const char *)buffer + n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ *   Copy clip payload range file to file, kernel side where supported
+ */
+static int copy_callback(int64_t src_offset, int64_t dst_offset, size_t size, void *token)
+{
+    trim_files_t *files = (trim_files_t *)token;
+    loff_t src = src_offset, dst = dst_offset;
+    while (size)
+    {
+        ssize_t n = copy_file_range(files->fd_in, &src, files->fd_out, &dst, size, 0);
+        if (n <= 0)
+        {
+            // e.g. EXDEV on old kernels: plain copy of the rest
+            char buf[65536];
+            size_t chunk = size < sizeof(buf) ? size : sizeof(buf);
+            if (read_callback(src, buf, chunk, token) || write_callback(dst, buf, chunk, token))
+                return 1;
+            n = (ssize_t)chunk;
+            src += n;
+            dst += n;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    trim_files_t files = { -1, -1 };
+    MP4D_demux_t mp4;
+    MP4E_mux_t *mux;
+    struct stat st;
+    int err;
+
+    if (argc < 5)
+    {
+        printf("usage: %s <in.mp4> <out.mp4> <t0_ms> <t1_ms>\n", argv[0]);
+        return 1;
+    }
+    files.fd_in = open(argv[1], O_RDONLY);
+    if (files.fd_in < 0 || fstat(files.fd_in, &st))
+    {
+        log_error("can't open %s", argv[1]);
+        return 1;
+    }
+    memset(&mp4, 0, sizeof(mp4));
+    if (!MP4D_open(&mp4, read_callback, &files, st.st_size))
+    {
+        log_error("can't parse %s", argv[1]);
+        close(files.fd_in);
+        return 1;
+    }
+    files.fd_out = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (files.fd_out < 0)
+    {
+        log_error("can't create %s", argv[2]);
+        MP4D_close(&mp4);
+        close(files.fd_in);
+        return 1;
+    }
+
+    mux = MP4E_open(0, 0, &files, write_callback);
+    err = MP4E_trim(&mp4, mux, strtoull(argv[3], NULL, 10), strtoull(argv[4], NULL, 10), copy_callback, &files);
+    if (MP4E_close(mux) != MP4E_STATUS_OK && !err)
+        err = MP4E_STATUS_FILE_WRITE_ERROR;
+    if (err)
+        log_error("trim failed: %d", err);
+    else
+        log_info("%s [%s, %s] ms -> %s", argv[1], argv[3], argv[4], argv[2]);
+
+    MP4D_close(&mp4);
+    close(files.fd_out);
+    close(files.fd_in);
+    return err ? 1 : 0;
+}
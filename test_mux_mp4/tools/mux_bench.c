@@ -0,0 +1,145 @@
+/**
+ *   mux_bench: record several simulated cameras at once to see how many streams
+ *   one box can mux. Each camera is its own simulator instance and pipeline;
+ *   with the virtual clock frames come as fast as the pipeline takes them
+ *
+ *   usage: mux_bench [-n streams] [-t seconds] [-s queue|mmap|direct] [-r] <video.h264> <audio.aac> <out_dir>
+ *   with -r, cameras run in real time instead. -s: file sink of the pipelines
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../thirdparty/codec_sim/ipc.h"
+#include "../thirdparty/pipeline/pipeline.h"
+#include "../thirdparty/log/log.h"
+
+#define BENCH_MAX_STREAMS 64
+#define BENCH_FPS 30
+#define BENCH_AUDIO_RATE 48000
+
+typedef struct
+{
+    ipc_dev_t *dev;
+    pipeline_t *pipeline;
+    ipc_param_t param;
+    char path[512];
+} bench_stream_t;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static bench_stream_t stream[BENCH_MAX_STREAMS];
+    const char *prog = argv[0];
+    static const char *sinks[] = {"queue", "mmap", "direct", NULL}; // by PIPELINE_SINK_*
+    int streams = 4, seconds = 10, real_time = 0, sink = PIPELINE_SINK_QUEUE, i, started = 0;
+    unsigned video = 0, audio = 0;
+    int64_t bytes = 0;
+    double t0, elapsed;
+
+    while (argc > 2 && argv[1][0] == '-')
+    {
+        if (!strcmp(argv[1], "-r"))
+        {
+            real_time = 1;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (!strcmp(argv[1], "-n"))
+            streams = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-t"))
+            seconds = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-s"))
+        {
+            for (sink = 0; sinks[sink] && strcmp(argv[2], sinks[sink]); sink++)
+                ;
+        }
+        else
+            break;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 4 || streams <= 0 || streams > BENCH_MAX_STREAMS || seconds <= 0 || !sinks[sink])
+    {
+        printf("usage: %s [-n streams] [-t seconds] [-s queue|mmap|direct] [-r] <video.h264> <audio.aac> <out_dir>\n",
+               prog);
+        return 1;
+    }
+    log_set_level(LOG_INFO);
+    log_set_async(true); // capture threads log without waiting for stderr
+
+    t0 = bench_now();
+    for (i = 0; i < streams; i++)
+    {
+        bench_stream_t *s = stream + i;
+        pipeline_param_t record =
+            {
+                .path = s->path,
+                .sequential_mode = 1,
+                .width = 1920,
+                .height = 1080,
+                .video_fps = BENCH_FPS,
+                .audio_rate = BENCH_AUDIO_RATE,
+                .audio_channels = 1,
+                .max_delay_ms = 500,
+                .sink = sink,
+                .stop_ms = seconds * 1000,
+            };
+        snprintf(s->path, sizeof(s->path), "%s/bench_%02d.mp4", argv[3], i);
+        s->param.audio_codec = AUDIO_AAC;
+        s->param.video_codec = H264;
+        s->param.video_fps = BENCH_FPS;
+        s->param.audio_sample = BENCH_AUDIO_RATE;
+        s->param.video_file = argv[1];
+        s->param.audio_file = argv[2];
+        s->param.virtual_clock = !real_time;
+        s->dev = ipc_dev_new(&sim_ipc);
+        s->pipeline = pipeline_create(&record);
+        if (!s->dev || !s->pipeline || pipeline_start_dev(s->pipeline, s->dev, &s->param))
+        {
+            log_error("can't start stream %d", i);
+            break;
+        }
+        started++;
+    }
+
+    // all streams have the same stop time
+    for (i = 0; i < started; i++)
+        pipeline_wait(stream[i].pipeline);
+    for (i = 0; i < streams; i++)
+    {
+        pipeline_stats_t st;
+        if (stream[i].pipeline)
+        {
+            pipeline_stats(stream[i].pipeline, &st);
+            video += st.video_frames;
+            audio += st.audio_frames;
+            if (pipeline_close(stream[i].pipeline))
+                log_error("stream %d failed", i);
+        }
+        ipc_dev_free(stream[i].dev);
+    }
+    elapsed = bench_now() - t0;
+    for (i = 0; i < started; i++)
+    {
+        FILE *f = fopen(stream[i].path, "rb");
+        if (f)
+        {
+            fseek(f, 0, SEEK_END);
+            bytes += ftell(f);
+            fclose(f);
+        }
+    }
+
+    printf("%s sink, %d streams, %.2f s: %u video (%.0f/s), %u audio frames, %.1f MB/s, %.1fx real time per stream\n",
+           sinks[sink], started, elapsed, video, video / elapsed, audio, bytes / elapsed / 1e6,
+           started ? video / elapsed / started / BENCH_FPS : 0.0);
+    return started == streams ? 0 : 1;
+}
@@ -64,15 +64,14 @@ int main()
 
     while (1)
     {
-        av_frame_size = av_max_frame_size;
-        memset(av_frame, 0, av_max_frame_size);
+        av_frame_size = av_max_frame_size; // reader overwrites only av_frame_size bytes, no clear needed
 
         usleep((int)((1.0 / VIDEO_FPS) * 100000));
 
         ret = H264FileReaderGetFrame(pH264Reader, av_frame, &av_frame_size);
-        if (ret == 0)
+        if (ret <= 0)
         {
-            printf("No data to read\n");
+            printf(ret ? "Can't read frame\n" : "No data to read\n");
             break;
         }
 
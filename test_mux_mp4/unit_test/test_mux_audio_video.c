@@ -1,106 +1,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <unistd.h>
-#include "../thirdparty/codec_sim/ipc.h"
 
-#include "../thirdparty/minimp4/include/minimp4.h"
 #include "../thirdparty/codec_sim/ipc.h"
 #include "../thirdparty/log/log.h"
-
-#include "../thirdparty/libAACdec/include/aacdecoder_lib.h"
-#include "../thirdparty/libAACenc/include/aacenc_lib.h"
+#include "../thirdparty/mp4sink/mp4sink.h"
+#include "../thirdparty/mp4mux/mp4mux.h"
+#include "../thirdparty/pipeline/pipeline.h"
 
 #define VIDEO_FPS 30
 #define AUDIO_RATE 48000
+#define MUX_MAX_DELAY_MS 500
+#define RECORD_FRAMES 1000
+#define RECORD_ON_MOTION 0 // 1 - record a segment per motion event instead of one file
+#define PREROLL_MS 5000
+#define POSTROLL_MS 3000
+#define JOURNAL_MS 1000 // index journal checkpoints, for mp4_recover -j after power loss
 
-typedef struct MP4_mux_ctx
-{
-    MP4E_mux_t *mp4_mux;
-    FILE *mp4_file;
-    mp4_h26x_writer_t mp4wr;
-    int audio_track_id;
-    int sequential_mode;    // 1
-    int fragmentation_mode; // 0
-    int is_hevc;            // use for h265
-    int count_frame_in_video;
-    int count_frame_in_audio;
-    int audio_track_num;
-} MP4_mux_ctx_t;
-
-static MP4_mux_ctx_t *mux_ctx = NULL;
-
-static int write_callback(int64_t offset, const void *buffer, size_t size, void *token)
-{
-    FILE *f = (FILE *)token;
-    fseek(f, offset, SEEK_SET);
-    return fwrite(buffer, 1, size, f) != size;
-}
-
-static void stop_mux(void)
-{
-    
-    MP4E_close(mux_ctx->mp4_mux);
-    mp4_h26x_write_close(&mux_ctx->mp4wr);
-    if(mux_ctx->mp4_file != NULL){
-        fclose(mux_ctx->mp4_file);
-        log_debug("closed mp4 file\n");
-    }
-    if(mux_ctx != NULL){
-        free(mux_ctx);
-        log_debug("free buffer\n");
-    }
-    log_info("=============> Stop mux mp4");
-}
-
-static int VideoFrameCallBack(uint8_t *frame, int len, int iskey, int64_t timestamp)
-{
-    log_debug("Timestamp: %ld , frame VIDEO len: %d , is key frame: %d", timestamp, len, iskey);
-
-    if (MP4E_STATUS_OK != mp4_h26x_write_nal(&mux_ctx->mp4wr, frame, len, 90000/VIDEO_FPS))
-    {
-        log_error("mp4_h26x_write_nal failed");
-        return -1;
-    }
-    else
-    {
-        log_debug("h26x_write_nal OK");
-    }
-
-    if(len == -1){
-        stop_mux();
-        return -1;
-    }
-    mux_ctx->count_frame_in_video++;
-    log_debug("=============> count = %d\n", mux_ctx->count_frame_in_video);
-    //sleep(1);
-
-    return 0;
-}
+static pipeline_t *recorder = NULL;
 
-static int AudioFrameCallBack(uint8_t *frame, int len, int64_t timestamp)
+static void on_signal(int sig)
 {
-    
-    log_debug("Timestamp: %ld , frame AUDIO len: %d", timestamp, len);
-    if(MP4E_STATUS_OK != MP4E_put_sample(mux_ctx->mp4_mux, mux_ctx->audio_track_num, frame,
-                              len, 1024*90000/AUDIO_RATE, MP4E_SAMPLE_DEFAULT))
-    {
-        log_error("Put audio sample failed\n");
-        return -1;
-    }
-    else
-    {
-        log_debug("Put audio sample OK\n");
-    }
-    //sleep(1);
-    mux_ctx->count_frame_in_audio++;
-    log_debug("=============> count = %d\n", mux_ctx->count_frame_in_audio);
-    return 0;
+    (void)sig;
+    pipeline_stop(recorder);
 }
 
 int main()
 {
     log_set_level(LOG_DEBUG);
+    log_set_async(true); // capture threads log without waiting for stderr
 
     ipc_dev_register(&sim_ipc); // Please run this function before run other function !
 
@@ -108,79 +38,62 @@ int main()
         {
             .audio_codec = AUDIO_AAC,
             .video_codec = H264,
-            .video_fps = 30,
-            .audio_sample = 48000,                  // Don't need set this param, program auto define base on audio file
+            .video_fps = VIDEO_FPS,
+            .audio_sample = AUDIO_RATE,             // Don't need set this param, program auto define base on audio file
             .video_file = "/home/ndp/Documents/workspace/test_mux_mp4/demux_output_file/test_demux.h264", // Test with big_file becase this file have many I frame
             .audio_file = "/home/ndp/Documents/workspace/test_mux_mp4/test_file/aac-sample.aac",
             .pic_file = NULL,
-            .video_cb = VideoFrameCallBack,
-            .audio_cb = AudioFrameCallBack,
+            .video_cb = NULL,                       // set by pipeline_start()
+            .audio_cb = NULL,
             .event_cb = NULL,
         };
 
-    ipc_init(&param);
-    ipc_run();
-
-    /* Init mp4 context */
-    mux_ctx = (MP4_mux_ctx_t *)malloc(sizeof(MP4_mux_ctx_t));
-    if (mux_ctx == NULL)
-    {
-        log_error("Can't malloc mux_ctx");
-        return -1;
-    }
-
-    mux_ctx->sequential_mode = 1;
-    mux_ctx->fragmentation_mode = 0;
-    mux_ctx->is_hevc = 0;
-    mux_ctx->mp4_mux = NULL;
-    mux_ctx->mp4_file = NULL;
+    pipeline_param_t record =
+        {
+            .path = RECORD_ON_MOTION ? "/home/ndp/Documents/workspace/test_mux_mp4/test_file/event_%03u.mp4"
+                                     : "/home/ndp/Documents/workspace/test_mux_mp4/test_file/test.mp4",
+            .sequential_mode = 1,
+            .fragmentation_mode = 0,
+            .is_hevc = 0,                           // use for h265
+            .width = 1920,
+            .height = 1080,
+            .video_fps = VIDEO_FPS,
+            .audio_rate = AUDIO_RATE,
+            .audio_channels = 1,
+            .ring_size = MP4MUX_RING_SIZE,
+            .max_delay_ms = MUX_MAX_DELAY_MS,
+            .sink_depth = MP4SINK_QUEUE_DEPTH,
+            .journal_ms = JOURNAL_MS,
+            .stop_frames = RECORD_FRAMES,
+            .event_mode = RECORD_ON_MOTION,
+            .preroll_ms = PREROLL_MS,
+            .preroll_bytes = PIPELINE_PREROLL_BYTES,
+            .postroll_ms = POSTROLL_MS,
+        };
 
-    mux_ctx->mp4_file = fopen("/home/ndp/Documents/workspace/test_mux_mp4/test_file/test.mp4", "wb");
-    if (mux_ctx->mp4_file == NULL)
+    recorder = pipeline_create(&record);
+    if (recorder == NULL)
     {
-        log_error("Can't open file mp4");
+        log_error("Can't create recorder");
         return -1;
     }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
 
-    mux_ctx->mp4_mux = MP4E_open(mux_ctx->sequential_mode, mux_ctx->fragmentation_mode, mux_ctx->mp4_file, write_callback);
-    if (mux_ctx->mp4_mux != NULL)
-    {
-        log_debug("Create mp4 file ok\n");
-    }
-
-    MP4E_track_t tr;
-    tr.track_media_kind = e_audio;
-    tr.language[0] = 'u';
-    tr.language[1] = 'n';
-    tr.language[2] = 'd';
-    tr.language[2] = 0;
-    tr.object_type_indication = MP4_OBJECT_TYPE_AUDIO_ISO_IEC_14496_3;
-    tr.time_scale = 90000;
-    tr.default_duration = 0;
-    tr.u.a.channelcount = 1;
-
-    mux_ctx->audio_track_num = MP4E_add_track(mux_ctx->mp4_mux, &tr);
-    //MP4E_set_dsi(mux_ctx->mp4_mux, audio_track_num, info.confBuf, info.confSize);
-
-    if (MP4E_STATUS_OK != mp4_h26x_write_init(&mux_ctx->mp4wr, mux_ctx->mp4_mux, 1920, 1080, mux_ctx->is_hevc))
+    if (pipeline_start(recorder, &param))
     {
-        log_error("mp4_h26x_write_init failed");
+        log_error("pipeline_start failed");
+        pipeline_close(recorder);
         return -1;
     }
-    else
-        log_info("init mp4_h26x_write_init ok");
+    log_info("=============> Start mux mp4");
 
-    while (mux_ctx->count_frame_in_video < 1000)
-    {
-        //log_info("=================> Count frame: %d", mux_ctx->count_frame_in_video);
-        //sleep(1);
-    }
-    
+    // sleeps until RECORD_FRAMES video frames are recorded or Ctrl+C
+    pipeline_wait(recorder);
 
-    stop_mux();
-    log_debug("%d", mux_ctx->count_frame_in_video);
-    log_debug("%d", mux_ctx->count_frame_in_audio);
-    
+    if (pipeline_close(recorder))
+        log_error("recording failed");
+    log_info("=============> Stop mux mp4");
 
     return 0;
 }